@@ -64,10 +64,21 @@ int Application::Execute()
 		m_Timer.Tick();
 		CalculateFramesPerSecond();
 
+#ifdef _DEBUG
+		HeapCounter::Reset();
+		HeapCounter::SetEnabled(true);
+#endif
+
 		m_EventDispatcher->Poll();
 		Update(static_cast<float>(m_Timer.DeltaTime()));
 		Render();
 
+#ifdef _DEBUG
+		HeapCounter::SetEnabled(false);
+		m_HeapAllocations = HeapCounter::GetCount();
+#endif
+
+		m_FrameArena.NextFrame();
 		ChangeRenderAPI();
 	}
 
@@ -91,7 +102,7 @@ void Application::CalculateFramesPerSecond()
 
 void Application::Update(float dt)
 {
-	m_Model->Update(dt);
+	m_Model->Update(dt, m_FrameArena);
 }
 
 bool Application::Init()
@@ -110,8 +121,6 @@ bool Application::Init()
 		return false;
 	}
 
-	m_Renderer->ToggleWireframe(m_Wireframe);
-
 	// Setup ImGui
 	if (!Gui::Init(m_Window.get(), m_Renderer.get()))
 	{
@@ -133,6 +142,12 @@ bool Application::Init()
 		return false;
 	}
 
+	m_Model->SetPoseEvaluation(m_PoseEvaluation);
+	m_Model->SetSkinningMode(m_SkinningMode);
+	m_Model->SetPaused(m_AnimationPaused);
+	PlaceInstances();
+	m_FrameDataVersion.reset();
+
 	QueryHardwareInfo();
 	m_DxCamera->SetRadius(m_Radius);
 	m_DxCamera->SetPitchAndYaw(m_Pitch, m_Yaw);
@@ -172,19 +187,78 @@ bool Application::Init()
 
 	int max_anisotropic_filtering = m_Renderer->GetMaxAnisotropicFilterLevel();
 	m_CurrentTextureFilterLevel = "x" + std::to_string(max_anisotropic_filtering);
-	m_Renderer->SetAnisotropicFilter(max_anisotropic_filtering);
+	m_TextureFilterLevel = max_anisotropic_filtering;
 	m_Renderer->SetVync(m_Vsync);
 
+	CreatePipelineState();
+
 	return true;
 }
 
+void Application::PlaceInstances()
+{
+	auto columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(m_InstanceCount))));
+	auto centre = (columns - 1) * m_InstanceSpacing * 0.5f;
+
+	std::vector<DirectX::XMFLOAT4X4> transforms(m_InstanceCount);
+	for (int i = 0; i < m_InstanceCount; ++i)
+	{
+		auto x = (i % columns) * m_InstanceSpacing - centre;
+		auto z = (i / columns) * m_InstanceSpacing - centre;
+		DirectX::XMStoreFloat4x4(&transforms[i], DirectX::XMMatrixTranslation(x, 0.0f, z));
+	}
+
+	m_Model->SetInstances(transforms);
+}
+
+void Application::CreatePipelineState()
+{
+	PipelineStateDesc desc;
+	desc.shader = m_Shader.get();
+	desc.wireframe = m_Wireframe;
+	desc.anisotropicFilterLevel = m_TextureFilterLevel;
+
+	m_PipelineState = m_Renderer->CreatePipelineState(desc);
+}
+
 void Application::Render()
 {
 	// Clear the screen
+	m_Renderer->ResetStateChanges();
 	m_Renderer->Clear();
 
-	// Apply shader data
-	m_Shader->Use();
+	// Apply pipeline state and shader data
+	m_Renderer->ApplyPipelineState(m_PipelineState.get());
+	m_Shader->ResetUploads();
+	m_Shader->BeginFrame();
+
+	// Camera and light buffers. The shader skips the upload when the data has not changed
+	UpdateFrameData();
+	m_Shader->UpdateWorld(m_WorldData);
+	m_Shader->UpdateLights(m_LightData);
+
+	// Render the models
+	m_Model->Render(m_DxCamera.get());
+	m_Shader->EndFrame();
+
+	// Render the GUI
+	RenderGui();
+
+	// Draw to the screen
+	m_Renderer->Present();
+}
+
+void Application::UpdateFrameData()
+{
+	m_FrameDataUpdates = {};
+	if (m_FrameDataVersion == m_DxCamera->GetVersion())
+	{
+		++m_FrameDataUpdates.skipped;
+		return;
+	}
+
+	m_FrameDataVersion = m_DxCamera->GetVersion();
+	++m_FrameDataUpdates.performed;
 
 	// Camera buffer
 	ShaderData::ShaderMaterial material = {};
@@ -192,16 +266,13 @@ void Application::Render()
 	material.mAmbient = DirectX::XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	material.mSpecular = DirectX::XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 
-	ShaderData::WorldBuffer cb = {};
 	auto world = DirectX::XMMatrixIdentity();
-	cb.world = DirectX::XMMatrixTranspose(world);
-	cb.view = DirectX::XMMatrixTranspose(m_DxCamera->GetView());
-	cb.projection = DirectX::XMMatrixTranspose(m_DxCamera->GetProjection());
-	cb.worldInverse = DirectX::XMMatrixInverse(nullptr, world);
-	cb.texture = DirectX::XMMatrixIdentity();
-	cb.mMaterial = material;
-
-	m_Shader->UpdateWorld(cb);
+	m_WorldData.world = DirectX::XMMatrixTranspose(world);
+	m_WorldData.view = DirectX::XMMatrixTranspose(m_DxCamera->GetView());
+	m_WorldData.projection = DirectX::XMMatrixTranspose(m_DxCamera->GetProjection());
+	m_WorldData.worldInverse = DirectX::XMMatrixInverse(nullptr, world);
+	m_WorldData.texture = DirectX::XMMatrixIdentity();
+	m_WorldData.mMaterial = material;
 
 	// Light Buffer
 	auto diffuse = DirectX::XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
@@ -209,23 +280,12 @@ void Application::Render()
 	auto specular = DirectX::XMFLOAT4(0.1f, 0.1f, 0.1f, 32.0f);
 	auto direction = DirectX::XMFLOAT4(-0.8f, -0.5f, 0.5f, 1.0f);
 
-	ShaderData::LightBuffer lightBuffer = {};
-	lightBuffer.mDirectionalLight.mCameraPos = m_DxCamera->GetPosition();
-	lightBuffer.mDirectionalLight.mDiffuse = diffuse;
-	lightBuffer.mDirectionalLight.mAmbient = ambient;
-	lightBuffer.mDirectionalLight.mSpecular = specular;
-	lightBuffer.mDirectionalLight.mDirection = direction;
-
-	m_Shader->UpdateLights(lightBuffer);
-
-	// Render the models
-	m_Model->Render(m_DxCamera.get());
-
-	// Render the GUI
-	RenderGui();
-
-	// Draw to the screen
-	m_Renderer->Present();
+	m_LightData = {};
+	m_LightData.mDirectionalLight.mCameraPos = m_DxCamera->GetPosition();
+	m_LightData.mDirectionalLight.mDiffuse = diffuse;
+	m_LightData.mDirectionalLight.mAmbient = ambient;
+	m_LightData.mDirectionalLight.mSpecular = specular;
+	m_LightData.mDirectionalLight.mDirection = direction;
 }
 
 void Application::RenderGui()
@@ -243,31 +303,69 @@ void Application::RenderGui()
 	ImGui::SetNextWindowPos(ImVec2(0 + distance, 0 + distance), ImGuiCond_Always);
 	if (ImGui::Begin("FPS Display", &open, ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoFocusOnAppearing | ImGuiWindowFlags_NoNav))
 	{
+		// Text is formatted by ImGui into its own buffer so the overlay does not allocate each frame
+
 		// Display FPS
-		std::string fps = "FPS: " + std::to_string(m_FramesPerSecond) + " - " + std::to_string(1000.0f / m_FramesPerSecond) + " ms";
-		ImGui::Text(fps.c_str());
+		ImGui::Text("FPS: %d - %f ms", m_FramesPerSecond, 1000.0f / m_FramesPerSecond);
 
 		// Display CPU name
-		ImGui::Text(m_CpuName.c_str());
+		ImGui::TextUnformatted(m_CpuName.c_str());
 
 		// Display device name
-		ImGui::Text(m_GpuName.c_str());
+		ImGui::TextUnformatted(m_GpuName.c_str());
 
 		// Display system RAM
-		ImGui::Text(m_RamAmount.c_str());
+		ImGui::TextUnformatted(m_RamAmount.c_str());
 
 		// Display video RAM
-		ImGui::Text(m_VideoRamAmount.c_str());
+		ImGui::TextUnformatted(m_VideoRamAmount.c_str());
 
 		// Camera
-		auto pitch = "Pitch: " + std::to_string(m_Pitch);
-		ImGui::Text(pitch.c_str());
+		ImGui::Text("Pitch: %f", m_Pitch);
+		ImGui::Text("Yaw: %f", m_Yaw);
+		ImGui::Text("Field of view: %d", static_cast<int>(m_Fov));
+
+		// Animation
+		ImGui::Text("Pose: %f ns per bone", m_Model->GetPoseTimePerBone());
+
+		// Updates skipped because nothing changed
+		auto pose_updates = m_Model->GetPoseUpdates();
+		auto uploads = m_Shader->GetUploads();
+		ImGui::Text("Updates: pose %u/%u, frame data %u/%u, uploads %u/%u (done/skipped)", pose_updates.performed, pose_updates.skipped,
+			m_FrameDataUpdates.performed, m_FrameDataUpdates.skipped, uploads.performed, uploads.skipped);
+		ImGui::Text("Uploaded: %.1f KB per frame", m_Shader->GetUploadedBytes() / 1024.0);
+
+		// Draw submission
+		auto draw_stats = m_Model->GetDrawStats();
+		ImGui::Text("Draws: %u subsets in %u batches, submitted in %.3f ms", draw_stats.subsets, draw_stats.batches, draw_stats.submitTime);
+		ImGui::Text("Culling: %u tested, %u culled in %.3f ms (%s)", draw_stats.tested, draw_stats.culled, draw_stats.cullTime,
+			Simd::GetPathName(Simd::GetBestPath()));
+		ImGui::Text("Occlusion: %u occluder triangles in %.3f ms, %u hidden", draw_stats.occluderTriangles, draw_stats.rasterTime, draw_stats.occluded);
+
+		// Triangles drawn at each level of detail, against those of one instance at that level
+		auto lod_triangles = m_Model->GetLodTriangleCounts();
+		ImGui::Text("LOD triangles (drawn/model):");
+		for (auto lod = 0u; lod < MaxSubsetLods; ++lod)
+		{
+			ImGui::SameLine();
+			ImGui::Text("%u: %u/%u", lod, draw_stats.lodTriangles[lod], lod_triangles[lod]);
+		}
+
+		ImGui::Text("Meshlets: %u tested, %u outside, %u back-facing", draw_stats.meshletsTested, draw_stats.meshletsOutside, draw_stats.meshletsBackFacing);
 
-		auto yaw = "Yaw: " + std::to_string(m_Yaw);
-		ImGui::Text(yaw.c_str());
+		// Redundant binds dropped by the renderer
+		auto state_changes = m_Renderer->GetStateChanges();
+		ImGui::Text("State changes: %u issued, %u filtered", state_changes.issued, state_changes.filtered);
 
-		auto fov = "Field of view: " + std::to_string(static_cast<int>(m_Fov));
-		ImGui::Text(fov.c_str());
+		// Bounds of the current pose of every instance
+		auto& bounds = m_Model->GetBounds();
+		ImGui::Text("Bounds: %.2f x %.2f x %.2f", bounds.Extents.x * 2.0f, bounds.Extents.y * 2.0f, bounds.Extents.z * 2.0f);
+
+		// Memory
+		ImGui::Text("Frame arena: %zu KB", m_FrameArena.GetUsed() / 1024);
+#ifdef _DEBUG
+		ImGui::Text("Heap allocations: %zu per frame", m_HeapAllocations);
+#endif
 	}
 
 	ImGui::End();
@@ -314,7 +412,7 @@ void Application::RenderGui()
 		// Wireframe
 		if (ImGui::Checkbox("Wireframe (Press 1)", &m_Wireframe))
 		{
-			m_Renderer->ToggleWireframe(m_Wireframe);
+			CreatePipelineState();
 		}
 
 		// Camera
@@ -333,7 +431,8 @@ void Application::RenderGui()
 					int level = 0;
 					auto substr = x.substr(1, x.size() - 1);
 					level = std::stoi(substr);
-					m_Renderer->SetAnisotropicFilter(level);
+					m_TextureFilterLevel = level;
+					CreatePipelineState();
 				}
 			}
 
@@ -346,6 +445,69 @@ void Application::RenderGui()
 			m_Renderer->SetVync(m_Vsync);
 		}
 
+		// Pose evaluation
+		auto current_pose_evaluation = static_cast<int>(m_PoseEvaluation);
+		const char* pose_evaluation_items[] = { "Reference", "Batched Slerp", "Batched Nlerp" };
+		if (ImGui::Combo("Pose Evaluation", &current_pose_evaluation, pose_evaluation_items, IM_ARRAYSIZE(pose_evaluation_items)))
+		{
+			m_PoseEvaluation = static_cast<PoseEvaluation>(current_pose_evaluation);
+			m_Model->SetPoseEvaluation(m_PoseEvaluation);
+		}
+
+		// Skinning
+		auto current_skinning_mode = static_cast<int>(m_SkinningMode);
+		const char* skinning_mode_items[] = { "Matrix", "Dual Quaternion" };
+		if (ImGui::Combo("Skinning", &current_skinning_mode, skinning_mode_items, IM_ARRAYSIZE(skinning_mode_items)))
+		{
+			m_SkinningMode = static_cast<SkinningMode>(current_skinning_mode);
+			m_Model->SetSkinningMode(m_SkinningMode);
+		}
+
+		if (ImGui::Checkbox("Pause Animation", &m_AnimationPaused))
+		{
+			m_Model->SetPaused(m_AnimationPaused);
+		}
+
+		// Culling
+		if (ImGui::Checkbox("Frustum Culling", &m_FrustumCulling))
+		{
+			m_Model->SetFrustumCulling(m_FrustumCulling);
+		}
+
+		if (ImGui::Checkbox("Occlusion Culling", &m_OcclusionCulling))
+		{
+			m_Model->SetOcclusionCulling(m_OcclusionCulling);
+		}
+
+		if (ImGui::Checkbox("Level of Detail", &m_LevelOfDetail))
+		{
+			m_Model->SetLevelOfDetail(m_LevelOfDetail);
+		}
+
+		if (ImGui::Checkbox("Meshlet Culling", &m_MeshletCulling))
+		{
+			m_Model->SetMeshletCulling(m_MeshletCulling);
+		}
+
+		if (ImGui::Button("Culling Benchmark"))
+		{
+			Culling::Benchmark(100000);
+		}
+
+		ImGui::SameLine();
+		if (ImGui::Button("Occlusion Benchmark"))
+		{
+			OcclusionBuffer::Benchmark();
+		}
+
+		// Instances
+		auto instances_changed = ImGui::SliderInt("Instances", &m_InstanceCount, 1, 1024);
+		instances_changed |= ImGui::SliderFloat("Instance Spacing", &m_InstanceSpacing, 0.5f, 10.0f);
+		if (instances_changed)
+		{
+			PlaceInstances();
+		}
+
 		ImGui::PopItemWidth();
 		ImGui::End();
 	}
@@ -371,6 +533,7 @@ void Application::ChangeRenderAPI()
 		m_Window.reset();
 		m_Renderer.reset();
 		m_Model.reset();
+		m_PipelineState.reset();
 		m_Shader.reset();
 		m_DxCamera.reset();
 
@@ -514,7 +677,7 @@ void Application::OnKeyPressed(SDL_Scancode scancode)
 	if (scancode == SDL_SCANCODE_1 || scancode == SDL_SCANCODE_KP_1)
 	{
 		m_Wireframe = !m_Wireframe;
-		m_Renderer->ToggleWireframe(m_Wireframe);
+		CreatePipelineState();
 	}
 }
 
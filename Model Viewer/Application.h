@@ -4,6 +4,8 @@
 #include "Timer.h"
 #include "Shader.h"
 #include "Camera.h"
+#include "Model.h"
+#include "FrameArena.h"
 
 // Forward declarions
 class Window;
@@ -40,6 +42,12 @@ private:
 	int m_FramesPerSecond = 0;
 	void CalculateFramesPerSecond();
 
+	// Transient per frame allocations
+	FrameArena m_FrameArena;
+#ifdef _DEBUG
+	size_t m_HeapAllocations = 0;
+#endif
+
 	// Window
 	std::unique_ptr<Window> m_Window = nullptr;
 
@@ -51,6 +59,10 @@ private:
 	std::unique_ptr<IShader> m_Shader = nullptr;
 	std::unique_ptr<IModel> m_Model = nullptr;
 
+	// Pipeline state, rebuilt when the wireframe or texture filtering settings change
+	void CreatePipelineState();
+	std::unique_ptr<PipelineState> m_PipelineState = nullptr;
+
 
 	std::unique_ptr<Camera> m_DxCamera = nullptr;
 
@@ -81,12 +93,36 @@ private:
 	std::vector<std::string> m_AntiAliasingLevelsText;
 
 	// Texture filtering GUI
+	int m_TextureFilterLevel = 1;
 	std::string m_CurrentTextureFilterLevel;
 	std::vector<std::string> m_TextureFilteringLevelsText;
 
 	// Vsync
 	bool m_Vsync = false;
 
+	// Animation
+	PoseEvaluation m_PoseEvaluation = PoseEvaluation::BatchedNlerp;
+	SkinningMode m_SkinningMode = SkinningMode::Matrix;
+	bool m_AnimationPaused = false;
+
+	// Culling
+	bool m_FrustumCulling = true;
+	bool m_OcclusionCulling = true;
+	bool m_LevelOfDetail = true;
+	bool m_MeshletCulling = true;
+
+	// Instances laid out in a square grid on the ground plane
+	void PlaceInstances();
+	int m_InstanceCount = 1;
+	float m_InstanceSpacing = 2.0f;
+
+	// Frame constants, rebuilt only when the camera changes
+	void UpdateFrameData();
+	ShaderData::WorldBuffer m_WorldData = {};
+	ShaderData::LightBuffer m_LightData = {};
+	std::optional<uint64_t> m_FrameDataVersion;
+	UpdateCounters m_FrameDataUpdates;
+
 	// Inherited via QuitListener
 	virtual void OnQuit() override;
 
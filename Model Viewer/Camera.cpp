@@ -13,6 +13,8 @@ void Camera::Resize(int width, int height)
 	auto fieldOfView = DirectX::XMConvertToRadians(m_FOV);
 	auto screenAspect = static_cast<float>(width) / height;
 	m_Projection = DirectX::XMMatrixPerspectiveFovLH(fieldOfView, screenAspect, 0.01f, 100.0f);
+	UpdateFrustumPlanes();
+	++m_Version;
 
 	// Keep a copy of width and height for updating the FOV
 	m_WindowWidth = width;
@@ -40,6 +42,8 @@ void Camera::SetPitchAndYaw(float pitch, float yaw)
 	auto at = DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 0.0f);
 	auto up = DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
 	m_View = DirectX::XMMatrixLookAtLH(eye, at, up);
+	UpdateFrustumPlanes();
+	++m_Version;
 }
 
 void Camera::SetFov(float fov)
@@ -52,4 +56,9 @@ void Camera::SetRadius(float radius)
 {
 	m_Radius = radius;
 	SetPitchAndYaw(m_Pitch, m_Yaw);
+}
+
+void Camera::UpdateFrustumPlanes()
+{
+	m_FrustumPlanes = Culling::ExtractFrustumPlanes(DirectX::XMMatrixMultiply(m_View, m_Projection));
 }
\ No newline at end of file
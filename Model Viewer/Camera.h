@@ -1,6 +1,7 @@
 #pragma once
 
 #include <DirectXMath.h>
+#include "Culling.h"
 
 class Camera final
 {
@@ -16,9 +17,18 @@ public:
 	// Get the projection matrix
 	constexpr DirectX::XMMATRIX GetProjection() { return m_Projection; }
 
+	// Height of the view in pixels
+	constexpr int GetHeight() { return m_WindowHeight; }
+
 	// Get the current camera position in world space
 	constexpr DirectX::XMFLOAT3 GetPosition() { return m_Position; }
 
+	// World space planes of the view frustum
+	constexpr const FrustumPlanes& GetFrustumPlanes() { return m_FrustumPlanes; }
+
+	// Changes whenever the view or projection changes
+	constexpr uint64_t GetVersion() { return m_Version; }
+
 	// Set pitch and yaw
 	void SetPitchAndYaw(float pitch, float yaw);
 
@@ -29,9 +39,14 @@ public:
 	void SetRadius(float radius);
 
 private:
+	// Extracts the frustum planes again after the view or projection changes
+	void UpdateFrustumPlanes();
+
 	DirectX::XMFLOAT3 m_Position;
-	DirectX::XMMATRIX m_View;
+	DirectX::XMMATRIX m_View = DirectX::XMMatrixIdentity();
 	DirectX::XMMATRIX m_Projection;
+	FrustumPlanes m_FrustumPlanes;
+	uint64_t m_Version = 0;
 
 	// Window size
 	int m_WindowWidth = 0;
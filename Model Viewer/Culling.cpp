@@ -0,0 +1,165 @@
+#include "Pch.h"
+#include "Culling.h"
+#include <random>
+#include <limits>
+
+namespace
+{
+	// Tests objects [begin, end) in groups of Lanes::Width, leaving any remainder to the caller.
+	// An object is inside a plane while its distance is no further out than the smaller of its
+	// sphere radius and its box's projected extent. Returns the first object not tested
+	template <typename Lanes>
+	size_t CullRange(const FrustumPlanes& planes, const CullingBounds& bounds, size_t begin, size_t end, uint8_t* visible, size_t* visible_count)
+	{
+		using Float = typename Lanes::Float;
+
+		// Planes are splatted once, with the absolute normals the box extents are projected onto
+		Float normal_x[6], normal_y[6], normal_z[6], distance[6];
+		Float abs_x[6], abs_y[6], abs_z[6];
+		for (size_t p = 0; p < planes.size(); ++p)
+		{
+			normal_x[p] = Lanes::Set(planes[p].x);
+			normal_y[p] = Lanes::Set(planes[p].y);
+			normal_z[p] = Lanes::Set(planes[p].z);
+			distance[p] = Lanes::Set(planes[p].w);
+			abs_x[p] = Lanes::Set(std::abs(planes[p].x));
+			abs_y[p] = Lanes::Set(std::abs(planes[p].y));
+			abs_z[p] = Lanes::Set(std::abs(planes[p].z));
+		}
+
+		constexpr auto all_lanes = static_cast<unsigned>((1ull << Lanes::Width) - 1);
+		auto zero = Lanes::Set(0.0f);
+		auto i = begin;
+		for (; i + Lanes::Width <= end; i += Lanes::Width)
+		{
+			auto centre_x = Lanes::Load(&bounds.centreX[i]);
+			auto centre_y = Lanes::Load(&bounds.centreY[i]);
+			auto centre_z = Lanes::Load(&bounds.centreZ[i]);
+			auto extent_x = Lanes::Load(&bounds.extentX[i]);
+			auto extent_y = Lanes::Load(&bounds.extentY[i]);
+			auto extent_z = Lanes::Load(&bounds.extentZ[i]);
+			auto radius = Lanes::Load(&bounds.radius[i]);
+
+			auto inside = all_lanes;
+			for (size_t p = 0; p < planes.size() && inside != 0; ++p)
+			{
+				auto signed_distance = Lanes::MulAdd(centre_x, normal_x[p], Lanes::MulAdd(centre_y, normal_y[p], Lanes::MulAdd(centre_z, normal_z[p], distance[p])));
+				auto reach = Lanes::Min(radius, Lanes::MulAdd(extent_x, abs_x[p], Lanes::MulAdd(extent_y, abs_y[p], Lanes::MulAdd(extent_z, abs_z[p], zero))));
+				inside &= Lanes::Bits(Lanes::GreaterEqual(Lanes::Add(signed_distance, reach), zero));
+			}
+
+			for (size_t lane = 0; lane < Lanes::Width; ++lane)
+			{
+				visible[i + lane] = static_cast<uint8_t>((inside >> lane) & 1);
+			}
+
+			*visible_count += static_cast<size_t>(std::bitset<Lanes::Width>(inside).count());
+		}
+
+		return i;
+	}
+
+	template <typename Lanes>
+	size_t CullAll(const FrustumPlanes& planes, const CullingBounds& bounds, uint8_t* visible)
+	{
+		size_t visible_count = 0;
+		auto remainder = CullRange<Lanes>(planes, bounds, 0, bounds.Size(), visible, &visible_count);
+		CullRange<Simd::ScalarLanes>(planes, bounds, remainder, bounds.Size(), visible, &visible_count);
+		return visible_count;
+	}
+}
+
+void CullingBounds::Resize(size_t count)
+{
+	for (auto values : { &centreX, &centreY, &centreZ, &extentX, &extentY, &extentZ, &radius })
+	{
+		values->resize(count);
+	}
+}
+
+void CullingBounds::Set(size_t index, const DirectX::BoundingBox& box, float sphereRadius)
+{
+	centreX[index] = box.Center.x;
+	centreY[index] = box.Center.y;
+	centreZ[index] = box.Center.z;
+	extentX[index] = box.Extents.x;
+	extentY[index] = box.Extents.y;
+	extentZ[index] = box.Extents.z;
+	radius[index] = sphereRadius;
+}
+
+size_t Culling::Cull(const FrustumPlanes& planes, const CullingBounds& bounds, uint8_t* visible, SimdPath path)
+{
+	return Simd::Dispatch(path, [&](auto lanes)
+	{
+		return CullAll<decltype(lanes)>(planes, bounds, visible);
+	});
+}
+
+void Culling::Benchmark(size_t count)
+{
+	// Objects scattered around and behind a camera looking down z, so only some of them are visible
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> position(-50.0f, 50.0f);
+	std::uniform_real_distribution<float> size(0.1f, 1.0f);
+
+	CullingBounds bounds;
+	bounds.Resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		DirectX::BoundingBox box(DirectX::XMFLOAT3(position(random), position(random), position(random)), DirectX::XMFLOAT3(size(random), size(random), size(random)));
+		bounds.Set(i, box, DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMLoadFloat3(&box.Extents))));
+	}
+
+	auto view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(0.0f, 0.0f, -50.0f, 1.0f), DirectX::XMVectorZero(), DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	auto projection = DirectX::XMMatrixPerspectiveFovLH(DirectX::XMConvertToRadians(60.0f), 16.0f / 9.0f, 0.01f, 100.0f);
+	auto planes = ExtractFrustumPlanes(DirectX::XMMatrixMultiply(view, projection));
+
+	// Every path must agree with the scalar one
+	std::vector<uint8_t> expected(count), visible(count);
+	Cull(planes, bounds, expected.data(), SimdPath::Scalar);
+
+	for (auto path = SimdPath::Scalar; path <= Simd::GetBestPath(); path = static_cast<SimdPath>(static_cast<int>(path) + 1))
+	{
+		// Best of several runs, to keep the first touch of the data out of the result
+		auto best_time = std::numeric_limits<double>::max();
+		size_t visible_count = 0;
+		for (int run = 0; run < 10; ++run)
+		{
+			auto start_time = std::chrono::high_resolution_clock::now();
+			visible_count = Cull(planes, bounds, visible.data(), path);
+			best_time = std::min(best_time, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count());
+		}
+
+		std::cout << "Culling " << Simd::GetPathName(path) << ": " << count << " objects in " << best_time * 1000.0 << " ms ("
+			<< count / best_time / 1000000.0 << " M objects/s), " << visible_count << " visible\n";
+
+		if (visible != expected)
+		{
+			std::cerr << "Culling " << Simd::GetPathName(path) << " differs from the scalar path\n";
+		}
+	}
+}
+
+FrustumPlanes Culling::ExtractFrustumPlanes(DirectX::FXMMATRIX viewProjection)
+{
+	// With row vectors each plane is a sum or difference of the matrix's columns. Depth runs from 0 to 1
+	auto columns = DirectX::XMMatrixTranspose(viewProjection);
+	const DirectX::XMVECTOR planes[6] =
+	{
+		DirectX::XMVectorAdd(columns.r[3], columns.r[0]),
+		DirectX::XMVectorSubtract(columns.r[3], columns.r[0]),
+		DirectX::XMVectorAdd(columns.r[3], columns.r[1]),
+		DirectX::XMVectorSubtract(columns.r[3], columns.r[1]),
+		columns.r[2],
+		DirectX::XMVectorSubtract(columns.r[3], columns.r[2])
+	};
+
+	FrustumPlanes result;
+	for (size_t i = 0; i < result.size(); ++i)
+	{
+		DirectX::XMStoreFloat4(&result[i], DirectX::XMPlaneNormalize(planes[i]));
+	}
+
+	return result;
+}
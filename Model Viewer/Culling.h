@@ -0,0 +1,36 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <DirectXCollision.h>
+#include "Simd.h"
+
+// World space frustum planes as (normal, distance), normals pointing inwards
+using FrustumPlanes = std::array<DirectX::XMFLOAT4, 6>;
+
+///<summary>
+/// Bounds of many objects in structure of arrays form, so the culling
+/// kernel can test one object per SIMD lane. Each object has a box and a
+/// sphere sharing its centre, and is culled when either is outside a plane.
+///</summary>
+struct CullingBounds
+{
+	std::vector<float> centreX, centreY, centreZ;
+	std::vector<float> extentX, extentY, extentZ;
+	std::vector<float> radius;
+
+	void Resize(size_t count);
+	void Set(size_t index, const DirectX::BoundingBox& box, float sphereRadius);
+	size_t Size() const { return radius.size(); }
+};
+
+namespace Culling
+{
+	// Planes of the frustum a combined view and projection matrix sees
+	FrustumPlanes ExtractFrustumPlanes(DirectX::FXMMATRIX viewProjection);
+
+	// Writes 1 to visible[i] when object i intersects the frustum and 0 otherwise. Returns the number visible
+	size_t Cull(const FrustumPlanes& planes, const CullingBounds& bounds, uint8_t* visible, SimdPath path = Simd::GetBestPath());
+
+	// Times every supported path on count randomly placed objects and prints the results
+	void Benchmark(size_t count);
+}
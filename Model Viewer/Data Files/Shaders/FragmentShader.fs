@@ -1,6 +1,13 @@
 #version 420 core
 
-uniform vec4 gDirectionLight, gDiffuseLight, gAmbientLight, gSpecularLight, gCameraPos;
+layout (std140) uniform cLights
+{
+	vec4 gDiffuseLight;
+	vec4 gAmbientLight;
+	vec4 gSpecularLight;
+	vec4 gDirectionLight;
+	vec3 gCameraPos;
+};
 
 layout (location = 0) out vec4 color;
 layout (binding = 0) uniform sampler2D diffuse_texture;
@@ -35,10 +35,27 @@ cbuffer DirectionalLightBuffer : register(b1)
 	matrix mLightProj;
 };
 
-// Bone constant buffer
+// Bone constant buffer. Matrix skinning stores each bone as three rows of its transposed affine transform,
+// dual quaternion skinning stores the real and dual parts of each bone
 cbuffer BoneBuffer : register(b2)
 {
-	matrix cBoneTransform[96];
+	uint cSkinningMode;
+	uint cPaletteInBuffer;
+	uint cPaletteOffset;
+	uint cBonePadding;
+	float4 cBoneTransform[96 * 3];
+}
+
+static const uint SKINNING_MATRIX = 0;
+static const uint SKINNING_DUAL_QUATERNION = 1;
+
+// Palettes too large for the bone constant buffer, and the palettes of every instance when drawing instanced.
+// Each instance's bones start at its palette base plus the offset of the subsets being drawn
+StructuredBuffer<float4> gBonePalette : register(t2);
+
+float4 GetBoneRow(int index)
+{
+	return cPaletteInBuffer != 0 ? gBonePalette[index] : cBoneTransform[index];
 }
 
 // Texture data
@@ -59,6 +76,12 @@ struct VertexInput
 	float3 BitTangent : BITTANGENT;
 	float4 weight : WEIGHT;
 	int4 bone : BONE;
+
+	// Per instance transform, stored like a matrix skinning bone
+	float4 Instance0 : INSTANCE0;
+	float4 Instance1 : INSTANCE1;
+	float4 Instance2 : INSTANCE2;
+	uint PaletteBase : PALETTEBASE;
 };
 
 // Pixel shader input
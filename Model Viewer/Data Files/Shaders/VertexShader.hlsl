@@ -11,23 +11,72 @@ PixelInput main(VertexInput input)
 	weights[2] = input.weight.z;
 	weights[3] = 1.0f - weights[0] - weights[1] - weights[2];
 
-	// Transform by bone influence
-	float3 position = float3(0.0f, 0.0f, 0.0f);
-	float3 normal = float3(0.0f, 0.0f, 0.0f);
-	float3 tangent = float3(0.0f, 0.0f, 0.0f);
-	float3 bi_tangent = float3(0.0f, 0.0f, 0.0f);
-	for (int i = 0; i < 4; i++)
+	float3 position;
+	float3 normal;
+	float3 tangent;
+	float3 bi_tangent;
+
+	// First palette row of this instance's bones
+	int palette_start = (input.PaletteBase + cPaletteOffset) * (cSkinningMode == SKINNING_DUAL_QUATERNION ? 2 : 3);
+
+	if (cSkinningMode == SKINNING_DUAL_QUATERNION)
+	{
+		// Blend the dual quaternions, keeping every influence in the same hemisphere as the first
+		float4 real = float4(0.0f, 0.0f, 0.0f, 0.0f);
+		float4 dual = float4(0.0f, 0.0f, 0.0f, 0.0f);
+		float4 first = GetBoneRow(palette_start + input.bone[0] * 2);
+		for (int i = 0; i < 4; i++)
+		{
+			int bone_index = palette_start + input.bone[i] * 2;
+			float4 bone_real = GetBoneRow(bone_index);
+			float weight = dot(first, bone_real) < 0.0f ? -weights[i] : weights[i];
+
+			real += weight * bone_real;
+			dual += weight * GetBoneRow(bone_index + 1);
+		}
+
+		float length_inverse = rsqrt(dot(real, real));
+		real *= length_inverse;
+		dual *= length_inverse;
+
+		// Rotate, then translate by 2 * dual * conjugate(real)
+		float3 translation = 2.0f * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+		position = input.Position + 2.0f * cross(real.xyz, cross(real.xyz, input.Position) + real.w * input.Position) + translation;
+		normal = input.Normal + 2.0f * cross(real.xyz, cross(real.xyz, input.Normal) + real.w * input.Normal);
+		tangent = input.Tangent + 2.0f * cross(real.xyz, cross(real.xyz, input.Tangent) + real.w * input.Tangent);
+		bi_tangent = input.BitTangent + 2.0f * cross(real.xyz, cross(real.xyz, input.BitTangent) + real.w * input.BitTangent);
+	}
+	else
 	{
-		float weight = weights[i];
-		int bone_index = input.bone[i];
-		matrix transform = cBoneTransform[bone_index];
-
-		position += weight * mul(float4(input.Position, 1.0f), transform).xyz;
-		normal += weight * mul(input.Normal, (float3x3)transform);
-		tangent += weight * mul(input.Tangent.xyz, (float3x3)transform);
-		bi_tangent += weight * mul(input.BitTangent.xyz, (float3x3)transform);
+		// Blend the bone transforms by influence
+		float4 row0 = float4(0.0f, 0.0f, 0.0f, 0.0f);
+		float4 row1 = float4(0.0f, 0.0f, 0.0f, 0.0f);
+		float4 row2 = float4(0.0f, 0.0f, 0.0f, 0.0f);
+		for (int i = 0; i < 4; i++)
+		{
+			float weight = weights[i];
+			int bone_index = palette_start + input.bone[i] * 3;
+
+			row0 += weight * GetBoneRow(bone_index);
+			row1 += weight * GetBoneRow(bone_index + 1);
+			row2 += weight * GetBoneRow(bone_index + 2);
+		}
+
+		// Transform by the blended bone
+		float4 local_position = float4(input.Position, 1.0f);
+		position = float3(dot(row0, local_position), dot(row1, local_position), dot(row2, local_position));
+		normal = float3(dot(row0.xyz, input.Normal), dot(row1.xyz, input.Normal), dot(row2.xyz, input.Normal));
+		tangent = float3(dot(row0.xyz, input.Tangent), dot(row1.xyz, input.Tangent), dot(row2.xyz, input.Tangent));
+		bi_tangent = float3(dot(row0.xyz, input.BitTangent), dot(row1.xyz, input.BitTangent), dot(row2.xyz, input.BitTangent));
 	}
 
+	// Place the instance
+	float4 instance_position = float4(position, 1.0f);
+	position = float3(dot(input.Instance0, instance_position), dot(input.Instance1, instance_position), dot(input.Instance2, instance_position));
+	normal = float3(dot(input.Instance0.xyz, normal), dot(input.Instance1.xyz, normal), dot(input.Instance2.xyz, normal));
+	tangent = float3(dot(input.Instance0.xyz, tangent), dot(input.Instance1.xyz, tangent), dot(input.Instance2.xyz, tangent));
+	bi_tangent = float3(dot(input.Instance0.xyz, bi_tangent), dot(input.Instance1.xyz, bi_tangent), dot(input.Instance2.xyz, bi_tangent));
+
 	// Transform to homogeneous clip space.
 	output.PositionH = mul(float4(position, 1.0f), cWorld);
 	output.PositionH = mul(output.PositionH, cView);
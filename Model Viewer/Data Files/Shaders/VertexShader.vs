@@ -7,7 +7,27 @@ layout (std140) uniform cWorld
     mat4 gProjection;
 };
 
-uniform mat4 gBoneTransform[96];
+// Matrix skinning stores each bone as three rows of its transposed affine transform,
+// dual quaternion skinning stores the real and dual parts of each bone
+layout (std140) uniform cBones
+{
+    int gSkinningMode;
+    int gPaletteInBuffer;
+    int gPaletteOffset;
+    vec4 gBoneTransform[96 * 3];
+};
+
+const int SKINNING_MATRIX = 0;
+const int SKINNING_DUAL_QUATERNION = 1;
+
+// Palettes too large for the bone uniforms, and the palettes of every instance when drawing instanced.
+// Each instance's bones start at its palette base plus the offset of the subsets being drawn
+uniform samplerBuffer gBonePalette;
+
+vec4 GetBoneRow(int index)
+{
+    return gPaletteInBuffer != 0 ? texelFetch(gBonePalette, index) : gBoneTransform[index];
+}
 
 layout (location = 0) in vec3 vPosition;
 layout (location = 1) in vec4 vColour;
@@ -18,6 +38,12 @@ layout (location = 5) in vec3 vBiTangent;
 layout (location = 6) in vec4 vWeight;
 layout (location = 7) in ivec4 vBone;
 
+// Per instance transform, stored like a matrix skinning bone
+layout (location = 8) in vec4 vInstance0;
+layout (location = 9) in vec4 vInstance1;
+layout (location = 10) in vec4 vInstance2;
+layout (location = 11) in uint vPaletteBase;
+
 out vec3 fPosition;
 out vec4 fColour;
 out vec2 fUV;
@@ -34,23 +60,72 @@ void main()
     weights[2] = vWeight.z;
     weights[3] = 1.0f - weights[0] - weights[1] - weights[2];
 
-    // Bone
-    vec3 position = vec3(0.0f, 0.0f, 0.0f);
-    vec3 normal = vec3(0.0f, 0.0f, 0.0f);
-    vec3 tangent = vec3(0.0f, 0.0f, 0.0f);
-    vec3 bi_tangent = vec3(0.0f, 0.0f, 0.0f);
-    for (int i = 0; i < 4; i++)
+    vec3 position;
+    vec3 normal;
+    vec3 tangent;
+    vec3 bi_tangent;
+
+    // First palette row of this instance's bones
+    int palette_start = (int(vPaletteBase) + gPaletteOffset) * (gSkinningMode == SKINNING_DUAL_QUATERNION ? 2 : 3);
+
+    if (gSkinningMode == SKINNING_DUAL_QUATERNION)
     {
-        float weight = weights[i];
-        int bone_index = vBone[i];
-        mat4 transform = gBoneTransform[bone_index];
-
-        position += weight * (vec4(vPosition, 1.0f) * transform).xyz;
-        normal += weight * vNormal * mat3(transform);
-        tangent += weight * vTangent * mat3(transform);
-		bi_tangent += weight * vBiTangent * mat3(transform);
+        // Blend the dual quaternions, keeping every influence in the same hemisphere as the first
+        vec4 real = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        vec4 dual = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        vec4 first = GetBoneRow(palette_start + vBone[0] * 2);
+        for (int i = 0; i < 4; i++)
+        {
+            int bone_index = palette_start + vBone[i] * 2;
+            vec4 bone_real = GetBoneRow(bone_index);
+            float weight = dot(first, bone_real) < 0.0f ? -weights[i] : weights[i];
+
+            real += weight * bone_real;
+            dual += weight * GetBoneRow(bone_index + 1);
+        }
+
+        float length_inverse = inversesqrt(dot(real, real));
+        real *= length_inverse;
+        dual *= length_inverse;
+
+        // Rotate, then translate by 2 * dual * conjugate(real)
+        vec3 translation = 2.0f * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+        position = vPosition + 2.0f * cross(real.xyz, cross(real.xyz, vPosition) + real.w * vPosition) + translation;
+        normal = vNormal + 2.0f * cross(real.xyz, cross(real.xyz, vNormal) + real.w * vNormal);
+        tangent = vTangent + 2.0f * cross(real.xyz, cross(real.xyz, vTangent) + real.w * vTangent);
+        bi_tangent = vBiTangent + 2.0f * cross(real.xyz, cross(real.xyz, vBiTangent) + real.w * vBiTangent);
+    }
+    else
+    {
+        // Blend the bone transforms by influence
+        vec4 row0 = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        vec4 row1 = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        vec4 row2 = vec4(0.0f, 0.0f, 0.0f, 0.0f);
+        for (int i = 0; i < 4; i++)
+        {
+            float weight = weights[i];
+            int bone_index = palette_start + vBone[i] * 3;
+
+            row0 += weight * GetBoneRow(bone_index);
+            row1 += weight * GetBoneRow(bone_index + 1);
+            row2 += weight * GetBoneRow(bone_index + 2);
+        }
+
+        // Transform by the blended bone
+        vec4 local_position = vec4(vPosition, 1.0f);
+        position = vec3(dot(row0, local_position), dot(row1, local_position), dot(row2, local_position));
+        normal = vec3(dot(row0.xyz, vNormal), dot(row1.xyz, vNormal), dot(row2.xyz, vNormal));
+        tangent = vec3(dot(row0.xyz, vTangent), dot(row1.xyz, vTangent), dot(row2.xyz, vTangent));
+        bi_tangent = vec3(dot(row0.xyz, vBiTangent), dot(row1.xyz, vBiTangent), dot(row2.xyz, vBiTangent));
     }
 
+    // Place the instance
+    vec4 instance_position = vec4(position, 1.0f);
+    position = vec3(dot(vInstance0, instance_position), dot(vInstance1, instance_position), dot(vInstance2, instance_position));
+    normal = vec3(dot(vInstance0.xyz, normal), dot(vInstance1.xyz, normal), dot(vInstance2.xyz, normal));
+    tangent = vec3(dot(vInstance0.xyz, tangent), dot(vInstance1.xyz, tangent), dot(vInstance2.xyz, tangent));
+    bi_tangent = vec3(dot(vInstance0.xyz, bi_tangent), dot(vInstance1.xyz, bi_tangent), dot(vInstance2.xyz, bi_tangent));
+
     // Position
     gl_Position = vec4(position, 1.0f)* gWorld * gView * gProjection;
     fPosition = position;
@@ -0,0 +1,92 @@
+#include "Pch.h"
+#include "FrameArena.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+FrameArena::FrameArena(size_t capacity)
+{
+	for (auto& buffer : m_Buffers)
+	{
+		buffer.data = std::make_unique<uint8_t[]>(capacity);
+		buffer.capacity = capacity;
+	}
+}
+
+void* FrameArena::Allocate(size_t size, size_t alignment)
+{
+	auto& buffer = m_Buffers[m_Current];
+	auto address = reinterpret_cast<uintptr_t>(buffer.data.get());
+	auto offset = ((address + buffer.used + alignment - 1) & ~(alignment - 1)) - address;
+	if (offset + size <= buffer.capacity)
+	{
+		buffer.used = offset + size;
+		return buffer.data.get() + offset;
+	}
+
+	// Out of space, so fall back to the heap for the rest of the frame. The buffer grows when it is next reset
+	buffer.overflow.push_back(std::make_unique<uint8_t[]>(size + alignment));
+	buffer.overflowBytes += size + alignment;
+
+	auto overflow = reinterpret_cast<uintptr_t>(buffer.overflow.back().get());
+	return reinterpret_cast<void*>((overflow + alignment - 1) & ~(alignment - 1));
+}
+
+void FrameArena::NextFrame()
+{
+	m_Current = (m_Current + 1) % m_Buffers.size();
+
+	auto& buffer = m_Buffers[m_Current];
+	buffer.used = 0;
+	if (!buffer.overflow.empty())
+	{
+		buffer.capacity = (buffer.capacity + buffer.overflowBytes) * 2;
+		buffer.data = std::make_unique<uint8_t[]>(buffer.capacity);
+		buffer.overflow.clear();
+		buffer.overflowBytes = 0;
+	}
+}
+
+#ifdef _DEBUG
+namespace
+{
+	std::atomic<bool> HeapCounterEnabled = false;
+	std::atomic<size_t> HeapAllocationCount = 0;
+}
+
+void HeapCounter::SetEnabled(bool enabled)
+{
+	HeapCounterEnabled = enabled;
+}
+
+size_t HeapCounter::GetCount()
+{
+	return HeapAllocationCount;
+}
+
+void HeapCounter::Reset()
+{
+	HeapAllocationCount = 0;
+}
+
+// Array and sized forms forward to these by default
+void* operator new(size_t size)
+{
+	if (HeapCounterEnabled)
+	{
+		++HeapAllocationCount;
+	}
+
+	if (auto memory = std::malloc(size > 0 ? size : 1))
+	{
+		return memory;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+// Linear allocator for data that only lives for a frame. Allocating bumps an offset and the whole
+// frame is released at once. Two buffers are kept so the previous frame's data stays valid while
+// the next frame is built, ready for handing over to a render thread
+class FrameArena
+{
+public:
+	explicit FrameArena(size_t capacity = 1024 * 1024);
+	FrameArena& operator=(const FrameArena&) = delete;
+	FrameArena(const FrameArena&) = delete;
+
+	// Allocate uninitialised memory from the current frame
+	void* Allocate(size_t size, size_t alignment);
+
+	// Allocate an uninitialised array from the current frame
+	template <typename T>
+	T* Allocate(size_t count)
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "Frame allocations are never destroyed");
+		return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+	}
+
+	// Called at the end of each frame. Switches to the other buffer and releases everything it held
+	void NextFrame();
+
+	// Bytes allocated in the current frame
+	constexpr size_t GetUsed() { return m_Buffers[m_Current].used; }
+
+private:
+	struct Buffer
+	{
+		std::unique_ptr<uint8_t[]> data = nullptr;
+		size_t capacity = 0;
+		size_t used = 0;
+
+		// Allocations that did not fit, released with the frame
+		std::vector<std::unique_ptr<uint8_t[]>> overflow;
+		size_t overflowBytes = 0;
+	};
+
+	std::array<Buffer, 2> m_Buffers;
+	size_t m_Current = 0;
+};
+
+#ifdef _DEBUG
+// Counts general heap allocations made through operator new while enabled, to find the ones left in the frame loop
+namespace HeapCounter
+{
+	void SetEnabled(bool enabled);
+	size_t GetCount();
+	void Reset();
+}
+#endif
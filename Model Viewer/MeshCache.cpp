@@ -0,0 +1,573 @@
+#include "Pch.h"
+#include "MeshCache.h"
+#include <filesystem>
+#include <cstring>
+
+namespace
+{
+	// Bump whenever the layout below or the output of ModelLoader changes
+	constexpr uint32_t CacheVersion = 16;
+	constexpr char CacheMagic[4] = { 'M', 'V', 'M', 'C' };
+
+	// Range of a section within the file
+	struct Section
+	{
+		uint64_t offset = 0;
+		uint64_t count = 0;
+	};
+
+	// Range of a string within the string table
+	struct StringRef
+	{
+		uint32_t offset = 0;
+		uint32_t length = 0;
+	};
+
+	struct CacheHeader
+	{
+		char magic[4] = {};
+		uint32_t version = 0;
+
+		// Source asset fingerprint
+		uint64_t sourceSize = 0;
+		int64_t sourceTime = 0;
+		uint64_t sourceHash = 0;
+
+		// Hash of the import settings
+		uint64_t settingsHash = 0;
+
+		Section vertices;
+		Section indices;
+		Section subsets;
+		Section subsetBones;
+		Section bounds;
+		Section boneBounds;
+		Section meshlets;
+		Section bones;
+		Section clips;
+		Section channels;
+		Section times;
+		Section translations;
+		Section rotations;
+		Section scales;
+		Section strings;
+	};
+
+	// Bind pose bounds of the whole model
+	struct CachedBounds
+	{
+		DirectX::BoundingBox box;
+		DirectX::BoundingSphere sphere;
+	};
+
+	struct CachedBone
+	{
+		int parentId = 0;
+		StringRef name;
+		StringRef parentName;
+		DirectX::XMFLOAT4X3 offset;
+	};
+
+	struct CachedClip
+	{
+		StringRef name;
+		uint32_t firstChannel = 0;
+		uint32_t channelCount = 0;
+		DirectX::XMFLOAT3 translationMin;
+		DirectX::XMFLOAT3 translationExtent;
+	};
+
+	// KeyframeTimes and the range of its track values. Times are only stored for unevenly spaced keys
+	struct CachedTrack
+	{
+		float start = 0.0f;
+		float interval = 0.0f;
+		uint32_t keyCount = 0;
+		uint32_t firstTime = 0;
+		uint32_t firstValue = 0;
+	};
+
+	struct CachedChannel
+	{
+		CachedTrack translation;
+		CachedTrack rotation;
+		CachedTrack scale;
+	};
+
+	// Read-only memory mapping of a whole file
+	class MappedFile
+	{
+	public:
+		MappedFile(const std::string& path)
+		{
+			std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+			std::wstring wide_path = converter.from_bytes(path);
+
+			m_File = CreateFileW(wide_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (m_File == INVALID_HANDLE_VALUE)
+				return;
+
+			LARGE_INTEGER size = {};
+			if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+				return;
+
+			m_Mapping = CreateFileMappingW(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (m_Mapping == nullptr)
+				return;
+
+			m_Data = static_cast<const char*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+			if (m_Data != nullptr)
+			{
+				m_Size = static_cast<size_t>(size.QuadPart);
+			}
+		}
+
+		~MappedFile()
+		{
+			if (m_Data != nullptr)
+				UnmapViewOfFile(m_Data);
+
+			if (m_Mapping != nullptr)
+				CloseHandle(m_Mapping);
+
+			if (m_File != INVALID_HANDLE_VALUE)
+				CloseHandle(m_File);
+		}
+
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile(const MappedFile&) = delete;
+
+		constexpr const char* Data() const { return m_Data; }
+		constexpr size_t Size() const { return m_Size; }
+
+	private:
+		HANDLE m_File = INVALID_HANDLE_VALUE;
+		HANDLE m_Mapping = nullptr;
+		const char* m_Data = nullptr;
+		size_t m_Size = 0;
+	};
+
+	// xxHash64 primes
+	constexpr uint64_t Prime1 = 11400714785074694791ull;
+	constexpr uint64_t Prime2 = 14029467366897019727ull;
+	constexpr uint64_t Prime3 = 1609587929392839161ull;
+	constexpr uint64_t Prime4 = 9650029242287828579ull;
+	constexpr uint64_t Prime5 = 2870177450012600261ull;
+
+	uint64_t RotateLeft(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	template <typename T>
+	T ReadWord(const char* data)
+	{
+		T word;
+		std::memcpy(&word, data, sizeof(T));
+		return word;
+	}
+
+	uint64_t Round(uint64_t lane, uint64_t word)
+	{
+		return RotateLeft(lane + word * Prime2, 31) * Prime1;
+	}
+
+	uint64_t MergeRound(uint64_t hash, uint64_t lane)
+	{
+		return (hash ^ Round(0, lane)) * Prime1 + Prime4;
+	}
+
+	// xxHash64 with a seed of 0. Four independent lanes take 32 bytes a step, so the source of every cache hit is
+	// hashed at memory speed rather than a multiply per byte
+	uint64_t Hash(const char* data, size_t size)
+	{
+		auto end = data + size;
+		uint64_t hash;
+		if (size >= 32)
+		{
+			uint64_t lanes[4] = { Prime1 + Prime2, Prime2, 0, 0 - Prime1 };
+			for (; end - data >= 32; data += 32)
+			{
+				for (int i = 0; i < 4; ++i)
+				{
+					lanes[i] = Round(lanes[i], ReadWord<uint64_t>(data + i * 8));
+				}
+			}
+
+			hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+			for (auto lane : lanes)
+			{
+				hash = MergeRound(hash, lane);
+			}
+		}
+		else
+		{
+			hash = Prime5;
+		}
+
+		hash += size;
+		for (; end - data >= 8; data += 8)
+		{
+			hash = RotateLeft(hash ^ Round(0, ReadWord<uint64_t>(data)), 27) * Prime1 + Prime4;
+		}
+
+		if (end - data >= 4)
+		{
+			hash = RotateLeft(hash ^ ReadWord<uint32_t>(data) * Prime1, 23) * Prime2 + Prime3;
+			data += 4;
+		}
+
+		for (; data < end; ++data)
+		{
+			hash = RotateLeft(hash ^ static_cast<unsigned char>(*data) * Prime5, 11) * Prime1;
+		}
+
+		hash ^= hash >> 33;
+		hash *= Prime2;
+		hash ^= hash >> 29;
+		hash *= Prime3;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+	// Bone tolerances are hashed in name order so the hash does not depend on the map's iteration order
+	uint64_t HashSettings(const ModelLoader::ImportSettings& settings)
+	{
+		std::vector<std::pair<std::string, float>> bone_tolerances(settings.boneKeyTolerances.begin(), settings.boneKeyTolerances.end());
+		std::sort(bone_tolerances.begin(), bone_tolerances.end());
+
+		std::string data(reinterpret_cast<const char*>(&settings.keyTolerance), sizeof(float));
+		data.append(reinterpret_cast<const char*>(&settings.weldVertices), sizeof(bool));
+		data.append(reinterpret_cast<const char*>(&settings.generateNormals), sizeof(bool));
+		data.append(reinterpret_cast<const char*>(&settings.generateTangents), sizeof(bool));
+		data.append(reinterpret_cast<const char*>(&settings.normalSmoothingAngle), sizeof(float));
+		data.append(reinterpret_cast<const char*>(&settings.lodCount), sizeof(unsigned));
+		data.append(reinterpret_cast<const char*>(&settings.lodRatio), sizeof(float));
+		data.append(reinterpret_cast<const char*>(&settings.lodErrorBudget), sizeof(float));
+		data.append(reinterpret_cast<const char*>(&settings.meshletVertices), sizeof(unsigned));
+		data.append(reinterpret_cast<const char*>(&settings.meshletTriangles), sizeof(unsigned));
+		data.append(reinterpret_cast<const char*>(&settings.optimizeMeshes), sizeof(bool));
+		for (auto& bone_tolerance : bone_tolerances)
+		{
+			data.append(bone_tolerance.first.c_str(), bone_tolerance.first.size() + 1);
+			data.append(reinterpret_cast<const char*>(&bone_tolerance.second), sizeof(float));
+		}
+
+		return Hash(data.data(), data.size());
+	}
+
+	// Fills in the fingerprint of the source asset
+	bool ReadSourceFingerprint(const std::string& path, CacheHeader* header)
+	{
+		std::error_code error;
+		auto size = std::filesystem::file_size(path, error);
+		if (error)
+			return false;
+
+		auto time = std::filesystem::last_write_time(path, error);
+		if (error)
+			return false;
+
+		header->sourceSize = static_cast<uint64_t>(size);
+		header->sourceTime = static_cast<int64_t>(time.time_since_epoch().count());
+		return true;
+	}
+
+	bool ReadSourceHash(const std::string& path, CacheHeader* header)
+	{
+		MappedFile source(path);
+		if (source.Data() == nullptr)
+			return false;
+
+		header->sourceHash = Hash(source.Data(), source.Size());
+		return true;
+	}
+
+	// Returns a pointer to the section if it lies within the file
+	template <typename T>
+	const T* GetSection(const MappedFile& file, const Section& section)
+	{
+		if (section.offset > file.Size() || section.count > (file.Size() - section.offset) / sizeof(T))
+			return nullptr;
+
+		return reinterpret_cast<const T*>(file.Data() + section.offset);
+	}
+
+	template <typename T>
+	bool ReadSection(const MappedFile& file, const Section& section, std::vector<T>* out)
+	{
+		auto data = GetSection<T>(file, section);
+		if (data == nullptr)
+			return false;
+
+		out->assign(data, data + section.count);
+		return true;
+	}
+
+	template <typename T>
+	bool ReadTrack(const CachedTrack& cached, const float* times, const Section& timeSection, const T* values, const Section& valueSection, KeyframeTrack<T>* track)
+	{
+		auto time_count = cached.interval > 0.0f || cached.keyCount < 2 ? 0u : cached.keyCount;
+		if (cached.keyCount == 0 ||
+			static_cast<uint64_t>(cached.firstTime) + time_count > timeSection.count ||
+			static_cast<uint64_t>(cached.firstValue) + cached.keyCount > valueSection.count)
+		{
+			return false;
+		}
+
+		track->Keys.Start = cached.start;
+		track->Keys.Interval = cached.interval;
+		track->Keys.Count = cached.keyCount;
+		track->Keys.Times.assign(times + cached.firstTime, times + cached.firstTime + time_count);
+		track->Values.assign(values + cached.firstValue, values + cached.firstValue + cached.keyCount);
+		return true;
+	}
+
+	template <typename T>
+	CachedTrack WriteTrack(const KeyframeTrack<T>& track, std::vector<float>* times, std::vector<T>* values)
+	{
+		CachedTrack cached;
+		cached.start = track.Keys.Start;
+		cached.interval = track.Keys.Interval;
+		cached.keyCount = static_cast<uint32_t>(track.Keys.Count);
+		cached.firstTime = static_cast<uint32_t>(times->size());
+		cached.firstValue = static_cast<uint32_t>(values->size());
+		times->insert(times->end(), track.Keys.Times.begin(), track.Keys.Times.end());
+		values->insert(values->end(), track.Values.begin(), track.Values.end());
+		return cached;
+	}
+
+	// Accumulates the sections of the cache file in memory before writing
+	class CacheWriter
+	{
+	public:
+		template <typename T>
+		Section Write(const T* data, size_t count)
+		{
+			static_assert(std::is_trivially_copyable_v<T>, "Cache sections must be trivially copyable");
+
+			// Keep every section aligned to 16 bytes
+			m_Buffer.resize((m_Buffer.size() + 15) & ~static_cast<size_t>(15));
+
+			Section section;
+			section.offset = sizeof(CacheHeader) + m_Buffer.size();
+			section.count = count;
+
+			auto bytes = reinterpret_cast<const char*>(data);
+			m_Buffer.insert(m_Buffer.end(), bytes, bytes + sizeof(T) * count);
+			return section;
+		}
+
+		template <typename T>
+		Section Write(const std::vector<T>& data)
+		{
+			return Write(data.data(), data.size());
+		}
+
+		StringRef AddString(const std::string& str)
+		{
+			StringRef ref;
+			ref.offset = static_cast<uint32_t>(m_Strings.size());
+			ref.length = static_cast<uint32_t>(str.size());
+			m_Strings.insert(m_Strings.end(), str.begin(), str.end());
+			return ref;
+		}
+
+		const std::vector<char>& GetStrings() const { return m_Strings; }
+		const std::vector<char>& GetBuffer() const { return m_Buffer; }
+
+	private:
+		std::vector<char> m_Buffer;
+		std::vector<char> m_Strings;
+	};
+}
+
+std::string MeshCache::GetCachePath(const std::string& path)
+{
+	return path + ".cache";
+}
+
+bool MeshCache::Load(const std::string& path, const ModelLoader::ImportSettings& settings, MeshData* meshData)
+{
+	MappedFile file(GetCachePath(path));
+	if (file.Data() == nullptr || file.Size() < sizeof(CacheHeader))
+		return false;
+
+	CacheHeader header;
+	std::memcpy(&header, file.Data(), sizeof(CacheHeader));
+	if (std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 || header.version != CacheVersion || header.settingsHash != HashSettings(settings))
+		return false;
+
+	// Check the cheap parts of the fingerprint before hashing the source
+	CacheHeader source;
+	if (!ReadSourceFingerprint(path, &source) || source.sourceSize != header.sourceSize || source.sourceTime != header.sourceTime)
+		return false;
+
+	if (!ReadSourceHash(path, &source) || source.sourceHash != header.sourceHash)
+		return false;
+
+	// Geometry
+	if (!ReadSection(file, header.vertices, &meshData->vertices) ||
+		!ReadSection(file, header.indices, &meshData->indices) ||
+		!ReadSection(file, header.subsets, &meshData->subsets) ||
+		!ReadSection(file, header.subsetBones, &meshData->subsetBones) ||
+		!ReadSection(file, header.boneBounds, &meshData->boneBounds) ||
+		!ReadSection(file, header.meshlets, &meshData->meshlets))
+	{
+		return false;
+	}
+
+	auto bounds = GetSection<CachedBounds>(file, header.bounds);
+	if (bounds == nullptr || header.bounds.count != 1)
+		return false;
+
+	meshData->box = bounds->box;
+	meshData->sphere = bounds->sphere;
+
+	auto strings = GetSection<char>(file, header.strings);
+	auto bones = GetSection<CachedBone>(file, header.bones);
+	auto clips = GetSection<CachedClip>(file, header.clips);
+	auto channels = GetSection<CachedChannel>(file, header.channels);
+	auto times = GetSection<float>(file, header.times);
+	auto translations = GetSection<PackedTranslation>(file, header.translations);
+	auto rotations = GetSection<PackedQuaternion>(file, header.rotations);
+	auto scales = GetSection<DirectX::XMFLOAT3>(file, header.scales);
+	if (strings == nullptr || bones == nullptr || clips == nullptr || channels == nullptr ||
+		times == nullptr || translations == nullptr || rotations == nullptr || scales == nullptr)
+	{
+		return false;
+	}
+
+	auto to_string = [&](const StringRef& ref)
+	{
+		if (static_cast<uint64_t>(ref.offset) + ref.length > header.strings.count)
+			return std::string();
+
+		return std::string(strings + ref.offset, ref.length);
+	};
+
+	// Bones
+	meshData->bones.resize(static_cast<size_t>(header.bones.count));
+	for (size_t i = 0; i < meshData->bones.size(); ++i)
+	{
+		auto& bone = meshData->bones[i];
+		bone.parentId = bones[i].parentId;
+		bone.name = to_string(bones[i].name);
+		bone.parentName = to_string(bones[i].parentName);
+		bone.offset = bones[i].offset;
+	}
+
+	// Animations
+	for (size_t i = 0; i < header.clips.count; ++i)
+	{
+		if (static_cast<uint64_t>(clips[i].firstChannel) + clips[i].channelCount > header.channels.count)
+			return false;
+
+		AnimationClip clip;
+		clip.Translations.Min = clips[i].translationMin;
+		clip.Translations.Extent = clips[i].translationExtent;
+		clip.BoneAnimations.resize(clips[i].channelCount);
+		for (auto k = 0u; k < clips[i].channelCount; ++k)
+		{
+			auto& channel = channels[clips[i].firstChannel + k];
+			auto& animation = clip.BoneAnimations[k];
+			if (!ReadTrack(channel.translation, times, header.times, translations, header.translations, &animation.Translation) ||
+				!ReadTrack(channel.rotation, times, header.times, rotations, header.rotations, &animation.Rotation) ||
+				!ReadTrack(channel.scale, times, header.times, scales, header.scales, &animation.Scale))
+			{
+				return false;
+			}
+		}
+
+		meshData->animations[to_string(clips[i].name)] = std::move(clip);
+	}
+
+	return true;
+}
+
+bool MeshCache::Save(const std::string& path, const ModelLoader::ImportSettings& settings, const MeshData& meshData)
+{
+	CacheHeader header;
+	std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+	header.version = CacheVersion;
+	header.settingsHash = HashSettings(settings);
+
+	if (!ReadSourceFingerprint(path, &header) || !ReadSourceHash(path, &header))
+		return false;
+
+	CacheWriter writer;
+	header.vertices = writer.Write(meshData.vertices);
+	header.indices = writer.Write(meshData.indices);
+	header.subsets = writer.Write(meshData.subsets);
+	header.subsetBones = writer.Write(meshData.subsetBones);
+	header.boneBounds = writer.Write(meshData.boneBounds);
+	header.meshlets = writer.Write(meshData.meshlets);
+
+	CachedBounds bounds = { meshData.box, meshData.sphere };
+	header.bounds = writer.Write(&bounds, 1);
+
+	// Bones
+	std::vector<CachedBone> bones(meshData.bones.size());
+	for (size_t i = 0; i < meshData.bones.size(); ++i)
+	{
+		bones[i].parentId = meshData.bones[i].parentId;
+		bones[i].name = writer.AddString(meshData.bones[i].name);
+		bones[i].parentName = writer.AddString(meshData.bones[i].parentName);
+		bones[i].offset = meshData.bones[i].offset;
+	}
+
+	header.bones = writer.Write(bones);
+
+	// Animations
+	std::vector<CachedClip> clips;
+	std::vector<CachedChannel> channels;
+	std::vector<float> times;
+	std::vector<PackedTranslation> translations;
+	std::vector<PackedQuaternion> rotations;
+	std::vector<DirectX::XMFLOAT3> scales;
+	for (auto& animation : meshData.animations)
+	{
+		CachedClip clip;
+		clip.name = writer.AddString(animation.first);
+		clip.firstChannel = static_cast<uint32_t>(channels.size());
+		clip.channelCount = static_cast<uint32_t>(animation.second.BoneAnimations.size());
+		clip.translationMin = animation.second.Translations.Min;
+		clip.translationExtent = animation.second.Translations.Extent;
+		clips.push_back(clip);
+
+		for (auto& bone_animation : animation.second.BoneAnimations)
+		{
+			CachedChannel channel;
+			channel.translation = WriteTrack(bone_animation.Translation, &times, &translations);
+			channel.rotation = WriteTrack(bone_animation.Rotation, &times, &rotations);
+			channel.scale = WriteTrack(bone_animation.Scale, &times, &scales);
+			channels.push_back(channel);
+		}
+	}
+
+	header.clips = writer.Write(clips);
+	header.channels = writer.Write(channels);
+	header.times = writer.Write(times);
+	header.translations = writer.Write(translations);
+	header.rotations = writer.Write(rotations);
+	header.scales = writer.Write(scales);
+	header.strings = writer.Write(writer.GetStrings());
+
+	// Write to a temporary file first so a failed write never leaves a truncated cache behind
+	auto cache_path = GetCachePath(path);
+	auto temp_path = cache_path + ".tmp";
+	{
+		std::ofstream file(temp_path, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+		if (!file.is_open())
+			return false;
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+		file.write(writer.GetBuffer().data(), writer.GetBuffer().size());
+		if (!file.good())
+			return false;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temp_path, cache_path, error);
+	return !error;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include "Model.h"
+#include "ModelLoader.h"
+
+// Native binary cache of imported MeshData. The cache lives beside the source asset and is
+// rejected whenever the source file's size, modification time or content hash changes, or when
+// it was imported with different settings
+namespace MeshCache
+{
+	// Path of the cache file for a source asset
+	std::string GetCachePath(const std::string& path);
+
+	// Load the cached mesh data for the source asset. Returns false if no valid cache exists
+	bool Load(const std::string& path, const ModelLoader::ImportSettings& settings, MeshData* meshData);
+
+	// Write the cache for the source asset
+	bool Save(const std::string& path, const ModelLoader::ImportSettings& settings, const MeshData& meshData);
+}
@@ -0,0 +1,487 @@
+#include "Pch.h"
+#include "MeshOptimizer.h"
+#include <cfloat>
+#include <numeric>
+
+namespace
+{
+	constexpr UINT NoVertex = ~0u;
+
+	// Line cache in front of the vertex buffer, 4 KB in 64 byte lines
+	constexpr size_t FetchLineSize = 64;
+	constexpr unsigned FetchCacheLines = 64;
+
+	// Size of the square the overdraw is rasterized into along each axis
+	constexpr int OverdrawResolution = 256;
+
+	// Clusters are at least this many triangles, so they stay large enough to hide something
+	constexpr size_t MinClusterTriangles = 16;
+
+	// Triangles using each vertex, as offsets into a shared list
+	struct VertexTriangles
+	{
+		VertexTriangles(const UINT* indices, size_t indexCount, size_t vertexCount) : offsets(vertexCount + 1, 0), triangles(indexCount / 3 * 3)
+		{
+			for (size_t i = 0; i < triangles.size(); ++i)
+			{
+				++offsets[indices[i] + 1];
+			}
+
+			std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+			auto cursors = offsets;
+			for (size_t i = 0; i < triangles.size(); ++i)
+			{
+				triangles[cursors[indices[i]]++] = static_cast<UINT>(i / 3);
+			}
+		}
+
+		std::vector<UINT> offsets;
+		std::vector<UINT> triangles;
+	};
+
+	void Tipsify(UINT* indices, size_t indexCount, size_t vertexCount)
+	{
+		VertexTriangles adjacency(indices, indexCount, vertexCount);
+
+		// Triangles of each vertex still to be emitted, and when it last entered the cache
+		std::vector<UINT> live(vertexCount);
+		for (size_t v = 0; v < vertexCount; ++v)
+		{
+			live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+		}
+
+		std::vector<unsigned> cache_time(vertexCount, 0);
+		std::vector<uint8_t> emitted(indexCount / 3, 0);
+		std::vector<UINT> dead_end;
+		std::vector<UINT> candidates;
+		std::vector<UINT> output;
+		dead_end.reserve(indexCount);
+		output.reserve(indexCount);
+
+		auto time = MeshOptimizer::VertexCacheSize + 1;
+		size_t cursor = 0;
+		auto fanning = vertexCount > 0 ? 0u : NoVertex;
+		while (fanning != NoVertex)
+		{
+			// Emit every remaining triangle around the fanning vertex
+			candidates.clear();
+			for (auto k = adjacency.offsets[fanning]; k < adjacency.offsets[fanning + 1]; ++k)
+			{
+				auto triangle = adjacency.triangles[k];
+				if (emitted[triangle])
+					continue;
+
+				for (int corner = 0; corner < 3; ++corner)
+				{
+					auto v = indices[triangle * 3 + corner];
+					output.push_back(v);
+					dead_end.push_back(v);
+					candidates.push_back(v);
+					--live[v];
+					if (time - cache_time[v] > MeshOptimizer::VertexCacheSize)
+					{
+						cache_time[v] = time++;
+					}
+				}
+
+				emitted[triangle] = 1;
+			}
+
+			// Fan next around the candidate that has been in the cache longest and will still be there after its own fan
+			auto best = NoVertex;
+			auto best_priority = -1;
+			for (auto v : candidates)
+			{
+				if (live[v] == 0)
+					continue;
+
+				auto age = static_cast<int>(time - cache_time[v]);
+				auto priority = age + 2 * static_cast<int>(live[v]) <= static_cast<int>(MeshOptimizer::VertexCacheSize) ? age : 0;
+				if (priority > best_priority)
+				{
+					best = v;
+					best_priority = priority;
+				}
+			}
+
+			// At a dead end take the most recent vertex with triangles left, then the next one in input order
+			while (best == NoVertex && !dead_end.empty())
+			{
+				auto v = dead_end.back();
+				dead_end.pop_back();
+				best = live[v] > 0 ? v : NoVertex;
+			}
+
+			for (; best == NoVertex && cursor < vertexCount; ++cursor)
+			{
+				best = live[cursor] > 0 ? static_cast<UINT>(cursor) : NoVertex;
+			}
+
+			fanning = best;
+		}
+
+		std::copy(output.begin(), output.end(), indices);
+	}
+
+	// Splits a cache optimised list wherever a cluster, starting with an empty cache, has become as cache friendly as the
+	// whole list within the threshold. Returns the first triangle of each cluster
+	std::vector<size_t> SplitClusters(const UINT* indices, size_t indexCount, size_t vertexCount)
+	{
+		auto triangle_count = indexCount / 3;
+		std::vector<unsigned> cache_time(vertexCount, 0);
+		auto time = MeshOptimizer::VertexCacheSize + 1;
+		auto misses = [&](const UINT* triangle)
+		{
+			auto count = 0u;
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				if (time - cache_time[triangle[corner]] > MeshOptimizer::VertexCacheSize)
+				{
+					cache_time[triangle[corner]] = time++;
+					++count;
+				}
+			}
+
+			return count;
+		};
+
+		size_t total = 0;
+		for (size_t t = 0; t < triangle_count; ++t)
+		{
+			total += misses(&indices[t * 3]);
+		}
+
+		auto acmr = triangle_count > 0 ? static_cast<float>(total) / triangle_count : 0.0f;
+
+		std::vector<size_t> starts;
+		size_t cluster_misses = 0;
+		for (size_t t = 0; t < triangle_count; ++t)
+		{
+			if (starts.empty() || cluster_misses == ~size_t(0))
+			{
+				starts.push_back(t);
+				cluster_misses = 0;
+				time += MeshOptimizer::VertexCacheSize + 1;
+			}
+
+			cluster_misses += misses(&indices[t * 3]);
+
+			auto cluster_triangles = t + 1 - starts.back();
+			if (cluster_triangles >= MinClusterTriangles && cluster_misses <= acmr * MeshOptimizer::OverdrawThreshold * cluster_triangles)
+			{
+				cluster_misses = ~size_t(0);
+			}
+		}
+
+		return starts;
+	}
+}
+
+void MeshOptimizer::DrawCost::Add(const DrawCost& other)
+{
+	triangles += other.triangles;
+	vertices += other.vertices;
+	transformed += other.transformed;
+	fetchedBytes += other.fetchedBytes;
+	coveredPixels += other.coveredPixels;
+	shadedPixels += other.shadedPixels;
+}
+
+float MeshOptimizer::DrawCost::GetAcmr() const
+{
+	return triangles > 0 ? static_cast<float>(transformed) / triangles : 0.0f;
+}
+
+float MeshOptimizer::DrawCost::GetAtvr() const
+{
+	return vertices > 0 ? static_cast<float>(transformed) / vertices : 0.0f;
+}
+
+float MeshOptimizer::DrawCost::GetOverfetch() const
+{
+	return vertices > 0 ? static_cast<float>(fetchedBytes) / (vertices * sizeof(Vertex)) : 0.0f;
+}
+
+float MeshOptimizer::DrawCost::GetOverdraw() const
+{
+	return coveredPixels > 0 ? static_cast<float>(shadedPixels) / coveredPixels : 0.0f;
+}
+
+MeshOptimizer::DrawCost MeshOptimizer::Analyze(const Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount)
+{
+	DrawCost cost;
+	cost.triangles = indexCount / 3;
+	indexCount = cost.triangles * 3;
+
+	// Every cache miss transforms the vertex, fetching the lines it spans that aren't cached
+	std::vector<uint8_t> used(vertexCount, 0);
+	std::vector<unsigned> cache_time(vertexCount, 0);
+	std::vector<unsigned> line_time((vertexCount * sizeof(Vertex) + FetchLineSize - 1) / FetchLineSize, 0);
+	auto time = VertexCacheSize + 1;
+	auto line_clock = FetchCacheLines + 1;
+	for (size_t i = 0; i < indexCount; ++i)
+	{
+		auto v = indices[i];
+		if (!used[v])
+		{
+			used[v] = 1;
+			++cost.vertices;
+		}
+
+		if (time - cache_time[v] <= VertexCacheSize)
+			continue;
+
+		cache_time[v] = time++;
+		++cost.transformed;
+
+		for (auto line = v * sizeof(Vertex) / FetchLineSize; line <= ((v + 1) * sizeof(Vertex) - 1) / FetchLineSize; ++line)
+		{
+			if (line_clock - line_time[line] > FetchCacheLines)
+			{
+				line_time[line] = line_clock++;
+				cost.fetchedBytes += FetchLineSize;
+			}
+		}
+	}
+
+	if (cost.vertices == 0)
+		return cost;
+
+	// Overdraw is rasterized along each axis into the unit square of the bounds. Triangles facing either way get their
+	// own depth buffer, as if seen from that side
+	auto min = DirectX::XMVectorReplicate(FLT_MAX);
+	auto max = DirectX::XMVectorReplicate(-FLT_MAX);
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		if (used[v])
+		{
+			auto position = DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[v].position));
+			min = DirectX::XMVectorMin(min, position);
+			max = DirectX::XMVectorMax(max, position);
+		}
+	}
+
+	DirectX::XMFLOAT3 origin, extent;
+	DirectX::XMStoreFloat3(&origin, min);
+	DirectX::XMStoreFloat3(&extent, DirectX::XMVectorSubtract(max, min));
+	auto scale = std::max({ extent.x, extent.y, extent.z });
+	scale = scale > 0.0f ? OverdrawResolution / scale : 0.0f;
+
+	constexpr size_t PixelCount = OverdrawResolution * OverdrawResolution;
+	std::vector<float> depth(PixelCount * 2);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		std::fill(depth.begin(), depth.begin() + PixelCount, -FLT_MAX);
+		std::fill(depth.begin() + PixelCount, depth.end(), FLT_MAX);
+
+		auto project = [&](UINT v)
+		{
+			auto& position = vertices[v].position;
+			const float p[3] = { position.x - origin.x, position.y - origin.y, position.z - origin.z };
+			return DirectX::XMFLOAT3(p[(axis + 1) % 3] * scale, p[(axis + 2) % 3] * scale, p[axis]);
+		};
+
+		for (size_t i = 0; i < indexCount; i += 3)
+		{
+			auto a = project(indices[i]);
+			auto b = project(indices[i + 1]);
+			auto c = project(indices[i + 2]);
+			auto area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			if (area == 0.0f)
+				continue;
+
+			// Triangles facing down the axis are seen from below, where nearer means lower rather than higher
+			auto back = area < 0.0f;
+			if (back)
+			{
+				std::swap(b, c);
+				area = -area;
+			}
+
+			auto layer = &depth[back ? PixelCount : 0];
+			auto min_x = std::max(0, static_cast<int>(std::min({ a.x, b.x, c.x })));
+			auto max_x = std::min(OverdrawResolution - 1, static_cast<int>(std::max({ a.x, b.x, c.x })));
+			auto min_y = std::max(0, static_cast<int>(std::min({ a.y, b.y, c.y })));
+			auto max_y = std::min(OverdrawResolution - 1, static_cast<int>(std::max({ a.y, b.y, c.y })));
+			for (auto y = min_y; y <= max_y; ++y)
+			{
+				for (auto x = min_x; x <= max_x; ++x)
+				{
+					auto px = x + 0.5f;
+					auto py = y + 0.5f;
+					auto w0 = (c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x);
+					auto w1 = (a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x);
+					auto w2 = (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+					if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+						continue;
+
+					auto z = (w0 * a.z + w1 * b.z + w2 * c.z) / area;
+					auto& stored = layer[y * OverdrawResolution + x];
+					if (back ? z < stored : z > stored)
+					{
+						stored = z;
+						++cost.shadedPixels;
+					}
+				}
+			}
+		}
+
+		cost.coveredPixels += std::count_if(depth.begin(), depth.begin() + PixelCount, [](float d) { return d != -FLT_MAX; });
+		cost.coveredPixels += std::count_if(depth.begin() + PixelCount, depth.end(), [](float d) { return d != FLT_MAX; });
+	}
+
+	return cost;
+}
+
+void MeshOptimizer::OptimizeVertexCache(UINT* indices, size_t indexCount, size_t vertexCount)
+{
+	indexCount = indexCount / 3 * 3;
+	if (indexCount == 0)
+		return;
+
+	// Short lists such as meshlets are renumbered to the vertices they use, keeping the work proportional to them
+	if (vertexCount <= indexCount)
+	{
+		Tipsify(indices, indexCount, vertexCount);
+		return;
+	}
+
+	std::vector<UINT> used(indices, indices + indexCount);
+	std::sort(used.begin(), used.end());
+	used.erase(std::unique(used.begin(), used.end()), used.end());
+
+	std::vector<UINT> local(indexCount);
+	for (size_t i = 0; i < indexCount; ++i)
+	{
+		local[i] = static_cast<UINT>(std::lower_bound(used.begin(), used.end(), indices[i]) - used.begin());
+	}
+
+	Tipsify(local.data(), indexCount, used.size());
+	for (size_t i = 0; i < indexCount; ++i)
+	{
+		indices[i] = used[local[i]];
+	}
+}
+
+void MeshOptimizer::OptimizeOverdraw(const Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount, std::vector<Meshlet>* meshlets)
+{
+	indexCount = indexCount / 3 * 3;
+	if (indexCount == 0)
+		return;
+
+	// Index range of each cluster, and the meshlet it came from
+	struct Cluster
+	{
+		size_t start = 0;
+		size_t count = 0;
+		size_t meshlet = 0;
+		float order = 0.0f;
+	};
+
+	std::vector<Cluster> clusters;
+	if (meshlets != nullptr && !meshlets->empty())
+	{
+		for (size_t m = 0; m < meshlets->size(); ++m)
+		{
+			clusters.push_back({ (*meshlets)[m].startIndex, (*meshlets)[m].totalIndex, m });
+		}
+	}
+	else
+	{
+		auto starts = SplitClusters(indices, indexCount, vertexCount);
+		for (size_t i = 0; i < starts.size(); ++i)
+		{
+			auto end = i + 1 < starts.size() ? starts[i + 1] * 3 : indexCount;
+			clusters.push_back({ starts[i] * 3, end - starts[i] * 3 });
+		}
+	}
+
+	// Area weighted centre and normal of each cluster, and the centre of the whole mesh
+	std::vector<DirectX::XMVECTOR> centres(clusters.size());
+	std::vector<DirectX::XMVECTOR> normals(clusters.size());
+	auto mesh_centre = DirectX::XMVectorZero();
+	auto mesh_area = 0.0f;
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		auto centre = DirectX::XMVectorZero();
+		auto normal = DirectX::XMVectorZero();
+		auto cluster_area = 0.0f;
+		for (auto i = clusters[c].start; i < clusters[c].start + clusters[c].count; i += 3)
+		{
+			auto p0 = DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[indices[i]].position));
+			auto p1 = DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[indices[i + 1]].position));
+			auto p2 = DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[indices[i + 2]].position));
+			auto cross = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(p1, p0), DirectX::XMVectorSubtract(p2, p0));
+			auto area = DirectX::XMVectorGetX(DirectX::XMVector3Length(cross));
+
+			auto triangle_centre = DirectX::XMVectorScale(DirectX::XMVectorAdd(p0, DirectX::XMVectorAdd(p1, p2)), 1.0f / 3.0f);
+			centre = DirectX::XMVectorAdd(centre, DirectX::XMVectorScale(triangle_centre, area));
+			normal = DirectX::XMVectorAdd(normal, cross);
+			cluster_area += area;
+		}
+
+		mesh_centre = DirectX::XMVectorAdd(mesh_centre, centre);
+		mesh_area += cluster_area;
+		centres[c] = cluster_area > 0.0f ? DirectX::XMVectorScale(centre, 1.0f / cluster_area) : centre;
+		normals[c] = DirectX::XMVector3Normalize(normal);
+	}
+
+	mesh_centre = mesh_area > 0.0f ? DirectX::XMVectorScale(mesh_centre, 1.0f / mesh_area) : mesh_centre;
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		clusters[c].order = DirectX::XMVectorGetX(DirectX::XMVector3Dot(DirectX::XMVectorSubtract(centres[c], mesh_centre), normals[c]));
+	}
+
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.order > b.order; });
+
+	std::vector<UINT> sorted;
+	sorted.reserve(indexCount);
+	std::vector<Meshlet> sorted_meshlets;
+	for (auto& cluster : clusters)
+	{
+		if (meshlets != nullptr && !meshlets->empty())
+		{
+			sorted_meshlets.push_back((*meshlets)[cluster.meshlet]);
+			sorted_meshlets.back().startIndex = static_cast<unsigned>(sorted.size());
+		}
+
+		sorted.insert(sorted.end(), indices + cluster.start, indices + cluster.start + cluster.count);
+	}
+
+	std::copy(sorted.begin(), sorted.end(), indices);
+	if (meshlets != nullptr && !meshlets->empty())
+	{
+		*meshlets = std::move(sorted_meshlets);
+	}
+}
+
+std::vector<UINT> MeshOptimizer::OptimizeVertexFetch(Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount)
+{
+	std::vector<UINT> remap(vertexCount, NoVertex);
+	UINT next = 0;
+	for (size_t i = 0; i < indexCount; ++i)
+	{
+		auto& index = indices[i];
+		if (remap[index] == NoVertex)
+		{
+			remap[index] = next++;
+		}
+
+		index = remap[index];
+	}
+
+	for (auto& index : remap)
+	{
+		index = index == NoVertex ? next++ : index;
+	}
+
+	std::vector<Vertex> reordered(vertexCount);
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		reordered[remap[v]] = vertices[v];
+	}
+
+	std::copy(reordered.begin(), reordered.end(), vertices);
+	return remap;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Model.h"
+
+// Reorders triangles and vertices for the GPU's post-transform vertex cache, for overdraw and for vertex fetch, and
+// measures all three on the CPU so the gains show without a GPU
+namespace MeshOptimizer
+{
+	// Post-transform cache entries the orders are optimised and measured for
+	constexpr unsigned VertexCacheSize = 16;
+
+	// Clusters may cost this much more in cache misses than the whole list in exchange for overdraw
+	constexpr float OverdrawThreshold = 1.05f;
+
+	// Costs of drawing a triangle list, counted with a simulated FIFO vertex cache, a 64 byte line cache in front of
+	// the vertex buffer, and a rasterizer looking along each axis from both sides
+	struct DrawCost
+	{
+		size_t triangles = 0;
+		size_t vertices = 0;
+		size_t transformed = 0;
+		size_t fetchedBytes = 0;
+		size_t coveredPixels = 0;
+		size_t shadedPixels = 0;
+
+		void Add(const DrawCost& other);
+
+		// Vertices transformed per triangle, and per vertex used
+		float GetAcmr() const;
+		float GetAtvr() const;
+
+		// Vertex bytes fetched per byte of the vertices used
+		float GetOverfetch() const;
+
+		// Pixels shaded per pixel covered, with the depth test rejecting what is hidden by earlier triangles
+		float GetOverdraw() const;
+	};
+
+	DrawCost Analyze(const Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount);
+
+	// Reorders triangles so each vertex is reused while still in the cache, fanning around the vertices that will stay
+	// in it longest (Tipsify)
+	void OptimizeVertexCache(UINT* indices, size_t indexCount, size_t vertexCount);
+
+	// Orders clusters of triangles so those facing out from the centre of the mesh are drawn first, hiding what is behind
+	// them. Meshlets are used as the clusters when given, and reordered with them. Otherwise the cache optimised list is
+	// split wherever a cluster has become as cache friendly as the whole list within OverdrawThreshold
+	void OptimizeOverdraw(const Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount, std::vector<Meshlet>* meshlets);
+
+	// Renumbers vertices in the order the triangles first use them, leaving unused ones at the end. Returns the new
+	// number of every old vertex, for remapping the other index lists using them
+	std::vector<UINT> OptimizeVertexFetch(Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount);
+}
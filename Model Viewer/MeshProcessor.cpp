@@ -0,0 +1,424 @@
+#include "Pch.h"
+#include "MeshProcessor.h"
+#include <execution>
+#include <atomic>
+#include <cstring>
+#include <numeric>
+
+namespace
+{
+	// Vertices or triangles given to each worker at a time
+	constexpr size_t ChunkSize = 1 << 15;
+
+	// Calls function(begin, end) on chunks of [0, count) concurrently
+	template <typename Function>
+	void ForEachChunk(size_t count, Function function)
+	{
+		std::vector<size_t> begins;
+		for (size_t begin = 0; begin < count; begin += ChunkSize)
+		{
+			begins.push_back(begin);
+		}
+
+		std::for_each(std::execution::par, begins.begin(), begins.end(), [&](size_t begin)
+		{
+			function(begin, std::min(begin + ChunkSize, count));
+		});
+	}
+
+	// Mixes 64 bits at a time, finishing with an avalanche so values differing in a few bits land far apart
+	uint64_t HashBytes(const void* data, size_t size)
+	{
+		auto bytes = static_cast<const char*>(data);
+		auto hash = 0xcbf29ce484222325ull ^ size;
+		for (size_t offset = 0; offset < size; offset += sizeof(uint64_t))
+		{
+			uint64_t word = 0;
+			std::memcpy(&word, bytes + offset, std::min(sizeof(uint64_t), size - offset));
+			hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+			hash ^= hash >> 29;
+		}
+
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdull;
+		hash ^= hash >> 33;
+		return hash;
+	}
+
+	// Negative zero is hashed as zero, since the two compare equal
+	uint64_t HashPosition(const Position& position)
+	{
+		const float values[3] = { position.x + 0.0f, position.y + 0.0f, position.z + 0.0f };
+		return HashBytes(values, sizeof(values));
+	}
+
+	// Position, normal and texture coordinate of a vertex, which are all its tangent depends on. Negative zero is
+	// stored as zero so the bytes of equal corners match
+	struct TangentCorner
+	{
+		explicit TangentCorner(const Vertex& vertex) : values{ vertex.position.x + 0.0f, vertex.position.y + 0.0f, vertex.position.z + 0.0f,
+			vertex.normal.x + 0.0f, vertex.normal.y + 0.0f, vertex.normal.z + 0.0f, vertex.texture.u + 0.0f, vertex.texture.v + 0.0f }
+		{
+		}
+
+		float values[8];
+	};
+
+	// First item equal to each one, which is itself for the first of each kind. Items are inserted concurrently into an
+	// open addressed table where equal items meet in one slot, which keeps the lowest of them so the result doesn't
+	// depend on the order the workers get there. Slots hold the item plus one, leaving zero for empty
+	template <typename Equal>
+	std::vector<UINT> FindFirstEqual(const std::vector<uint64_t>& hashes, Equal equal)
+	{
+		size_t capacity = 1;
+		while (capacity < hashes.size() * 2)
+		{
+			capacity *= 2;
+		}
+
+		// Each item's slot is kept from inserting it, and read back once every item is in
+		std::vector<std::atomic<UINT>> table(capacity);
+		std::vector<UINT> first(hashes.size());
+		ForEachChunk(hashes.size(), [&](size_t begin, size_t end)
+		{
+			for (auto i = begin; i < end; ++i)
+			{
+				auto item = static_cast<UINT>(i);
+				for (auto slot = hashes[item] & (capacity - 1);; slot = (slot + 1) & (capacity - 1))
+				{
+					auto stored = table[slot].load();
+					if (stored == 0 && table[slot].compare_exchange_strong(stored, item + 1))
+					{
+						first[item] = static_cast<UINT>(slot);
+						break;
+					}
+
+					if (hashes[stored - 1] == hashes[item] && equal(stored - 1, item))
+					{
+						while (item + 1 < stored && !table[slot].compare_exchange_weak(stored, item + 1))
+						{
+						}
+
+						first[item] = static_cast<UINT>(slot);
+						break;
+					}
+				}
+			}
+		});
+
+		ForEachChunk(hashes.size(), [&](size_t begin, size_t end)
+		{
+			for (auto i = begin; i < end; ++i)
+			{
+				first[i] = table[first[i]].load() - 1;
+			}
+		});
+
+		return first;
+	}
+
+	// Triangles around each key of a vertex, as offsets into a shared list. Vertices are their own keys without any
+	struct Adjacency
+	{
+		Adjacency(const UINT* indices, size_t triangleCount, size_t vertexCount, const UINT* keys) : offsets(vertexCount + 1, 0), triangles(triangleCount * 3)
+		{
+			auto key = [&](size_t i) { return keys != nullptr ? keys[indices[i]] : indices[i]; };
+			for (size_t i = 0; i < triangles.size(); ++i)
+			{
+				++offsets[key(i) + 1];
+			}
+
+			std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+			auto cursors = offsets;
+			for (size_t i = 0; i < triangles.size(); ++i)
+			{
+				triangles[cursors[key(i)]++] = static_cast<UINT>(i / 3);
+			}
+		}
+
+		std::vector<UINT> offsets;
+		std::vector<UINT> triangles;
+	};
+
+	DirectX::XMVECTOR LoadPosition(const Vertex& vertex)
+	{
+		return DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertex.position));
+	}
+
+	DirectX::XMVECTOR LoadNormal(const Vertex& vertex)
+	{
+		return DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertex.normal));
+	}
+
+	float Dot(DirectX::XMVECTOR a, DirectX::XMVECTOR b)
+	{
+		return DirectX::XMVectorGetX(DirectX::XMVector3Dot(a, b));
+	}
+
+	// Removes the part of a vector along a unit normal
+	DirectX::XMVECTOR ProjectOntoPlane(DirectX::XMVECTOR vector, DirectX::XMVECTOR normal)
+	{
+		return DirectX::XMVectorSubtract(vector, DirectX::XMVectorScale(normal, Dot(vector, normal)));
+	}
+
+	// Corner of a triangle at a vertex
+	int FindCorner(const UINT* indices, UINT triangle, UINT vertex)
+	{
+		return indices[triangle * 3] == vertex ? 0 : indices[triangle * 3 + 1] == vertex ? 1 : indices[triangle * 3 + 2] == vertex ? 2 : -1;
+	}
+
+	// Corner of a triangle at any vertex with a key
+	int FindCorner(const UINT* indices, const UINT* keys, UINT triangle, UINT key)
+	{
+		return keys[indices[triangle * 3]] == key ? 0 : keys[indices[triangle * 3 + 1]] == key ? 1 : keys[indices[triangle * 3 + 2]] == key ? 2 : -1;
+	}
+}
+
+size_t MeshProcessor::WeldVertices(Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount)
+{
+	std::vector<uint64_t> hashes(vertexCount);
+	ForEachChunk(vertexCount, [&](size_t begin, size_t end)
+	{
+		for (auto v = begin; v < end; ++v)
+		{
+			hashes[v] = HashBytes(&vertices[v], sizeof(Vertex));
+		}
+	});
+
+	auto first = FindFirstEqual(hashes, [&](UINT a, UINT b) { return std::memcmp(&vertices[a], &vertices[b], sizeof(Vertex)) == 0; });
+
+	// The first of each kind moves down over the duplicates before it, which all map to it
+	std::vector<UINT> remap(vertexCount);
+	auto count = 0u;
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		if (first[v] == v)
+		{
+			remap[v] = count;
+			vertices[count++] = vertices[v];
+		}
+		else
+		{
+			remap[v] = remap[first[v]];
+		}
+	}
+
+	ForEachChunk(indexCount, [&](size_t begin, size_t end)
+	{
+		for (auto i = begin; i < end; ++i)
+		{
+			indices[i] = remap[indices[i]];
+		}
+	});
+
+	return count;
+}
+
+void MeshProcessor::GenerateNormals(Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount, float smoothingAngle)
+{
+	auto triangle_count = indexCount / 3;
+
+	// Normal of each triangle scaled by its area, and its direction
+	std::vector<DirectX::XMFLOAT3> face_normals(triangle_count);
+	std::vector<DirectX::XMFLOAT3> face_directions(triangle_count);
+	ForEachChunk(triangle_count, [&](size_t begin, size_t end)
+	{
+		for (auto t = begin; t < end; ++t)
+		{
+			auto p0 = LoadPosition(vertices[indices[t * 3]]);
+			auto p1 = LoadPosition(vertices[indices[t * 3 + 1]]);
+			auto p2 = LoadPosition(vertices[indices[t * 3 + 2]]);
+			auto normal = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(p1, p0), DirectX::XMVectorSubtract(p2, p0));
+			DirectX::XMStoreFloat3(&face_normals[t], normal);
+			DirectX::XMStoreFloat3(&face_directions[t], DirectX::XMVector3Normalize(normal));
+		}
+	});
+
+	// Flat normals come from the vertex's own triangles alone
+	if (smoothingAngle <= 0.0f)
+	{
+		Adjacency adjacency(indices, triangle_count, vertexCount, nullptr);
+		ForEachChunk(vertexCount, [&](size_t begin, size_t end)
+		{
+			for (auto v = begin; v < end; ++v)
+			{
+				auto normal = DirectX::XMVectorZero();
+				for (auto k = adjacency.offsets[v]; k < adjacency.offsets[v + 1]; ++k)
+				{
+					normal = DirectX::XMVectorAdd(normal, DirectX::XMLoadFloat3(&face_normals[adjacency.triangles[k]]));
+				}
+
+				DirectX::XMStoreFloat3(reinterpret_cast<DirectX::XMFLOAT3*>(&vertices[v].normal), DirectX::XMVector3Normalize(normal));
+			}
+		});
+
+		return;
+	}
+
+	// Vertices at the same position share the triangles around it through the first of them
+	std::vector<uint64_t> hashes(vertexCount);
+	ForEachChunk(vertexCount, [&](size_t begin, size_t end)
+	{
+		for (auto v = begin; v < end; ++v)
+		{
+			hashes[v] = HashPosition(vertices[v].position);
+		}
+	});
+
+	auto positions = FindFirstEqual(hashes, [&](UINT a, UINT b)
+	{
+		auto& p = vertices[a].position;
+		auto& q = vertices[b].position;
+		return p.x == q.x && p.y == q.y && p.z == q.z;
+	});
+
+	Adjacency adjacency(indices, triangle_count, vertexCount, positions.data());
+
+	auto min_dot = std::cos(DirectX::XMConvertToRadians(smoothingAngle));
+	ForEachChunk(vertexCount, [&](size_t begin, size_t end)
+	{
+		for (auto v = begin; v < end; ++v)
+		{
+			auto first = adjacency.offsets[positions[v]];
+			auto last = adjacency.offsets[positions[v] + 1];
+
+			// Direction of the vertex's own triangles, which the others are compared against
+			auto own = DirectX::XMVectorZero();
+			for (auto k = first; k < last; ++k)
+			{
+				auto triangle = adjacency.triangles[k];
+				if (FindCorner(indices, triangle, static_cast<UINT>(v)) >= 0)
+				{
+					own = DirectX::XMVectorAdd(own, DirectX::XMLoadFloat3(&face_normals[triangle]));
+				}
+			}
+
+			own = DirectX::XMVector3Normalize(own);
+
+			auto normal = DirectX::XMVectorZero();
+			for (auto k = first; k < last; ++k)
+			{
+				auto triangle = adjacency.triangles[k];
+				if (Dot(DirectX::XMLoadFloat3(&face_directions[triangle]), own) >= min_dot)
+				{
+					normal = DirectX::XMVectorAdd(normal, DirectX::XMLoadFloat3(&face_normals[triangle]));
+				}
+			}
+
+			normal = DirectX::XMVector3Normalize(normal);
+			DirectX::XMStoreFloat3(reinterpret_cast<DirectX::XMFLOAT3*>(&vertices[v].normal), Dot(normal, normal) > 0.0f ? normal : own);
+		}
+	});
+}
+
+void MeshProcessor::GenerateTangents(Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount)
+{
+	auto triangle_count = indexCount / 3;
+
+	// Unit direction of increasing u across each triangle, and whether its texture keeps the orientation of its
+	// winding. Texture coordinates were flipped for Direct3D on import, so v is negated back to keep bi-tangents
+	// pointing up the texture
+	struct FaceTangent
+	{
+		DirectX::XMFLOAT3 tangent;
+		bool preserving = false;
+		bool valid = false;
+	};
+
+	std::vector<FaceTangent> face_tangents(triangle_count);
+	ForEachChunk(triangle_count, [&](size_t begin, size_t end)
+	{
+		for (auto t = begin; t < end; ++t)
+		{
+			auto& v0 = vertices[indices[t * 3]];
+			auto& v1 = vertices[indices[t * 3 + 1]];
+			auto& v2 = vertices[indices[t * 3 + 2]];
+			auto d1 = DirectX::XMVectorSubtract(LoadPosition(v1), LoadPosition(v0));
+			auto d2 = DirectX::XMVectorSubtract(LoadPosition(v2), LoadPosition(v0));
+			auto s1 = v1.texture.u - v0.texture.u;
+			auto s2 = v2.texture.u - v0.texture.u;
+			auto t1 = v0.texture.v - v1.texture.v;
+			auto t2 = v0.texture.v - v2.texture.v;
+
+			auto area = s1 * t2 - s2 * t1;
+			auto tangent = DirectX::XMVectorSubtract(DirectX::XMVectorScale(d1, t2), DirectX::XMVectorScale(d2, t1));
+			auto& face = face_tangents[t];
+			face.preserving = area > 0.0f;
+			face.valid = area != 0.0f && Dot(tangent, tangent) > 0.0f;
+			DirectX::XMStoreFloat3(&face.tangent, DirectX::XMVectorScale(DirectX::XMVector3Normalize(tangent), face.preserving ? 1.0f : -1.0f));
+		}
+	});
+
+	// Vertices that differ in nothing tangents depend on share the triangles around them through the first of them,
+	// so vertices not yet welded get the tangents they would have had welded
+	std::vector<uint64_t> hashes(vertexCount);
+	ForEachChunk(vertexCount, [&](size_t begin, size_t end)
+	{
+		for (auto v = begin; v < end; ++v)
+		{
+			TangentCorner corner(vertices[v]);
+			hashes[v] = HashBytes(corner.values, sizeof(corner.values));
+		}
+	});
+
+	auto keys = FindFirstEqual(hashes, [&](UINT a, UINT b)
+	{
+		TangentCorner corner_a(vertices[a]), corner_b(vertices[b]);
+		return std::memcmp(corner_a.values, corner_b.values, sizeof(corner_a.values)) == 0;
+	});
+
+	Adjacency adjacency(indices, triangle_count, vertexCount, keys.data());
+	ForEachChunk(vertexCount, [&](size_t begin, size_t end)
+	{
+		for (auto v = begin; v < end; ++v)
+		{
+			auto normal = LoadNormal(vertices[v]);
+			auto position = LoadPosition(vertices[v]);
+
+			// Tangents of the triangles around the vertex in the plane of its normal, weighted by the angle of their
+			// corner there. Mirrored triangles are summed apart. The side the vertex's own triangles are mostly on
+			// wins, or failing any the side with the most weight
+			DirectX::XMVECTOR sums[2] = { DirectX::XMVectorZero(), DirectX::XMVectorZero() };
+			float weights[2] = { 0.0f, 0.0f };
+			float own_weights[2] = { 0.0f, 0.0f };
+			for (auto k = adjacency.offsets[keys[v]]; k < adjacency.offsets[keys[v] + 1]; ++k)
+			{
+				auto triangle = adjacency.triangles[k];
+				auto& face = face_tangents[triangle];
+				auto corner = FindCorner(indices, keys.data(), triangle, keys[v]);
+				if (!face.valid || corner < 0)
+					continue;
+
+				auto next = LoadPosition(vertices[indices[triangle * 3 + (corner + 1) % 3]]);
+				auto previous = LoadPosition(vertices[indices[triangle * 3 + (corner + 2) % 3]]);
+				auto edge0 = ProjectOntoPlane(DirectX::XMVectorSubtract(next, position), normal);
+				auto edge1 = ProjectOntoPlane(DirectX::XMVectorSubtract(previous, position), normal);
+				auto lengths = std::sqrt(Dot(edge0, edge0) * Dot(edge1, edge1));
+				auto angle = lengths > 0.0f ? std::acos(std::clamp(Dot(edge0, edge1) / lengths, -1.0f, 1.0f)) : 0.0f;
+
+				auto tangent = DirectX::XMVector3Normalize(ProjectOntoPlane(DirectX::XMLoadFloat3(&face.tangent), normal));
+				sums[face.preserving] = DirectX::XMVectorAdd(sums[face.preserving], DirectX::XMVectorScale(tangent, angle));
+				weights[face.preserving] += angle;
+				if (FindCorner(indices, triangle, static_cast<UINT>(v)) >= 0)
+				{
+					own_weights[face.preserving] += angle;
+				}
+			}
+
+			auto preserving = own_weights[0] + own_weights[1] > 0.0f ? own_weights[1] >= own_weights[0] : weights[1] >= weights[0];
+			auto tangent = DirectX::XMVector3Normalize(ProjectOntoPlane(sums[preserving], normal));
+
+			// Vertices without a usable triangle get any tangent in the plane of the normal
+			if (Dot(tangent, tangent) == 0.0f)
+			{
+				auto axis = std::abs(DirectX::XMVectorGetX(normal)) < 0.9f ? DirectX::XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f) : DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+				tangent = DirectX::XMVector3Normalize(ProjectOntoPlane(axis, normal));
+			}
+
+			auto bi_tangent = DirectX::XMVectorScale(DirectX::XMVector3Cross(normal, tangent), preserving ? 1.0f : -1.0f);
+			DirectX::XMStoreFloat3(reinterpret_cast<DirectX::XMFLOAT3*>(&vertices[v].tangent), tangent);
+			DirectX::XMStoreFloat3(reinterpret_cast<DirectX::XMFLOAT3*>(&vertices[v].bi_tangent), bi_tangent);
+		}
+	});
+}
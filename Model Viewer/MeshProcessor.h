@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Model.h"
+
+// Geometry processing run on imported meshes in place of Assimp's post-processing steps. Large meshes are spread over
+// several workers
+namespace MeshProcessor
+{
+	// Merges vertices whose attributes are all identical, found by hashing them. The remaining vertices keep their
+	// order at the front of the array and the indices are renumbered. Returns the number of vertices left
+	size_t WeldVertices(Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount);
+
+	// Gives every vertex the area weighted normal of the triangles around its position, leaving out those facing more
+	// than smoothingAngle degrees away from its own triangles so hard edges stay hard. At 0 only its own triangles
+	// count, which is flat where vertices aren't shared. Vertices are never split, so run it before welding
+	void GenerateNormals(Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount, float smoothingAngle);
+
+	// Tangents and bi-tangents following MikkTSpace: each triangle's texture directions are projected onto the vertex
+	// normal and weighted by the angle of its corner. Triangles with mirrored texture coordinates are kept apart from
+	// the rest, and the bi-tangent is the normal crossed with the tangent, flipped for mirrored triangles. Vertices
+	// with the same position, normal and texture coordinate share their triangles, so it can run before welding
+	void GenerateTangents(Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount);
+}
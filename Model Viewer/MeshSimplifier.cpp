@@ -0,0 +1,560 @@
+#include "Pch.h"
+#include "MeshSimplifier.h"
+#include <cfloat>
+#include <numeric>
+
+namespace
+{
+	// Loop neighbours of vertices on no border, and of those on more than one
+	constexpr UINT NoVertex = ~0u;
+	constexpr UINT ManyVertices = ~1u;
+
+	// Planes along borders and seams are weighted well above the surface so outlines stay in place
+	constexpr float BorderWeight = 10.0f;
+
+	// A level of detail keeping more than this share of the triangles of the one before is not worth its indices
+	constexpr float MinLodReduction = 0.85f;
+
+	// How a vertex may be collapsed. Manifold vertices move onto any neighbour, border and seam vertices only
+	// along their border or seam, and locked vertices never move
+	enum class VertexKind : uint8_t
+	{
+		Manifold,
+		Border,
+		Seam,
+		Locked
+	};
+
+	DirectX::XMVECTOR LoadPosition(const DirectX::XMFLOAT3& position)
+	{
+		return DirectX::XMLoadFloat3(&position);
+	}
+
+	// Sum of weighted squared distances to planes, as p'Ap + 2b'p + c. The error is averaged over the total weight
+	struct Quadric
+	{
+		float a00 = 0.0f, a11 = 0.0f, a22 = 0.0f;
+		float a10 = 0.0f, a20 = 0.0f, a21 = 0.0f;
+		float b0 = 0.0f, b1 = 0.0f, b2 = 0.0f;
+		float c = 0.0f;
+		float weight = 0.0f;
+
+		void AddPlane(const DirectX::XMFLOAT3& normal, float distance, float w)
+		{
+			a00 += w * normal.x * normal.x;
+			a11 += w * normal.y * normal.y;
+			a22 += w * normal.z * normal.z;
+			a10 += w * normal.y * normal.x;
+			a20 += w * normal.z * normal.x;
+			a21 += w * normal.z * normal.y;
+			b0 += w * normal.x * distance;
+			b1 += w * normal.y * distance;
+			b2 += w * normal.z * distance;
+			c += w * distance * distance;
+			weight += w;
+		}
+
+		void Add(const Quadric& other)
+		{
+			a00 += other.a00;
+			a11 += other.a11;
+			a22 += other.a22;
+			a10 += other.a10;
+			a20 += other.a20;
+			a21 += other.a21;
+			b0 += other.b0;
+			b1 += other.b1;
+			b2 += other.b2;
+			c += other.c;
+			weight += other.weight;
+		}
+
+		float Error(const DirectX::XMFLOAT3& p) const
+		{
+			auto rx = a00 * p.x + a10 * p.y + a20 * p.z;
+			auto ry = a10 * p.x + a11 * p.y + a21 * p.z;
+			auto rz = a20 * p.x + a21 * p.y + a22 * p.z;
+			auto error = p.x * rx + p.y * ry + p.z * rz + 2.0f * (b0 * p.x + b1 * p.y + b2 * p.z) + c;
+			return weight > 0.0f ? std::abs(error) / weight : 0.0f;
+		}
+	};
+
+	// Outgoing half edges of every vertex of a triangle list
+	class EdgeAdjacency
+	{
+	public:
+		EdgeAdjacency(const std::vector<UINT>& indices, size_t vertexCount) : m_Offsets(vertexCount + 1, 0), m_Targets(indices.size())
+		{
+			for (auto index : indices)
+			{
+				++m_Offsets[index + 1];
+			}
+
+			std::partial_sum(m_Offsets.begin(), m_Offsets.end(), m_Offsets.begin());
+
+			auto cursors = m_Offsets;
+			for (size_t i = 0; i < indices.size(); i += 3)
+			{
+				for (size_t k = 0; k < 3; ++k)
+				{
+					m_Targets[cursors[indices[i + k]]++] = indices[i + (k + 1) % 3];
+				}
+			}
+		}
+
+		bool HasEdge(UINT from, UINT to) const
+		{
+			auto begin = m_Targets.begin() + m_Offsets[from];
+			auto end = m_Targets.begin() + m_Offsets[from + 1];
+			return std::find(begin, end, to) != end;
+		}
+
+		template <typename Function>
+		void ForEachEdge(UINT from, Function&& function) const
+		{
+			for (auto i = m_Offsets[from]; i < m_Offsets[from + 1]; ++i)
+			{
+				function(m_Targets[i]);
+			}
+		}
+
+	private:
+		std::vector<UINT> m_Offsets;
+		std::vector<UINT> m_Targets;
+	};
+
+	// Moving v0 onto v1, and the error it adds
+	struct Collapse
+	{
+		UINT v0 = 0;
+		UINT v1 = 0;
+		float error = 0.0f;
+	};
+
+	///<summary>
+	/// Collapses edges of a triangle list in passes, cheapest first. Vertices
+	/// sharing a position are wedges of one point and move together, so the
+	/// quadrics, triangle adjacency and locks are kept per point, found as the
+	/// first vertex at that position. Borders and seams are followed as loops
+	/// of vertices with an open edge, which move along the loop only. Positions
+	/// are scaled into the unit cube so errors are comparable across meshes.
+	///</summary>
+	class Simplifier
+	{
+	public:
+		Simplifier(const Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount) :
+			m_Indices(indices, indices + indexCount)
+		{
+			auto min = DirectX::XMVectorReplicate(FLT_MAX);
+			auto max = DirectX::XMVectorReplicate(-FLT_MAX);
+			m_Positions.resize(vertexCount);
+			for (size_t i = 0; i < vertexCount; ++i)
+			{
+				auto& position = vertices[i].position;
+				m_Positions[i] = DirectX::XMFLOAT3(position.x, position.y, position.z);
+				min = DirectX::XMVectorMin(min, LoadPosition(m_Positions[i]));
+				max = DirectX::XMVectorMax(max, LoadPosition(m_Positions[i]));
+			}
+
+			DirectX::XMFLOAT3 extent;
+			DirectX::XMStoreFloat3(&extent, DirectX::XMVectorSubtract(max, min));
+			m_Scale = std::max({ extent.x, extent.y, extent.z });
+			m_Scale = m_Scale > 0.0f ? m_Scale : 1.0f;
+			for (auto& position : m_Positions)
+			{
+				DirectX::XMStoreFloat3(&position, DirectX::XMVectorScale(DirectX::XMVectorSubtract(LoadPosition(position), min), 1.0f / m_Scale));
+			}
+
+			BuildWedges();
+
+			EdgeAdjacency adjacency(m_Indices, vertexCount);
+			ClassifyVertices(adjacency);
+			ComputeQuadrics(adjacency);
+		}
+
+		// Collapses edges until at most targetIndexCount indices are left, or the next collapse would move the surface
+		// by more than maxError model units. Calling again carries on from where the last call stopped
+		void Simplify(size_t targetIndexCount, float maxError)
+		{
+			auto error_limit = (maxError / m_Scale) * (maxError / m_Scale);
+			auto vertex_count = m_Positions.size();
+			while (m_Indices.size() > targetIndexCount)
+			{
+				BuildTriangleAdjacency();
+				PickCollapses();
+
+				// Each collapse removes about two triangles. Collapses touching a point moved this pass wait for the next,
+				// as their cost no longer holds
+				auto goal = (m_Indices.size() - targetIndexCount) / 6 + 1;
+				m_CollapseRemap.resize(vertex_count);
+				std::iota(m_CollapseRemap.begin(), m_CollapseRemap.end(), 0u);
+				m_CollapseLocked.assign(vertex_count, 0);
+
+				size_t collapsed = 0;
+				for (auto& collapse : m_Collapses)
+				{
+					if (collapsed >= goal || collapse.error > error_limit)
+						break;
+
+					auto r0 = m_Remap[collapse.v0];
+					auto r1 = m_Remap[collapse.v1];
+					if (m_CollapseLocked[r0] || m_CollapseLocked[r1] || Flips(r0, r1, m_Positions[collapse.v1]))
+						continue;
+
+					// The other wedge of a seam moves along its own side of the seam
+					if (m_Kinds[collapse.v0] == VertexKind::Seam)
+					{
+						auto w0 = m_Wedge[collapse.v0];
+						auto w1 = m_LoopOut[collapse.v0] == collapse.v1 ? m_LoopIn[w0] : m_LoopOut[w0];
+						if (w1 == NoVertex || w1 == ManyVertices || m_Remap[w1] != r1)
+							continue;
+
+						m_CollapseRemap[w0] = w1;
+					}
+
+					m_CollapseRemap[collapse.v0] = collapse.v1;
+					m_Quadrics[r1].Add(m_Quadrics[r0]);
+					m_CollapseLocked[r0] = 1;
+					m_CollapseLocked[r1] = 1;
+					m_Error = std::max(m_Error, collapse.error);
+					++collapsed;
+				}
+
+				if (collapsed == 0)
+					break;
+
+				ApplyCollapses();
+			}
+		}
+
+		const std::vector<UINT>& GetIndices() const { return m_Indices; }
+
+		// Largest error of any collapse so far, in model units
+		float GetError() const { return std::sqrt(m_Error) * m_Scale; }
+
+	private:
+		// Links the vertices sharing each position into a cycle, and points each at the first of them
+		void BuildWedges()
+		{
+			auto vertex_count = m_Positions.size();
+			std::vector<UINT> order(vertex_count);
+			std::iota(order.begin(), order.end(), 0u);
+			std::sort(order.begin(), order.end(), [&](UINT a, UINT b)
+			{
+				auto& p = m_Positions[a];
+				auto& q = m_Positions[b];
+				return std::tie(p.x, p.y, p.z, a) < std::tie(q.x, q.y, q.z, b);
+			});
+
+			m_Remap.resize(vertex_count);
+			m_Wedge.resize(vertex_count);
+			for (size_t begin = 0; begin < vertex_count;)
+			{
+				auto& position = m_Positions[order[begin]];
+				auto end = begin + 1;
+				while (end < vertex_count && m_Positions[order[end]].x == position.x && m_Positions[order[end]].y == position.y && m_Positions[order[end]].z == position.z)
+				{
+					++end;
+				}
+
+				for (auto i = begin; i < end; ++i)
+				{
+					m_Remap[order[i]] = order[begin];
+					m_Wedge[order[i]] = order[i + 1 < end ? i + 1 : begin];
+				}
+
+				begin = end;
+			}
+		}
+
+		// Finds the open edges leaving and entering each vertex, then sorts points into the kinds of VertexKind. A seam
+		// is a point with two wedges whose open edges run along the same points in opposite directions
+		void ClassifyVertices(const EdgeAdjacency& adjacency)
+		{
+			auto vertex_count = m_Positions.size();
+			m_LoopOut.assign(vertex_count, NoVertex);
+			m_LoopIn.assign(vertex_count, NoVertex);
+			for (auto from = 0u; from < vertex_count; ++from)
+			{
+				adjacency.ForEachEdge(from, [&](UINT to)
+				{
+					if (!adjacency.HasEdge(to, from))
+					{
+						m_LoopOut[from] = m_LoopOut[from] == NoVertex ? to : ManyVertices;
+						m_LoopIn[to] = m_LoopIn[to] == NoVertex ? from : ManyVertices;
+					}
+				});
+			}
+
+			auto single = [](UINT v) { return v != NoVertex && v != ManyVertices; };
+
+			m_Kinds.assign(vertex_count, VertexKind::Locked);
+			for (auto i = 0u; i < vertex_count; ++i)
+			{
+				if (m_Remap[i] != i)
+					continue;
+
+				auto kind = VertexKind::Locked;
+				auto w = m_Wedge[i];
+				if (w == i)
+				{
+					if (m_LoopOut[i] == NoVertex && m_LoopIn[i] == NoVertex)
+					{
+						kind = VertexKind::Manifold;
+					}
+					else if (single(m_LoopOut[i]) && single(m_LoopIn[i]))
+					{
+						kind = VertexKind::Border;
+					}
+				}
+				else if (m_Wedge[w] == i && single(m_LoopOut[i]) && single(m_LoopIn[i]) && single(m_LoopOut[w]) && single(m_LoopIn[w]) &&
+					m_Remap[m_LoopIn[i]] == m_Remap[m_LoopOut[w]] && m_Remap[m_LoopOut[i]] == m_Remap[m_LoopIn[w]])
+				{
+					kind = VertexKind::Seam;
+				}
+
+				for (auto v = i;;)
+				{
+					m_Kinds[v] = kind;
+					v = m_Wedge[v];
+					if (v == i)
+						break;
+				}
+			}
+		}
+
+		// Each point gets the planes of its triangles weighted by area, and open edges a plane through the edge at
+		// right angles to their triangle
+		void ComputeQuadrics(const EdgeAdjacency& adjacency)
+		{
+			m_Quadrics.assign(m_Positions.size(), Quadric());
+			for (size_t i = 0; i < m_Indices.size(); i += 3)
+			{
+				const UINT corners[3] = { m_Indices[i], m_Indices[i + 1], m_Indices[i + 2] };
+				auto p0 = LoadPosition(m_Positions[corners[0]]);
+				auto p1 = LoadPosition(m_Positions[corners[1]]);
+				auto p2 = LoadPosition(m_Positions[corners[2]]);
+
+				auto cross = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(p1, p0), DirectX::XMVectorSubtract(p2, p0));
+				auto length = DirectX::XMVectorGetX(DirectX::XMVector3Length(cross));
+				if (length <= 0.0f)
+					continue;
+
+				auto normal = DirectX::XMVectorScale(cross, 1.0f / length);
+				DirectX::XMFLOAT3 plane;
+				DirectX::XMStoreFloat3(&plane, normal);
+
+				Quadric quadric;
+				quadric.AddPlane(plane, -DirectX::XMVectorGetX(DirectX::XMVector3Dot(normal, p0)), length * 0.5f);
+				for (auto corner : corners)
+				{
+					m_Quadrics[m_Remap[corner]].Add(quadric);
+				}
+
+				for (size_t k = 0; k < 3; ++k)
+				{
+					auto i0 = corners[k];
+					auto i1 = corners[(k + 1) % 3];
+					if (adjacency.HasEdge(i1, i0))
+						continue;
+
+					auto e0 = LoadPosition(m_Positions[i0]);
+					auto edge = DirectX::XMVectorSubtract(LoadPosition(m_Positions[i1]), e0);
+					auto edge_length_squared = DirectX::XMVectorGetX(DirectX::XMVector3LengthSq(edge));
+					auto edge_normal = DirectX::XMVector3Normalize(DirectX::XMVector3Cross(edge, normal));
+					DirectX::XMStoreFloat3(&plane, edge_normal);
+
+					Quadric border;
+					border.AddPlane(plane, -DirectX::XMVectorGetX(DirectX::XMVector3Dot(edge_normal, e0)), edge_length_squared * BorderWeight);
+					m_Quadrics[m_Remap[i0]].Add(border);
+					m_Quadrics[m_Remap[i1]].Add(border);
+				}
+			}
+		}
+
+		bool CanCollapse(UINT v0, UINT v1) const
+		{
+			switch (m_Kinds[v0])
+			{
+			case VertexKind::Manifold:
+				return true;
+			case VertexKind::Border:
+			case VertexKind::Seam:
+				return m_LoopOut[v0] == v1 || m_LoopIn[v0] == v1;
+			default:
+				return false;
+			}
+		}
+
+		// Triangles around each point of the current triangles
+		void BuildTriangleAdjacency()
+		{
+			auto vertex_count = m_Positions.size();
+			m_TriangleOffsets.assign(vertex_count + 1, 0);
+			for (auto index : m_Indices)
+			{
+				++m_TriangleOffsets[m_Remap[index] + 1];
+			}
+
+			std::partial_sum(m_TriangleOffsets.begin(), m_TriangleOffsets.end(), m_TriangleOffsets.begin());
+
+			auto cursors = m_TriangleOffsets;
+			m_Triangles.resize(m_Indices.size());
+			for (size_t i = 0; i < m_Indices.size(); ++i)
+			{
+				m_Triangles[cursors[m_Remap[m_Indices[i]]]++] = static_cast<UINT>(i / 3);
+			}
+		}
+
+		// Costs every edge in whichever direction is allowed and cheaper, sorted cheapest first
+		void PickCollapses()
+		{
+			m_Collapses.clear();
+			for (size_t i = 0; i < m_Indices.size(); i += 3)
+			{
+				for (size_t k = 0; k < 3; ++k)
+				{
+					auto i0 = m_Indices[i + k];
+					auto i1 = m_Indices[i + (k + 1) % 3];
+
+					// Edges inside the surface are seen from both their triangles and only need costing once
+					auto r0 = m_Remap[i0];
+					auto r1 = m_Remap[i1];
+					if (r0 > r1 && m_LoopOut[i0] != i1)
+						continue;
+
+					auto error01 = CanCollapse(i0, i1) ? m_Quadrics[r0].Error(m_Positions[i1]) : FLT_MAX;
+					auto error10 = CanCollapse(i1, i0) ? m_Quadrics[r1].Error(m_Positions[i0]) : FLT_MAX;
+					if (error01 == FLT_MAX && error10 == FLT_MAX)
+						continue;
+
+					m_Collapses.push_back(error01 <= error10 ? Collapse{ i0, i1, error01 } : Collapse{ i1, i0, error10 });
+				}
+			}
+
+			std::sort(m_Collapses.begin(), m_Collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+		}
+
+		// Whether moving point r0 onto position turns any of its triangles kept by the collapse onto r1 around
+		bool Flips(UINT r0, UINT r1, const DirectX::XMFLOAT3& position) const
+		{
+			auto target = LoadPosition(position);
+			for (auto k = m_TriangleOffsets[r0]; k < m_TriangleOffsets[r0 + 1]; ++k)
+			{
+				auto triangle = &m_Indices[m_Triangles[k] * 3];
+				if (m_Remap[triangle[0]] == r1 || m_Remap[triangle[1]] == r1 || m_Remap[triangle[2]] == r1)
+					continue;
+
+				DirectX::XMVECTOR before[3], after[3];
+				for (int corner = 0; corner < 3; ++corner)
+				{
+					before[corner] = LoadPosition(m_Positions[triangle[corner]]);
+					after[corner] = m_Remap[triangle[corner]] == r0 ? target : before[corner];
+				}
+
+				auto normal_before = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(before[1], before[0]), DirectX::XMVectorSubtract(before[2], before[0]));
+				auto normal_after = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(after[1], after[0]), DirectX::XMVectorSubtract(after[2], after[0]));
+				if (DirectX::XMVectorGetX(DirectX::XMVector3Dot(normal_before, normal_after)) <= 0.0f)
+					return true;
+			}
+
+			return false;
+		}
+
+		// Moves the corners of collapsed vertices onto their targets, drops the triangles that collapsed to lines, and
+		// carries border and seam loops on past the vertices that left them
+		void ApplyCollapses()
+		{
+			size_t write = 0;
+			for (size_t i = 0; i < m_Indices.size(); i += 3)
+			{
+				auto a = m_CollapseRemap[m_Indices[i]];
+				auto b = m_CollapseRemap[m_Indices[i + 1]];
+				auto c = m_CollapseRemap[m_Indices[i + 2]];
+				if (m_Remap[a] == m_Remap[b] || m_Remap[b] == m_Remap[c] || m_Remap[c] == m_Remap[a])
+					continue;
+
+				m_Indices[write++] = a;
+				m_Indices[write++] = b;
+				m_Indices[write++] = c;
+			}
+
+			m_Indices.resize(write);
+
+			auto remap_loop = [&](std::vector<UINT>& loop)
+			{
+				auto previous = loop;
+				for (auto i = 0u; i < previous.size(); ++i)
+				{
+					auto next = previous[i];
+					if (next == NoVertex || next == ManyVertices)
+						continue;
+
+					// When the next vertex collapsed onto this one the loop carries on from where it went
+					auto target = m_CollapseRemap[next];
+					if (target == i)
+					{
+						target = previous[next];
+						if (target != NoVertex && target != ManyVertices)
+						{
+							target = m_CollapseRemap[target];
+						}
+					}
+
+					loop[i] = target;
+				}
+			};
+
+			remap_loop(m_LoopOut);
+			remap_loop(m_LoopIn);
+		}
+
+		std::vector<DirectX::XMFLOAT3> m_Positions;
+		float m_Scale = 1.0f;
+		std::vector<UINT> m_Indices;
+
+		// First vertex at each vertex's position, and the next vertex at it
+		std::vector<UINT> m_Remap;
+		std::vector<UINT> m_Wedge;
+
+		// Kind of each vertex and its neighbours along its border or seam
+		std::vector<VertexKind> m_Kinds;
+		std::vector<UINT> m_LoopOut;
+		std::vector<UINT> m_LoopIn;
+
+		std::vector<Quadric> m_Quadrics;
+		float m_Error = 0.0f;
+
+		// Working state of a pass
+		std::vector<UINT> m_TriangleOffsets;
+		std::vector<UINT> m_Triangles;
+		std::vector<Collapse> m_Collapses;
+		std::vector<UINT> m_CollapseRemap;
+		std::vector<uint8_t> m_CollapseLocked;
+	};
+}
+
+std::vector<MeshSimplifier::Lod> MeshSimplifier::BuildLods(const Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount, unsigned count, float ratio, float maxError)
+{
+	std::vector<Lod> lods;
+	if (count < 2 || indexCount < 3)
+		return lods;
+
+	// Each level carries on from the last, so errors build up along the chain as they would in the mesh
+	Simplifier simplifier(vertices, vertexCount, indices, indexCount);
+	auto previous = indexCount;
+	for (auto lod = 1u; lod < count; ++lod)
+	{
+		auto target = static_cast<size_t>(previous / 3 * ratio) * 3;
+		simplifier.Simplify(target, maxError);
+
+		auto& result = simplifier.GetIndices();
+		if (result.empty() || result.size() > previous * MinLodReduction)
+			break;
+
+		lods.push_back({ result, simplifier.GetError() });
+		previous = result.size();
+	}
+
+	return lods;
+}
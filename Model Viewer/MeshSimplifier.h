@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Model.h"
+
+// Quadric error edge collapse simplification. Vertices are only ever collapsed onto other existing vertices, so
+// every level of detail is an index list into the same vertices as the full mesh
+namespace MeshSimplifier
+{
+	// Triangles of one level of detail, with indices local to the vertices given
+	struct Lod
+	{
+		std::vector<UINT> indices;
+
+		// Largest distance, in model units, the simplified surface is estimated to have moved from the full mesh
+		float error = 0.0f;
+	};
+
+	// Builds up to count - 1 coarser levels of detail from a triangle list, each with about ratio of the triangles
+	// of the one before. Stops early once collapsing further would move the surface by more than maxError, or no
+	// longer removes enough triangles to be worth another index list. UV and normal seams, and open borders, are
+	// only collapsed along themselves so the outline and texture layout hold
+	std::vector<Lod> BuildLods(const Vertex* vertices, size_t vertexCount, const UINT* indices, size_t indexCount, unsigned count, float ratio, float maxError);
+}
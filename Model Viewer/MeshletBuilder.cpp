@@ -0,0 +1,228 @@
+#include "Pch.h"
+#include "MeshletBuilder.h"
+#include <numeric>
+#include <cfloat>
+
+namespace
+{
+	constexpr UINT NoTriangle = ~0u;
+
+	// Cones wider than this, as the cosine of their half angle, can't face away from any eye and are never culled
+	constexpr float MinConeSpread = 0.1f;
+
+	DirectX::XMVECTOR LoadPosition(const Vertex& vertex)
+	{
+		return DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertex.position));
+	}
+
+	// Bounding sphere and normal cone of a meshlet's triangles
+	void ComputeMeshletBounds(const Vertex* vertices, const UINT* indices, const std::vector<UINT>& meshletVertices, Meshlet* meshlet)
+	{
+		std::vector<DirectX::XMFLOAT3> points(meshletVertices.size());
+		for (size_t i = 0; i < meshletVertices.size(); ++i)
+		{
+			DirectX::XMStoreFloat3(&points[i], LoadPosition(vertices[meshletVertices[i]]));
+		}
+
+		DirectX::BoundingSphere::CreateFromPoints(meshlet->sphere, points.size(), points.data(), sizeof(DirectX::XMFLOAT3));
+
+		// The axis is the average triangle normal and the cutoff the sine of the widest angle from it to any of them
+		std::vector<DirectX::XMVECTOR> normals;
+		normals.reserve(meshlet->totalIndex / 3);
+		auto axis = DirectX::XMVectorZero();
+		for (auto i = meshlet->startIndex; i < meshlet->startIndex + meshlet->totalIndex; i += 3)
+		{
+			auto p0 = LoadPosition(vertices[indices[i]]);
+			auto p1 = LoadPosition(vertices[indices[i + 1]]);
+			auto p2 = LoadPosition(vertices[indices[i + 2]]);
+			auto normal = DirectX::XMVector3Cross(DirectX::XMVectorSubtract(p1, p0), DirectX::XMVectorSubtract(p2, p0));
+			if (DirectX::XMVectorGetX(DirectX::XMVector3LengthSq(normal)) <= 0.0f)
+				continue;
+
+			normals.push_back(DirectX::XMVector3Normalize(normal));
+			axis = DirectX::XMVectorAdd(axis, normals.back());
+		}
+
+		meshlet->coneCutoff = 1.0f;
+		if (normals.empty() || DirectX::XMVectorGetX(DirectX::XMVector3LengthSq(axis)) <= 0.0f)
+			return;
+
+		axis = DirectX::XMVector3Normalize(axis);
+		auto min_dot = 1.0f;
+		for (auto& normal : normals)
+		{
+			min_dot = std::min(min_dot, DirectX::XMVectorGetX(DirectX::XMVector3Dot(normal, axis)));
+		}
+
+		DirectX::XMStoreFloat3(&meshlet->coneAxis, axis);
+		if (min_dot > MinConeSpread)
+		{
+			meshlet->coneCutoff = std::sqrt(1.0f - min_dot * min_dot);
+		}
+	}
+}
+
+std::vector<Meshlet> MeshletBuilder::Build(const Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount, unsigned maxVertices, unsigned maxTriangles)
+{
+	std::vector<Meshlet> meshlets;
+	auto triangle_count = indexCount / 3;
+	if (triangle_count == 0 || maxVertices < 3 || maxTriangles == 0)
+		return meshlets;
+
+	// Triangles using each vertex
+	std::vector<UINT> offsets(vertexCount + 1, 0);
+	for (size_t i = 0; i < triangle_count * 3; ++i)
+	{
+		++offsets[indices[i] + 1];
+	}
+
+	std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+	std::vector<UINT> vertex_triangles(triangle_count * 3);
+	auto cursors = offsets;
+	for (size_t i = 0; i < triangle_count * 3; ++i)
+	{
+		vertex_triangles[cursors[indices[i]]++] = static_cast<UINT>(i / 3);
+	}
+
+	// Meshlet each vertex was last added to, so membership of the one being grown is a single compare
+	std::vector<UINT> owner(vertexCount, ~0u);
+	std::vector<uint8_t> emitted(triangle_count, 0);
+	std::vector<UINT> meshlet_vertices;
+	std::vector<UINT> output;
+	output.reserve(triangle_count * 3);
+
+	auto current = 0u;
+	auto new_vertices = [&](UINT triangle)
+	{
+		auto count = 0u;
+		for (int k = 0; k < 3; ++k)
+		{
+			count += owner[indices[triangle * 3 + k]] != current;
+		}
+
+		return count;
+	};
+
+	// Unemitted triangle around the given vertices adding the fewest new vertices to the meshlet, and of those the
+	// nearest its centre so meshlets grow round rather than in strips
+	auto centre = DirectX::XMVectorZero();
+	auto best_neighbour = [&](const UINT* around, size_t count, UINT& best, unsigned& best_cost, float& best_distance)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			for (auto k = offsets[around[i]]; k < offsets[around[i] + 1]; ++k)
+			{
+				auto triangle = vertex_triangles[k];
+				if (emitted[triangle])
+					continue;
+
+				auto cost = new_vertices(triangle);
+				if (cost > best_cost)
+					continue;
+
+				auto corners = &indices[triangle * 3];
+				auto sum = DirectX::XMVectorAdd(LoadPosition(vertices[corners[0]]), DirectX::XMVectorAdd(LoadPosition(vertices[corners[1]]), LoadPosition(vertices[corners[2]])));
+				auto distance = DirectX::XMVectorGetX(DirectX::XMVector3LengthSq(DirectX::XMVectorSubtract(DirectX::XMVectorScale(sum, 1.0f / 3.0f), centre)));
+				if (cost < best_cost || distance < best_distance)
+				{
+					best = triangle;
+					best_cost = cost;
+					best_distance = distance;
+				}
+			}
+		}
+	};
+
+	size_t next_seed = 0;
+	while (true)
+	{
+		// Start next to the last meshlet while it has unemitted neighbours, which keeps meshlets close in the buffer
+		auto seed = NoTriangle;
+		for (auto vertex : meshlet_vertices)
+		{
+			for (auto k = offsets[vertex]; k < offsets[vertex + 1] && seed == NoTriangle; ++k)
+			{
+				seed = emitted[vertex_triangles[k]] ? NoTriangle : vertex_triangles[k];
+			}
+
+			if (seed != NoTriangle)
+				break;
+		}
+
+		while (seed == NoTriangle && next_seed < triangle_count)
+		{
+			seed = emitted[next_seed] ? NoTriangle : static_cast<UINT>(next_seed);
+			++next_seed;
+		}
+
+		if (seed == NoTriangle)
+			break;
+
+		Meshlet meshlet;
+		meshlet.startIndex = static_cast<unsigned>(output.size());
+		meshlet_vertices.clear();
+
+		// Grow from the neighbours of the latest triangle first, falling back to those of the whole meshlet when
+		// they would all add more than one vertex
+		auto triangle = seed;
+		auto triangles = 0u;
+		auto vertex_sum = DirectX::XMVectorZero();
+		while (true)
+		{
+			emitted[triangle] = 1;
+			for (int k = 0; k < 3; ++k)
+			{
+				auto vertex = indices[triangle * 3 + k];
+				if (owner[vertex] != current)
+				{
+					owner[vertex] = current;
+					meshlet_vertices.push_back(vertex);
+					vertex_sum = DirectX::XMVectorAdd(vertex_sum, LoadPosition(vertices[vertex]));
+				}
+
+				output.push_back(vertex);
+			}
+
+			if (++triangles == maxTriangles)
+				break;
+
+			centre = DirectX::XMVectorScale(vertex_sum, 1.0f / meshlet_vertices.size());
+			auto best = NoTriangle;
+			auto best_cost = 3u;
+			auto best_distance = FLT_MAX;
+			best_neighbour(&indices[triangle * 3], 3, best, best_cost, best_distance);
+			if (best_cost > 1)
+			{
+				best_neighbour(meshlet_vertices.data(), meshlet_vertices.size(), best, best_cost, best_distance);
+			}
+
+			if (best == NoTriangle || meshlet_vertices.size() + best_cost > maxVertices)
+				break;
+
+			triangle = best;
+		}
+
+		meshlet.totalIndex = static_cast<unsigned>(output.size()) - meshlet.startIndex;
+		meshlets.push_back(meshlet);
+		++current;
+	}
+
+	std::copy(output.begin(), output.end(), indices);
+
+	for (auto& meshlet : meshlets)
+	{
+		meshlet_vertices.clear();
+		for (auto i = meshlet.startIndex; i < meshlet.startIndex + meshlet.totalIndex; ++i)
+		{
+			if (std::find(meshlet_vertices.begin(), meshlet_vertices.end(), indices[i]) == meshlet_vertices.end())
+			{
+				meshlet_vertices.push_back(indices[i]);
+			}
+		}
+
+		ComputeMeshletBounds(vertices, indices, meshlet_vertices, &meshlet);
+	}
+
+	return meshlets;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "Model.h"
+
+// Splits triangle lists into meshlets, small clusters of neighbouring triangles that can be culled on their own
+namespace MeshletBuilder
+{
+	// Reorders a triangle list in place into meshlets of at most maxVertices vertices and maxTriangles triangles, each
+	// grown from its neighbouring triangles. Returns the meshlets, with index ranges relative to indices
+	std::vector<Meshlet> Build(const Vertex* vertices, size_t vertexCount, UINT* indices, size_t indexCount, unsigned maxVertices, unsigned maxTriangles);
+}
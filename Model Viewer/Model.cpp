@@ -3,10 +3,39 @@
 #include "Renderer.h"
 #include "Shader.h"
 #include "ModelLoader.h"
+#include "MeshCache.h"
+#include "Pose.h"
+#include "FrameArena.h"
+#include "Camera.h"
+
+namespace
+{
+	// The three smallest components of a unit quaternion lie within +-1/sqrt(2)
+	constexpr float QuaternionComponentRange = 0.707106781f;
+	constexpr uint64_t QuaternionComponentMax = (1u << 15) - 1;
+	constexpr float TranslationMax = 65535.0f;
+
+	// Coarser levels of detail are drawn while the error they add covers at most this many pixels
+	constexpr float LodPixelError = 1.0f;
+
+	// Closest distance levels of detail are chosen for, keeping the camera inside a bounding sphere at the full mesh
+	constexpr float LodMinDistance = 1.0e-3f;
+
+	template <typename T>
+	size_t GetTrackMemoryUsage(const KeyframeTrack<T>& track)
+	{
+		return track.Keys.Times.size() * sizeof(float) + track.Values.size() * sizeof(T);
+	}
+}
 
 Model::Model(IRenderer* renderer, IShader* shader) : m_Shader(shader)
 {
 	m_Renderer = reinterpret_cast<DXRenderer*>(renderer);
+	m_PoseEvaluator = std::make_unique<PoseEvaluator>();
+
+	// A single instance at the origin until placed otherwise
+	m_Instances.resize(1);
+	DirectX::XMStoreFloat4x4(&m_Instances.front().transform, DirectX::XMMatrixIdentity());
 }
 
 Model::~Model()
@@ -15,18 +44,49 @@ Model::~Model()
 
 bool Model::Load(const std::string& path)
 {
+	// Prefer the binary cache and only fall back to Assimp when it is missing or stale
+	ModelLoader::ImportSettings settings;
+	auto start_time = std::chrono::high_resolution_clock::now();
 	m_MeshData = std::make_unique<MeshData>();
-	if (!ModelLoader::Load(path, m_MeshData.get()))
+	if (MeshCache::Load(path, settings, m_MeshData.get()))
+	{
+		auto load_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time);
+		std::cout << "Loaded " << path << " from cache in " << load_time.count() << " ms\n";
+	}
+	else
 	{
-		return false;
+		m_MeshData = std::make_unique<MeshData>();
+		if (!ModelLoader::Load(path, m_MeshData.get(), settings))
+		{
+			return false;
+		}
+
+		auto load_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time);
+		std::cout << "Imported " << path << " with Assimp in " << load_time.count() << " ms\n";
+
+		if (!MeshCache::Save(path, settings, *m_MeshData))
+		{
+			std::cerr << "Failed to write mesh cache " << MeshCache::GetCachePath(path) << '\n';
+		}
 	}
 
+	for (auto& instance : m_Instances)
+	{
+		instance.cursors.assign(m_MeshData->bones.size(), {});
+	}
+
+	m_PoseDirty = true;
+
 	// Create vertex buffer
 	m_VertexBuffer = m_Renderer->CreateVertexBuffer(m_MeshData->vertices);
 
 	// Create index buffer
 	m_IndexBuffer = m_Renderer->CreateIndexBuffer(m_MeshData->indices);
 
+	// Create draw commands
+	CreateDrawBatch();
+	SelectOccluders();
+
 	// Load mr texture
 	m_DiffuseTexture = m_Renderer->CreateTexture2D("Data Files/Textures/crate_diffuse.dds");
 	m_NormalTexture = m_Renderer->CreateTexture2D("Data Files/Textures/crate_normal.dds");
@@ -34,57 +94,221 @@ bool Model::Load(const std::string& path)
 	return true;
 }
 
-void Model::Update(float dt)
+void Model::Update(float dt, FrameArena& arena)
 {
-	static float TimeInSeconds = 0.0f;
-	TimeInSeconds += dt * 100.0f;
-
-	auto numBones = m_MeshData->bones.size();
-	std::vector<DirectX::XMMATRIX> toParentTransforms(numBones);
+	m_PoseUpdates = {};
 
-	// Animation
-	ShaderData::BoneBuffer bone_buffer = {};
+	// Skip the pose when nothing that affects it has changed since it was last evaluated
 	auto clip = m_MeshData->animations.find("Take1");
-	if (clip != m_MeshData->animations.end())
+	auto playing = clip != m_MeshData->animations.end() && !m_Paused && clip->second.GetClipEndTime() > clip->second.GetClipStartTime();
+	if (!playing && !m_PoseDirty)
+	{
+		m_PoseUpdates.skipped += static_cast<unsigned>(m_Instances.size());
+		return;
+	}
+
+	m_PoseDirty = false;
+
+	// Each instance plays the clip from its own time
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (auto& instance : m_Instances)
 	{
-		clip->second.Interpolate(TimeInSeconds, toParentTransforms);
-		if (TimeInSeconds > clip->second.GetClipEndTime())
+		if (playing)
 		{
-			TimeInSeconds = 0.0f;
+			instance.time += dt * 100.0f;
 		}
 
-		// Transform to root
-		std::vector<DirectX::XMMATRIX> toRootTransforms(numBones);
-		toRootTransforms[0] = toParentTransforms[0];
-		for (UINT i = 1; i < numBones; ++i)
+		EvaluatePose(instance, clip != m_MeshData->animations.end() ? &clip->second : nullptr, arena);
+		ComputePoseBounds(instance);
+		++m_PoseUpdates.performed;
+	}
+
+	UpdateCullingBounds();
+
+	// Smooth the timing over recent frames so the overlay is readable
+	auto pose_time = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start_time);
+	auto numBones = m_MeshData->bones.size() * m_Instances.size();
+	if (clip != m_MeshData->animations.end() && numBones > 0)
+	{
+		m_PoseTimePerBone += (pose_time.count() / numBones - m_PoseTimePerBone) * 0.05;
+	}
+}
+
+void Model::EvaluatePose(Instance& instance, const AnimationClip* clip, FrameArena& arena)
+{
+	// Animation. The palette covers the whole skeleton, each subset picks its bones out of it when drawn
+	auto numBones = m_MeshData->bones.size();
+	auto rows = GetPaletteRowsPerBone(m_SkinningMode);
+	instance.palette.resize(numBones * rows);
+
+	if (clip == nullptr)
+	{
+		// Without animation every bone stays in its bind pose
+		for (size_t i = 0; i < numBones; ++i)
 		{
-			DirectX::XMMATRIX toParent = toParentTransforms[i];
-			DirectX::XMMATRIX parentToRoot = toRootTransforms[m_MeshData->bones[i].parentId];
-			toRootTransforms[i] = XMMatrixMultiply(toParent, parentToRoot);
+			StoreBoneTransform(DirectX::XMMatrixIdentity(), m_SkinningMode, &instance.palette[i * rows]);
 		}
 
-		// Transform bone
-		for (size_t i = 0; i < m_MeshData->bones.size(); i++)
+		return;
+	}
+
+	if (m_PoseEvaluation == PoseEvaluation::Reference)
+	{
+		auto palette = EvaluateReferencePose(*clip, instance.time, instance.cursors, arena);
+		for (size_t i = 0; i < numBones; ++i)
 		{
-			DirectX::XMMATRIX offset = m_MeshData->bones[i].offset;
-			DirectX::XMMATRIX toRoot = toRootTransforms[i];
-			DirectX::XMMATRIX matrix = DirectX::XMMatrixMultiply(offset, toRoot);
-			bone_buffer.transform[i] = DirectX::XMMatrixTranspose(matrix);
+			StoreBoneTransform(palette[i], m_SkinningMode, &instance.palette[i * rows]);
 		}
 	}
 	else
 	{
-		bone_buffer.transform[0] = DirectX::XMMatrixIdentity();
+		auto blend = m_PoseEvaluation == PoseEvaluation::BatchedSlerp ? RotationBlend::Slerp : RotationBlend::Nlerp;
+		m_PoseEvaluator->Evaluate(*clip, m_MeshData->bones, instance.time, blend, instance.cursors, m_SkinningMode, instance.palette.data(), numBones);
+	}
+
+#ifdef _DEBUG
+	// Check the palette against the full matrix reference path. The first instance is enough
+	if (m_PoseEvaluation != PoseEvaluation::Reference && &instance == &m_Instances.front())
+	{
+		auto reference = EvaluateReferencePose(*clip, instance.time, instance.cursors, arena);
+
+		auto max_error = 0.0f;
+		for (size_t i = 0; i < numBones; ++i)
+		{
+			DirectX::XMFLOAT4 expected[3];
+			StoreBoneTransform(reference[i], m_SkinningMode, expected);
+			for (size_t row = 0; row < rows; ++row)
+			{
+				auto error = DirectX::XMVectorAbs(DirectX::XMVectorSubtract(XMLoadFloat4(&expected[row]), XMLoadFloat4(&instance.palette[i * rows + row])));
+				auto scale = DirectX::XMVectorMax(DirectX::XMVectorSplatOne(), DirectX::XMVectorAbs(XMLoadFloat4(&expected[row])));
+				auto relative = DirectX::XMVectorDivide(error, scale);
+				max_error = std::max({ max_error, DirectX::XMVectorGetX(relative), DirectX::XMVectorGetY(relative), DirectX::XMVectorGetZ(relative), DirectX::XMVectorGetW(relative) });
+			}
+		}
+
+		static bool reported = false;
+		if (max_error > 1.0e-3f && !reported)
+		{
+			std::cerr << "Bone palette differs from the reference by " << max_error << '\n';
+			reported = true;
+		}
+	}
+#endif
+
+	if (instance.time > clip->GetClipEndTime())
+	{
+		instance.time = 0.0f;
+	}
+}
+
+void Model::ComputePoseBounds(Instance& instance)
+{
+	// Only the bones influencing vertices have bounds, and moving their corners by the palette covers the skinned
+	// vertices without touching them
+	auto rows = GetPaletteRowsPerBone(m_SkinningMode);
+	auto& bone_bounds = m_MeshData->boneBounds;
+	m_PosedBoneBounds.resize(bone_bounds.size());
+	for (size_t i = 0; i < bone_bounds.size(); ++i)
+	{
+		if (bone_bounds[i].Extents.x < 0.0f)
+		{
+			m_PosedBoneBounds[i] = bone_bounds[i];
+			continue;
+		}
+
+		bone_bounds[i].Transform(m_PosedBoneBounds[i], LoadBoneTransform(&instance.palette[i * rows], m_SkinningMode));
+	}
+
+	// Each subset covers the bones it uses, while subsets without bones keep their bind pose
+	auto& subsets = m_MeshData->subsets;
+	auto& subset_bones = m_MeshData->subsetBones;
+	std::optional<DirectX::BoundingBox> bounds;
+	instance.subsetBounds.resize(subsets.size());
+	for (size_t s = 0; s < subsets.size(); ++s)
+	{
+		auto& subset = subsets[s];
+		std::optional<DirectX::BoundingBox> posed;
+		for (auto i = 0u; i < subset.boneCount; ++i)
+		{
+			auto& box = m_PosedBoneBounds[subset_bones[subset.boneStart + i]];
+			if (box.Extents.x >= 0.0f)
+			{
+				posed ? DirectX::BoundingBox::CreateMerged(*posed, *posed, box) : void(posed = box);
+			}
+		}
+
+		instance.subsetBounds[s] = posed.value_or(subset.box);
+		if (subset.totalIndex > 0)
+		{
+			bounds ? DirectX::BoundingBox::CreateMerged(*bounds, *bounds, instance.subsetBounds[s]) : void(bounds = instance.subsetBounds[s]);
+		}
+	}
+
+	instance.bounds = bounds.value_or(m_MeshData->box);
+}
+
+void Model::UpdateCullingBounds()
+{
+	auto& subsets = m_MeshData->subsets;
+	auto& meshlets = m_MeshData->meshlets;
+	auto instance_count = m_Instances.size();
+	std::optional<DirectX::BoundingBox> bounds;
+	m_CullingBounds.Resize(subsets.size() * instance_count);
+	m_MeshletBounds.Resize(meshlets.size() * instance_count);
+	for (size_t i = 0; i < instance_count; ++i)
+	{
+		auto& instance = m_Instances[i];
+		auto transform = XMLoadFloat4x4(&instance.transform);
+
+		// Box centres are moved by the transform and extents by its absolute value. Spheres grow by the largest scale
+		auto abs_transform = transform;
+		auto scale = 0.0f;
+		for (int row = 0; row < 3; ++row)
+		{
+			abs_transform.r[row] = DirectX::XMVectorAbs(transform.r[row]);
+			scale = std::max(scale, DirectX::XMVectorGetX(DirectX::XMVector3Length(transform.r[row])));
+		}
+
+		instance.scale = scale;
+
+		for (size_t s = 0; s < subsets.size(); ++s)
+		{
+			auto& box = instance.subsetBounds[s];
+			DirectX::BoundingBox world;
+			DirectX::XMStoreFloat3(&world.Center, DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&box.Center), transform));
+			DirectX::XMStoreFloat3(&world.Extents, DirectX::XMVector3TransformNormal(DirectX::XMLoadFloat3(&box.Extents), abs_transform));
+
+			// Subsets without bones keep their tighter bind pose sphere, posed ones only have their box
+			auto radius = subsets[s].boneCount == 0 ? subsets[s].sphere.Radius * scale :
+				DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMLoadFloat3(&world.Extents)));
+
+			m_CullingBounds.Set(s * instance_count + i, world, radius);
+			if (subsets[s].totalIndex > 0)
+			{
+				bounds ? DirectX::BoundingBox::CreateMerged(*bounds, *bounds, world) : void(bounds = world);
+			}
+		}
+
+		// Meshlets belong to unskinned subsets, so their bounds only follow the instance
+		for (size_t m = 0; m < meshlets.size(); ++m)
+		{
+			auto& sphere = meshlets[m].sphere;
+			auto radius = sphere.Radius * scale;
+			DirectX::BoundingBox world;
+			DirectX::XMStoreFloat3(&world.Center, DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&sphere.Center), transform));
+			world.Extents = DirectX::XMFLOAT3(radius, radius, radius);
+			m_MeshletBounds.Set(i * meshlets.size() + m, world, radius);
+		}
 	}
 
-	// Update bone buffer
-	m_Shader->UpdateBones(bone_buffer);
+	m_Bounds = bounds.value_or(m_MeshData->box);
 }
 
 void Model::Render(Camera* camera)
 {
 	// Bind the vertex buffer
 	m_Renderer->ApplyVertexBuffer(m_VertexBuffer.get());
+	m_Renderer->ApplyInstanceBuffer(m_InstanceBuffer.get());
 
 	// Bind the index buffer
 	m_Renderer->ApplyIndexBuffer(m_IndexBuffer.get());
@@ -93,75 +317,751 @@ void Model::Render(Camera* camera)
 	m_Renderer->ApplyTexture2D(0, m_DiffuseTexture.get());
 	m_Renderer->ApplyTexture2D(1, m_NormalTexture.get());
 
-	// Set topology
-	m_Renderer->SetPrimitiveTopology();
+	// Frustum culling, testing every subset of every instance at once
+	auto cull_start_time = std::chrono::high_resolution_clock::now();
+	auto instance_count = m_Instances.size();
+	auto object_count = m_CullingBounds.Size();
+	auto visible_count = object_count;
+	m_Visible.resize(object_count);
+	if (m_FrustumCulling)
+	{
+		visible_count = Culling::Cull(camera->GetFrustumPlanes(), m_CullingBounds, m_Visible.data());
+	}
+	else
+	{
+		std::fill(m_Visible.begin(), m_Visible.end(), static_cast<uint8_t>(1));
+	}
+
+	// Occlusion culling of what is in view, against the occluders of every instance in view
+	auto in_view_count = visible_count;
+	m_DrawStats.occluderTriangles = 0;
+	if (m_OcclusionCulling && !m_Occluders.empty())
+	{
+		auto raster_start_time = std::chrono::high_resolution_clock::now();
+		m_OcclusionBuffer.Begin(DirectX::XMMatrixMultiply(camera->GetView(), camera->GetProjection()));
+		for (size_t i = 0; i < instance_count; ++i)
+		{
+			auto world = XMLoadFloat4x4(&m_Instances[i].transform);
+			for (auto& occluder : m_Occluders)
+			{
+				if (m_Visible[occluder.subset * instance_count + i])
+				{
+					m_OcclusionBuffer.Rasterize(&m_OccluderPositions[occluder.firstVertex], occluder.vertexCount,
+						&m_OccluderIndices[occluder.firstIndex], occluder.indexCount, world);
+				}
+			}
+		}
+
+		m_OcclusionBuffer.End();
+
+		auto raster_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - raster_start_time);
+		m_DrawStats.rasterTime += (raster_time.count() - m_DrawStats.rasterTime) * 0.05;
+		m_DrawStats.occluderTriangles = static_cast<unsigned>(m_OcclusionBuffer.GetTriangleCount());
+
+		visible_count -= m_OcclusionBuffer.Cull(m_CullingBounds, m_Visible.data());
+	}
+
+	SelectLods(camera);
+
+	// Meshlets of every instance are tested against the frustum at once. Facing away is tested as they are drawn
+	auto use_meshlets = m_MeshletCulling && !m_MeshData->meshlets.empty();
+	m_DrawStats.meshletsTested = 0;
+	m_DrawStats.meshletsOutside = 0;
+	m_DrawStats.meshletsBackFacing = 0;
+	if (use_meshlets)
+	{
+		m_MeshletVisible.resize(m_MeshletBounds.Size());
+		if (m_FrustumCulling)
+		{
+			Culling::Cull(camera->GetFrustumPlanes(), m_MeshletBounds, m_MeshletVisible.data());
+		}
+		else
+		{
+			std::fill(m_MeshletVisible.begin(), m_MeshletVisible.end(), static_cast<uint8_t>(1));
+		}
+
+		auto position = camera->GetPosition();
+		auto eye = DirectX::XMLoadFloat3(&position);
+		m_InstanceEyes.resize(instance_count);
+		for (size_t i = 0; i < instance_count; ++i)
+		{
+			auto to_model = DirectX::XMMatrixInverse(nullptr, XMLoadFloat4x4(&m_Instances[i].transform));
+			DirectX::XMStoreFloat3(&m_InstanceEyes[i], DirectX::XMVector3TransformCoord(eye, to_model));
+		}
+	}
+
+	// Consecutive visible instances of a subset at the same level of detail share one instanced draw. Subsets split
+	// into meshlets are drawn instance by instance in full detail, with only their meshlets that can be seen
+	m_VisibleCommands.clear();
+	m_InstanceVisible.assign(instance_count, 0);
+	m_DrawStats.lodTriangles = {};
+	for (auto& run : m_DrawRuns)
+	{
+		run.visibleFirst = static_cast<UINT>(m_VisibleCommands.size());
+		for (auto s = run.firstCommand; s < run.firstCommand + run.commandCount; ++s)
+		{
+			auto visible = &m_Visible[s * instance_count];
+			auto lods = &m_Lods[s * instance_count];
+			for (size_t i = 0; i < instance_count;)
+			{
+				if (!visible[i])
+				{
+					++i;
+					continue;
+				}
+
+				auto lod = lods[i];
+				if (use_meshlets && lod == 0 && m_MeshData->subsets[s].meshletCount > 0)
+				{
+					auto triangles = AddMeshletCommands(s, i);
+					m_InstanceVisible[i] |= triangles > 0;
+					m_DrawStats.lodTriangles[0] += triangles;
+					++i;
+					continue;
+				}
+
+				auto& subset_lod = m_MeshData->subsets[s].lods[lod];
+				auto command = m_Commands[s];
+				command.firstIndex = subset_lod.startIndex;
+				command.indexCount = subset_lod.totalIndex;
+				command.baseInstance = static_cast<UINT>(i);
+				for (; i < instance_count && visible[i] && lods[i] == lod; ++i)
+				{
+					m_InstanceVisible[i] = 1;
+				}
+
+				command.instanceCount = static_cast<UINT>(i) - command.baseInstance;
+				m_VisibleCommands.push_back(command);
+				m_DrawStats.lodTriangles[lod] += subset_lod.totalIndex / 3 * command.instanceCount;
+			}
+		}
+
+		run.visibleCount = static_cast<UINT>(m_VisibleCommands.size()) - run.visibleFirst;
+	}
+
+	m_Renderer->UpdateDrawBatch(m_DrawBatch.get(), m_VisibleCommands);
+
+	auto cull_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - cull_start_time);
+	m_DrawStats.cullTime += (cull_time.count() - m_DrawStats.cullTime) * 0.05;
+
+	// Render geometry. A single instance uploads only the bones each run of subsets uses, then draws all of them at once
+	auto start_time = std::chrono::high_resolution_clock::now();
+	auto rows = GetPaletteRowsPerBone(m_SkinningMode);
+	unsigned batches = 0;
+	if (m_Instances.size() == 1)
+	{
+		for (auto& run : m_DrawRuns)
+		{
+			if (run.visibleCount == 0)
+				continue;
+
+			m_SubsetPalette.resize(std::max(run.subset->boneCount, 1u) * rows);
+			GatherSubsetPalette(m_Instances.front(), *run.subset, m_SubsetPalette.data());
+
+			m_Shader->UpdateBones(m_SkinningMode, m_SubsetPalette.data(), m_SubsetPalette.size());
+			m_Renderer->DrawBatched(m_DrawBatch.get(), run.visibleFirst, run.visibleCount);
+			++batches;
+		}
+	}
+	else
+	{
+		// Many instances upload every run's palette of every visible instance together, then each run is drawn
+		// with instanced draws
+		auto rows_per_instance = m_PaletteBonesPerInstance * rows;
+		m_InstancePalettes.resize(m_Instances.size() * rows_per_instance);
+		for (size_t i = 0; i < m_Instances.size(); ++i)
+		{
+			if (!m_InstanceVisible[i])
+				continue;
+
+			for (auto& run : m_DrawRuns)
+			{
+				GatherSubsetPalette(m_Instances[i], *run.subset, &m_InstancePalettes[i * rows_per_instance + run.boneOffset * rows]);
+			}
+		}
+
+		m_Shader->UpdateInstancePalettes(m_InstancePalettes.data(), m_InstancePalettes.size());
+		for (auto& run : m_DrawRuns)
+		{
+			if (run.visibleCount == 0)
+				continue;
+
+			m_Shader->UpdateBoneOffset(m_SkinningMode, run.boneOffset);
+			m_Renderer->DrawBatched(m_DrawBatch.get(), run.visibleFirst, run.visibleCount);
+			++batches;
+		}
+	}
+
+	auto submit_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time);
+	m_DrawStats.submitTime += (submit_time.count() - m_DrawStats.submitTime) * 0.05;
+	m_DrawStats.subsets = static_cast<unsigned>(visible_count);
+	m_DrawStats.batches = batches;
+	m_DrawStats.tested = m_FrustumCulling ? static_cast<unsigned>(object_count) : 0;
+	m_DrawStats.culled = static_cast<unsigned>(object_count - in_view_count);
+	m_DrawStats.occluded = static_cast<unsigned>(in_view_count - visible_count);
+}
+
+void Model::CreateDrawBatch()
+{
+	auto& subsets = m_MeshData->subsets;
+	auto& subset_bones = m_MeshData->subsetBones;
+
+	std::vector<DrawCommand> commands(subsets.size());
+	m_DrawRuns.clear();
+	m_PaletteBonesPerInstance = 0;
+	for (size_t i = 0; i < subsets.size(); ++i)
+	{
+		auto& subset = subsets[i];
+		commands[i].indexCount = subset.totalIndex;
+		commands[i].firstIndex = subset.startIndex;
+		commands[i].baseVertex = static_cast<INT>(subset.baseVertex);
+		commands[i].instanceCount = static_cast<UINT>(m_Instances.size());
+
+		// Subsets using the same bones, including those using none, share one palette upload
+		if (!m_DrawRuns.empty())
+		{
+			auto& previous = *m_DrawRuns.back().subset;
+			auto same_bones = previous.boneCount == subset.boneCount && std::equal(subset_bones.begin() + previous.boneStart,
+				subset_bones.begin() + previous.boneStart + previous.boneCount, subset_bones.begin() + subset.boneStart);
+
+			if (same_bones)
+			{
+				++m_DrawRuns.back().commandCount;
+				continue;
+			}
+		}
+
+		m_DrawRuns.push_back({ &subset, static_cast<UINT>(i), 1, m_PaletteBonesPerInstance });
+		m_PaletteBonesPerInstance += std::max(subset.boneCount, 1u);
+	}
+
+	// Culling rewrites the batch every frame from these
+	m_DrawBatch = m_Renderer->CreateDrawBatch(commands);
+	m_Commands = std::move(commands);
+
+	// Instance stream
+	std::vector<InstanceData> instances(m_Instances.size());
+	for (size_t i = 0; i < m_Instances.size(); ++i)
+	{
+		StoreBoneTransform(XMLoadFloat4x4(&m_Instances[i].transform), SkinningMode::Matrix, instances[i].transform);
+		instances[i].paletteBase = static_cast<uint32_t>(i * m_PaletteBonesPerInstance);
+	}
+
+	m_InstanceBuffer = m_Renderer->CreateInstanceBuffer(instances);
+}
+
+void Model::SelectOccluders()
+{
+	// Besides tagged subsets, those covering a large part of the model's largest face are worth rasterizing while
+	// they are cheap enough. Skinned subsets move with the pose, so only unskinned ones are used
+	constexpr unsigned MaxOccluderTriangles = 2048;
+	constexpr float MinOccluderFaceRatio = 0.05f;
+
+	auto largest_face = [](const DirectX::BoundingBox& box)
+	{
+		auto& extents = box.Extents;
+		return 4.0f * std::max({ extents.x * extents.y, extents.y * extents.z, extents.z * extents.x });
+	};
+
+	m_Occluders.clear();
+	m_OccluderPositions.clear();
+	m_OccluderIndices.clear();
+
+	auto model_face = largest_face(m_MeshData->box);
+	auto& subsets = m_MeshData->subsets;
+	for (size_t s = 0; s < subsets.size(); ++s)
+	{
+		auto& subset = subsets[s];
+		auto large = subset.totalIndex / 3 <= MaxOccluderTriangles && largest_face(subset.box) >= model_face * MinOccluderFaceRatio;
+		if (subset.boneCount > 0 || subset.totalIndex == 0 || !(subset.occluder || large))
+			continue;
+
+		Occluder occluder;
+		occluder.subset = s;
+		occluder.firstVertex = m_OccluderPositions.size();
+		occluder.vertexCount = subset.vertexCount;
+		occluder.firstIndex = m_OccluderIndices.size();
+		occluder.indexCount = subset.totalIndex;
+		m_Occluders.push_back(occluder);
+
+		for (auto i = 0u; i < subset.vertexCount; ++i)
+		{
+			auto& position = m_MeshData->vertices[subset.baseVertex + i].position;
+			m_OccluderPositions.emplace_back(position.x, position.y, position.z);
+		}
+
+		auto indices = m_MeshData->indices.begin() + subset.startIndex;
+		m_OccluderIndices.insert(m_OccluderIndices.end(), indices, indices + subset.totalIndex);
+	}
+
+	std::cout << "Selected " << m_Occluders.size() << " occluders with " << m_OccluderIndices.size() / 3 << " triangles\n";
+}
+
+void Model::SelectLods(Camera* camera)
+{
+	auto& subsets = m_MeshData->subsets;
+	auto instance_count = m_Instances.size();
+	m_Lods.assign(m_CullingBounds.Size(), 0);
+	if (!m_LevelOfDetail)
+		return;
+
+	// A bounding sphere of radius r at distance d covers r * pixels_per_unit / d pixels, found from the vertical scale of
+	// the projection. Each level's error is a share of that, and the coarsest level within LodPixelError is drawn
+	auto pixels_per_unit = 0.5f * camera->GetHeight() * DirectX::XMVectorGetY(camera->GetProjection().r[1]);
+	auto eye = camera->GetPosition();
+	for (size_t s = 0; s < subsets.size(); ++s)
+	{
+		auto& subset = subsets[s];
+		if (subset.lodCount < 2)
+			continue;
+
+		for (size_t i = 0; i < instance_count; ++i)
+		{
+			auto object = s * instance_count + i;
+			if (!m_Visible[object])
+				continue;
+
+			// Measured to the nearest point of the sphere, so no part of the subset is drawn coarser than it should be
+			auto dx = m_CullingBounds.centreX[object] - eye.x;
+			auto dy = m_CullingBounds.centreY[object] - eye.y;
+			auto dz = m_CullingBounds.centreZ[object] - eye.z;
+			auto distance = std::max(std::sqrt(dx * dx + dy * dy + dz * dz) - m_CullingBounds.radius[object], LodMinDistance);
+
+			auto pixels_per_error = m_Instances[i].scale * pixels_per_unit / distance;
+			auto lod = subset.lodCount - 1;
+			while (lod > 0 && subset.lods[lod].error * pixels_per_error > LodPixelError)
+			{
+				--lod;
+			}
+
+			m_Lods[object] = static_cast<uint8_t>(lod);
+		}
+	}
+}
+
+unsigned Model::AddMeshletCommands(size_t subsetIndex, size_t instance)
+{
+	auto& subset = m_MeshData->subsets[subsetIndex];
+	auto& meshlets = m_MeshData->meshlets;
+	auto visible = &m_MeshletVisible[instance * meshlets.size()];
+	auto eye = DirectX::XMLoadFloat3(&m_InstanceEyes[instance]);
+
+	auto command = m_Commands[subsetIndex];
+	command.indexCount = 0;
+	command.instanceCount = 1;
+	command.baseInstance = static_cast<UINT>(instance);
+
+	unsigned triangles = 0;
+	auto flush = [&]()
+	{
+		if (command.indexCount > 0)
+		{
+			m_VisibleCommands.push_back(command);
+			triangles += command.indexCount / 3;
+		}
+	};
+
+	for (auto m = subset.meshletStart; m < subset.meshletStart + subset.meshletCount; ++m)
+	{
+		auto& meshlet = meshlets[m];
+		++m_DrawStats.meshletsTested;
+		if (!visible[m])
+		{
+			++m_DrawStats.meshletsOutside;
+			continue;
+		}
+
+		auto offset = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&meshlet.sphere.Center), eye);
+		auto facing = DirectX::XMVectorGetX(DirectX::XMVector3Dot(offset, DirectX::XMLoadFloat3(&meshlet.coneAxis)));
+		if (facing >= meshlet.coneCutoff * DirectX::XMVectorGetX(DirectX::XMVector3Length(offset)) + meshlet.sphere.Radius)
+		{
+			++m_DrawStats.meshletsBackFacing;
+			continue;
+		}
+
+		// Meshlets next to each other in the index buffer share a draw
+		if (command.indexCount > 0 && command.firstIndex + command.indexCount == meshlet.startIndex)
+		{
+			command.indexCount += meshlet.totalIndex;
+			continue;
+		}
+
+		flush();
+		command.firstIndex = meshlet.startIndex;
+		command.indexCount = meshlet.totalIndex;
+	}
+
+	flush();
+	return triangles;
+}
+
+void Model::GatherSubsetPalette(const Instance& instance, const Subset& subset, DirectX::XMFLOAT4* destination) const
+{
+	auto rows = GetPaletteRowsPerBone(m_SkinningMode);
+	if (subset.boneCount == 0)
+	{
+		// Vertices without weights are drawn by local bone 0 in the bind pose
+		StoreBoneTransform(DirectX::XMMatrixIdentity(), m_SkinningMode, destination);
+		return;
+	}
+
+	for (unsigned i = 0; i < subset.boneCount; ++i)
+	{
+		auto bone_id = m_MeshData->subsetBones[subset.boneStart + i];
+		std::copy_n(&instance.palette[bone_id * rows], rows, &destination[i * rows]);
+	}
+}
+
+DirectX::XMMATRIX* Model::EvaluateReferencePose(const AnimationClip& clip, float t, std::vector<KeyframeCursor>& cursors, FrameArena& arena)
+{
+	auto numBones = m_MeshData->bones.size();
+	auto toParentTransforms = arena.Allocate<DirectX::XMMATRIX>(numBones);
+	clip.Interpolate(t, cursors, toParentTransforms);
+
+	// Transform to root. Bones are stored parent-before-child so a single forward pass is enough
+	auto toRootTransforms = arena.Allocate<DirectX::XMMATRIX>(numBones);
+	for (UINT i = 0; i < numBones; ++i)
+	{
+		auto parentId = m_MeshData->bones[i].parentId;
+		if (parentId < 0)
+		{
+			toRootTransforms[i] = toParentTransforms[i];
+		}
+		else
+		{
+			toRootTransforms[i] = XMMatrixMultiply(toParentTransforms[i], toRootTransforms[parentId]);
+		}
+	}
+
+	// Transform bone
+	auto palette = arena.Allocate<DirectX::XMMATRIX>(numBones);
+	for (size_t i = 0; i < numBones; i++)
+	{
+		DirectX::XMMATRIX offset = XMLoadFloat4x3(&m_MeshData->bones[i].offset);
+		DirectX::XMMATRIX toRoot = toRootTransforms[i];
+		palette[i] = DirectX::XMMatrixMultiply(offset, toRoot);
+	}
+
+	return palette;
+}
+
+void Model::SetPoseEvaluation(PoseEvaluation evaluation)
+{
+	m_PoseEvaluation = evaluation;
+	m_PoseDirty = true;
+}
+
+void Model::SetSkinningMode(SkinningMode mode)
+{
+	m_PoseDirty |= m_SkinningMode != mode;
+	m_SkinningMode = mode;
+}
+
+void Model::SetInstances(const std::vector<DirectX::XMFLOAT4X4>& transforms)
+{
+	if (transforms.empty())
+	{
+		return;
+	}
+
+	// New instances start spread over the clip so they don't all move in step
+	auto clip_length = 0.0f;
+	if (m_MeshData)
+	{
+		auto clip = m_MeshData->animations.find("Take1");
+		if (clip != m_MeshData->animations.end())
+		{
+			clip_length = clip->second.GetClipEndTime();
+		}
+	}
+
+	auto previous_count = m_Instances.size();
+	m_Instances.resize(transforms.size());
+	for (size_t i = 0; i < transforms.size(); ++i)
+	{
+		auto& instance = m_Instances[i];
+		instance.transform = transforms[i];
+		if (i >= previous_count)
+		{
+			instance.time = std::fmod(i * 0.618034f, 1.0f) * clip_length;
+			instance.cursors.assign(m_MeshData ? m_MeshData->bones.size() : 0, {});
+		}
+	}
+
+	m_PoseDirty = true;
+	if (m_MeshData)
+	{
+		CreateDrawBatch();
+	}
+}
+
+void Model::SetPaused(bool paused)
+{
+	m_Paused = paused;
+}
+
+void Model::SetFrustumCulling(bool enabled)
+{
+	m_FrustumCulling = enabled;
+}
+
+void Model::SetOcclusionCulling(bool enabled)
+{
+	m_OcclusionCulling = enabled;
+}
+
+void Model::SetLevelOfDetail(bool enabled)
+{
+	m_LevelOfDetail = enabled;
+}
+
+void Model::SetMeshletCulling(bool enabled)
+{
+	m_MeshletCulling = enabled;
+}
+
+double Model::GetPoseTimePerBone() const
+{
+	return m_PoseTimePerBone;
+}
+
+const DirectX::BoundingBox& Model::GetBounds() const
+{
+	return m_Bounds;
+}
+
+DrawStats Model::GetDrawStats() const
+{
+	return m_DrawStats;
+}
+
+std::array<unsigned, MaxSubsetLods> Model::GetLodTriangleCounts() const
+{
+	std::array<unsigned, MaxSubsetLods> counts = {};
+	if (!m_MeshData)
+		return counts;
 
-	// Render geometry
 	for (auto& subset : m_MeshData->subsets)
 	{
-		m_Renderer->DrawIndex(subset.totalIndex, subset.startIndex, subset.baseVertex);
+		for (auto lod = 0u; lod < MaxSubsetLods; ++lod)
+		{
+			counts[lod] += subset.lods[std::min(lod, subset.lodCount - 1)].totalIndex / 3;
+		}
 	}
+
+	return counts;
 }
 
-float BoneAnimation::GetStartTime() const
+UpdateCounters Model::GetPoseUpdates() const
 {
-	return Keyframes.front().TimePos;
+	return m_PoseUpdates;
 }
 
-float BoneAnimation::GetEndTime() const
+PackedQuaternion PackedQuaternion::Pack(const DirectX::XMFLOAT4& quaternion)
+{
+	float components[4] = { quaternion.x, quaternion.y, quaternion.z, quaternion.w };
+
+	size_t largest = 0;
+	auto length = 0.0f;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		length += components[i] * components[i];
+		if (std::abs(components[i]) > std::abs(components[largest]))
+		{
+			largest = i;
+		}
+	}
+
+	// q and -q are the same rotation, so flip the sign to keep the dropped component positive
+	length = std::sqrt(length);
+	auto scale = (components[largest] < 0.0f ? -1.0f : 1.0f) / (length > 0.0f ? length : 1.0f);
+
+	uint64_t bits = largest;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		if (i == largest)
+		{
+			continue;
+		}
+
+		auto value = std::clamp(components[i] * scale, -QuaternionComponentRange, QuaternionComponentRange);
+		auto normalised = value / QuaternionComponentRange * 0.5f + 0.5f;
+		bits = (bits << 15) | static_cast<uint64_t>(std::lround(normalised * QuaternionComponentMax));
+	}
+
+	PackedQuaternion packed;
+	packed.Data[0] = static_cast<uint16_t>(bits);
+	packed.Data[1] = static_cast<uint16_t>(bits >> 16);
+	packed.Data[2] = static_cast<uint16_t>(bits >> 32);
+	return packed;
+}
+
+DirectX::XMVECTOR PackedQuaternion::Unpack() const
 {
-	return Keyframes.back().TimePos;
+	uint64_t bits = Data[0] | (static_cast<uint64_t>(Data[1]) << 16) | (static_cast<uint64_t>(Data[2]) << 32);
+	auto largest = static_cast<size_t>(bits >> 45) & 3;
+
+	// The last component packed sits in the lowest bits
+	float components[4] = {};
+	auto sum = 0.0f;
+	for (size_t i = 4; i-- > 0;)
+	{
+		if (i == largest)
+		{
+			continue;
+		}
+
+		auto normalised = static_cast<float>(bits & QuaternionComponentMax) / QuaternionComponentMax;
+		components[i] = (normalised * 2.0f - 1.0f) * QuaternionComponentRange;
+		sum += components[i] * components[i];
+		bits >>= 15;
+	}
+
+	components[largest] = std::sqrt(std::max(0.0f, 1.0f - sum));
+	return DirectX::XMVectorSet(components[0], components[1], components[2], components[3]);
 }
 
-void BoneAnimation::Interpolate(float t, DirectX::XMMATRIX& M) const
+PackedTranslation TranslationRange::Pack(const DirectX::XMFLOAT3& translation) const
 {
-	if (t <= Keyframes.front().TimePos)
+	const float values[3] = { translation.x - Min.x, translation.y - Min.y, translation.z - Min.z };
+	const float extents[3] = { Extent.x, Extent.y, Extent.z };
+
+	PackedTranslation packed;
+	for (size_t i = 0; i < 3; ++i)
 	{
-		DirectX::XMVECTOR S = XMLoadFloat3(&Keyframes.front().Scale);
-		DirectX::XMVECTOR P = XMLoadFloat3(&Keyframes.front().Translation);
-		DirectX::XMVECTOR Q = XMLoadFloat4(&Keyframes.front().RotationQuat);
+		auto normalised = extents[i] > 0.0f ? std::clamp(values[i] / extents[i], 0.0f, 1.0f) : 0.0f;
+		packed.Data[i] = static_cast<uint16_t>(std::lround(normalised * TranslationMax));
+	}
+
+	return packed;
+}
+
+DirectX::XMVECTOR TranslationRange::Unpack(const PackedTranslation& translation) const
+{
+	auto normalised = DirectX::XMVectorScale(DirectX::XMVectorSet(translation.Data[0], translation.Data[1], translation.Data[2], 0.0f), 1.0f / TranslationMax);
+	return DirectX::XMVectorMultiplyAdd(normalised, XMLoadFloat3(&Extent), XMLoadFloat3(&Min));
+}
+
+void KeyframeTimes::Assign(const std::vector<float>& times)
+{
+	Start = times.empty() ? 0.0f : times.front();
+	Interval = 0.0f;
+	Count = times.size();
+	Times.clear();
 
-		DirectX::XMVECTOR zero = DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
-		M = DirectX::XMMatrixAffineTransformation(S, zero, Q, P);
+	if (Count < 2)
+	{
+		return;
 	}
-	else if (t >= Keyframes.back().TimePos)
+
+	// Every key must sit on the grid within a small fraction of the interval
+	auto interval = (times.back() - Start) / static_cast<float>(Count - 1);
+	auto tolerance = interval * 1.0e-3f;
+	auto uniform = interval > 0.0f;
+	for (size_t i = 0; uniform && i < Count; ++i)
 	{
-		DirectX::XMVECTOR S = XMLoadFloat3(&Keyframes.back().Scale);
-		DirectX::XMVECTOR P = XMLoadFloat3(&Keyframes.back().Translation);
-		DirectX::XMVECTOR Q = XMLoadFloat4(&Keyframes.back().RotationQuat);
+		uniform = std::abs(times[i] - (Start + interval * i)) <= tolerance;
+	}
 
-		DirectX::XMVECTOR zero = DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
-		M = DirectX::XMMatrixAffineTransformation(S, zero, Q, P);
+	if (uniform)
+	{
+		Interval = interval;
 	}
 	else
 	{
-		for (UINT i = 0; i < Keyframes.size() - 1; ++i)
-		{
-			// Typedef to stop the compiler from moaning about arithmetic overflow 
-			typedef std::vector<Keyframe, std::allocator<Keyframe>>::size_type KeyframeSize;
-			if (t >= Keyframes[i].TimePos && t <= Keyframes[static_cast<KeyframeSize>(i) + 1].TimePos)
-			{
-				float lerpPercent = (t - Keyframes[i].TimePos) / (Keyframes[static_cast<KeyframeSize>(i) + 1].TimePos - Keyframes[i].TimePos);
+		Times = times;
+	}
+}
+
+float KeyframeTimes::GetStartTime() const
+{
+	return Start;
+}
+
+float KeyframeTimes::GetEndTime() const
+{
+	if (Count < 2)
+	{
+		return Start;
+	}
 
-				DirectX::XMVECTOR s0 = XMLoadFloat3(&Keyframes[i].Scale);
-				DirectX::XMVECTOR s1 = XMLoadFloat3(&Keyframes[static_cast<std::vector<Keyframe, std::allocator<Keyframe>>::size_type>(i) + 1].Scale);
+	return Interval > 0.0f ? Start + Interval * (Count - 1) : Times.back();
+}
+
+size_t KeyframeTimes::Find(float t, size_t& cursor, float& lerpPercent) const
+{
+	lerpPercent = 0.0f;
+	if (Count < 2 || t <= Start)
+	{
+		return 0;
+	}
 
-				DirectX::XMVECTOR p0 = XMLoadFloat3(&Keyframes[i].Translation);
-				DirectX::XMVECTOR p1 = XMLoadFloat3(&Keyframes[static_cast<KeyframeSize>(i) + 1].Translation);
+	if (t >= GetEndTime())
+	{
+		return Count - 1;
+	}
 
-				DirectX::XMVECTOR q0 = XMLoadFloat4(&Keyframes[i].RotationQuat);
-				DirectX::XMVECTOR q1 = XMLoadFloat4(&Keyframes[static_cast<KeyframeSize>(i) + 1].RotationQuat);
+	auto last = Count - 2;
 
-				DirectX::XMVECTOR S = DirectX::XMVectorLerp(s0, s1, lerpPercent);
-				DirectX::XMVECTOR P = DirectX::XMVectorLerp(p0, p1, lerpPercent);
-				DirectX::XMVECTOR Q = DirectX::XMQuaternionSlerp(q0, q1, lerpPercent);
+	// Evenly spaced keys are indexed directly
+	if (Interval > 0.0f)
+	{
+		auto position = (t - Start) / Interval;
+		auto index = std::min(static_cast<size_t>(position), last);
+		lerpPercent = std::min(position - static_cast<float>(index), 1.0f);
+		return index;
+	}
 
-				DirectX::XMVECTOR zero = DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
-				M = DirectX::XMMatrixAffineTransformation(S, zero, Q, P);
-				break;
-			}
+	// Playback normally stays within the same interval or moves on to the next, otherwise seek with a binary search
+	auto contains = [&](size_t i) { return Times[i] <= t && t < Times[i + 1]; };
+	if (cursor > last || !contains(cursor))
+	{
+		if (cursor < last && contains(cursor + 1))
+		{
+			++cursor;
+		}
+		else
+		{
+			auto upper = std::upper_bound(Times.begin(), Times.end(), t);
+			cursor = std::min(static_cast<size_t>(std::distance(Times.begin(), upper)) - 1, last);
 		}
 	}
+
+	lerpPercent = (t - Times[cursor]) / (Times[cursor + 1] - Times[cursor]);
+	return cursor;
+}
+
+float BoneAnimation::GetStartTime() const
+{
+	return std::min({ Translation.Keys.GetStartTime(), Rotation.Keys.GetStartTime(), Scale.Keys.GetStartTime() });
+}
+
+float BoneAnimation::GetEndTime() const
+{
+	return std::max({ Translation.Keys.GetEndTime(), Rotation.Keys.GetEndTime(), Scale.Keys.GetEndTime() });
+}
+
+void BoneAnimation::Interpolate(float t, const TranslationRange& range, KeyframeCursor& cursor, DirectX::XMMATRIX& M) const
+{
+	auto lerpPercent = 0.0f;
+
+	auto i = Translation.Keys.Find(t, cursor.Translation, lerpPercent);
+	auto p0 = range.Unpack(Translation.Values[i]);
+	auto p1 = range.Unpack(Translation.Values[std::min(i + 1, Translation.Values.size() - 1)]);
+	DirectX::XMVECTOR P = DirectX::XMVectorLerp(p0, p1, lerpPercent);
+
+	i = Rotation.Keys.Find(t, cursor.Rotation, lerpPercent);
+	auto q0 = Rotation.Values[i].Unpack();
+	auto q1 = Rotation.Values[std::min(i + 1, Rotation.Values.size() - 1)].Unpack();
+	DirectX::XMVECTOR Q = DirectX::XMQuaternionSlerp(q0, q1, lerpPercent);
+
+	i = Scale.Keys.Find(t, cursor.Scale, lerpPercent);
+	auto s0 = XMLoadFloat3(&Scale.Values[i]);
+	auto s1 = XMLoadFloat3(&Scale.Values[std::min(i + 1, Scale.Values.size() - 1)]);
+	DirectX::XMVECTOR S = DirectX::XMVectorLerp(s0, s1, lerpPercent);
+
+	DirectX::XMVECTOR zero = DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f);
+	M = DirectX::XMMatrixAffineTransformation(S, zero, Q, P);
 }
 
 float AnimationClip::GetClipStartTime() const
@@ -188,10 +1088,21 @@ float AnimationClip::GetClipEndTime() const
 	return t;
 }
 
-void AnimationClip::Interpolate(float t, std::vector<DirectX::XMMATRIX>& boneTransforms) const
+void AnimationClip::Interpolate(float t, std::vector<KeyframeCursor>& cursors, DirectX::XMMATRIX* boneTransforms) const
 {
 	for (auto i = 0u; i < BoneAnimations.size(); ++i)
 	{
-		BoneAnimations[i].Interpolate(t, boneTransforms[i]);
+		BoneAnimations[i].Interpolate(t, Translations, cursors[i], boneTransforms[i]);
 	}
+}
+
+size_t AnimationClip::GetMemoryUsage() const
+{
+	size_t bytes = 0;
+	for (auto& animation : BoneAnimations)
+	{
+		bytes += GetTrackMemoryUsage(animation.Translation) + GetTrackMemoryUsage(animation.Rotation) + GetTrackMemoryUsage(animation.Scale);
+	}
+
+	return bytes;
 }
\ No newline at end of file
@@ -3,6 +3,9 @@
 #include "Pch.h"
 #include <map>
 #include <DirectXMath.h>
+#include <DirectXCollision.h>
+#include "Culling.h"
+#include "Occlusion.h"
 class IRenderer;
 class DXRenderer;
 class Camera;
@@ -11,10 +14,14 @@ class GLShader;
 class IShader;
 class GlCamera;
 class Camera;
+class PoseEvaluator;
+class FrameArena;
 
 struct VertexBuffer;
 struct IndexBuffer;
 struct Texture2D;
+struct DrawBatch;
+struct DrawCommand;
 
 struct Position
 {
@@ -76,12 +83,26 @@ struct Vertex
 	int bone[4] = { 0, 0, 0, 0 };
 };
 
+// Bones are ordered so that a parent always comes before its children. Root bones have a parentId of -1
 struct BoneInfo
 {
-	int parentId = 0;
+	int parentId = -1;
 	std::string name;
 	std::string parentName;
-	DirectX::XMMATRIX offset;
+	DirectX::XMFLOAT4X3 offset;
+};
+
+// Levels of detail a subset can have, including the full mesh
+constexpr unsigned MaxSubsetLods = 5;
+
+// Index range of one level of detail of a subset, drawn from the subset's vertices
+struct SubsetLod
+{
+	unsigned startIndex = 0;
+	unsigned totalIndex = 0;
+
+	// Largest distance, in model units, the simplified surface is estimated to have moved from the full mesh
+	float error = 0.0f;
 };
 
 struct Subset
@@ -89,37 +110,140 @@ struct Subset
 	unsigned totalIndex = 0;
 	unsigned startIndex = 0;
 	unsigned baseVertex = 0;
+	unsigned vertexCount = 0;
+
+	// Range of MeshData::subsetBones making up this subset's bone palette. Vertex bone indices are local to it
+	unsigned boneStart = 0;
+	unsigned boneCount = 0;
+
+	// Bind pose bounds of the subset's vertices
+	DirectX::BoundingBox box;
+	DirectX::BoundingSphere sphere;
+
+	// Tagged as an occluder by the author, through a mesh name containing "occluder"
+	bool occluder = false;
+
+	// Levels of detail from the full mesh down, each coarser than the last
+	unsigned lodCount = 1;
+	SubsetLod lods[MaxSubsetLods];
+
+	// Range of MeshData::meshlets splitting up the full mesh. Only unskinned subsets have them
+	unsigned meshletStart = 0;
+	unsigned meshletCount = 0;
+};
+
+// Cluster of neighbouring triangles of a subset's full mesh, culled on its own when out of view or facing away
+struct Meshlet
+{
+	unsigned startIndex = 0;
+	unsigned totalIndex = 0;
+
+	// Bounds of its vertices
+	DirectX::BoundingSphere sphere;
+
+	// Cone around the normals of its triangles. Every triangle faces away from an eye at e when
+	// dot(centre - e, coneAxis) >= coneCutoff * |centre - e| + radius, which a cutoff of 1 never passes
+	DirectX::XMFLOAT3 coneAxis = DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f);
+	float coneCutoff = 1.0f;
 };
 
 ///<summary>
-	/// A Keyframe defines the bone transformation at an instant in time.
-	///</summary>
-struct Keyframe
+/// Rotation stored in 48 bits using the smallest three encoding. The
+/// largest component is dropped and rebuilt from the unit length, the
+/// other three are kept in 15 bits each along with the index of the
+/// dropped one.
+///</summary>
+struct PackedQuaternion
 {
-	Keyframe() = default;
-	virtual ~Keyframe() = default;
+	static PackedQuaternion Pack(const DirectX::XMFLOAT4& quaternion);
+	DirectX::XMVECTOR Unpack() const;
 
-	float TimePos = 0.0f;
-	DirectX::XMFLOAT3 Translation = DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f);
-	DirectX::XMFLOAT3 Scale = DirectX::XMFLOAT3(1.0f, 1.0f, 1.0f);
-	DirectX::XMFLOAT4 RotationQuat = DirectX::XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f);
+	uint16_t Data[3] = { 0, 0, 0 };
 };
 
 ///<summary>
-/// A BoneAnimation is defined by a list of keyframes.  For time
-/// values inbetween two keyframes, we interpolate between the
-/// two nearest keyframes that bound the time.  
+/// Translation quantized to 16 bits per axis within a TranslationRange.
+///</summary>
+struct PackedTranslation
+{
+	uint16_t Data[3] = { 0, 0, 0 };
+};
+
+///<summary>
+/// Bounds used to quantize every translation of an animation clip.
+///</summary>
+struct TranslationRange
+{
+	PackedTranslation Pack(const DirectX::XMFLOAT3& translation) const;
+	DirectX::XMVECTOR Unpack(const PackedTranslation& translation) const;
+
+	DirectX::XMFLOAT3 Min = DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f);
+	DirectX::XMFLOAT3 Extent = DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f);
+};
+
+///<summary>
+/// Key times of a single track. Evenly spaced keys only keep their
+/// start time and interval, otherwise every time is stored.
+///</summary>
+struct KeyframeTimes
+{
+	// Stores the key times, dropping them when they are evenly spaced
+	void Assign(const std::vector<float>& times);
+
+	float GetStartTime() const;
+	float GetEndTime() const;
+
+	// Returns the key at or before t and writes the blend factor towards the next key
+	size_t Find(float t, size_t& cursor, float& lerpPercent) const;
+
+	float Start = 0.0f;
+	float Interval = 0.0f;
+	size_t Count = 0;
+
+	// Only filled when the keys are not evenly spaced
+	std::vector<float> Times;
+};
+
+///<summary>
+/// A track animates one channel of a bone, with its values stored
+/// apart from the key times.
+///</summary>
+template <typename T>
+struct KeyframeTrack
+{
+	KeyframeTimes Keys;
+	std::vector<T> Values;
+};
+
+///<summary>
+/// Playback position within a BoneAnimation. Remembering the last
+/// key of every track makes the lookup constant time while playback
+/// moves forward.
+///</summary>
+struct KeyframeCursor
+{
+	size_t Translation = 0;
+	size_t Rotation = 0;
+	size_t Scale = 0;
+};
+
+///<summary>
+/// A BoneAnimation is defined by separate translation, rotation and
+/// scale tracks.  For time values inbetween two keys, we interpolate
+/// between the two nearest keys that bound the time.
 ///
-/// We assume an animation always has two keyframes.
+/// We assume every track has at least one key.
 ///</summary>
 struct BoneAnimation
 {
 	float GetStartTime() const;
 	float GetEndTime() const;
 
-	void Interpolate(float t, DirectX::XMMATRIX& M) const;
+	void Interpolate(float t, const TranslationRange& range, KeyframeCursor& cursor, DirectX::XMMATRIX& M) const;
 
-	std::vector<Keyframe> Keyframes;
+	KeyframeTrack<PackedTranslation> Translation;
+	KeyframeTrack<PackedQuaternion> Rotation;
+	KeyframeTrack<DirectX::XMFLOAT3> Scale;
 };
 
 ///<summary>
@@ -132,8 +256,12 @@ struct AnimationClip
 	float GetClipStartTime() const;
 	float GetClipEndTime() const;
 
-	void Interpolate(float t, std::vector<DirectX::XMMATRIX>& boneTransforms)const;
+	void Interpolate(float t, std::vector<KeyframeCursor>& cursors, DirectX::XMMATRIX* boneTransforms) const;
+
+	// Bytes used by the tracks of every bone
+	size_t GetMemoryUsage() const;
 
+	TranslationRange Translations;
 	std::vector<BoneAnimation> BoneAnimations;
 };
 
@@ -145,8 +273,75 @@ struct MeshData
 	std::vector<Vertex> vertices;
 	std::vector<UINT> indices;
 	std::vector<Subset> subsets;
+	std::vector<int> subsetBones;
 	std::vector<BoneInfo> bones;
 	std::map<std::string, AnimationClip> animations;
+
+	// Bind pose bounds of the whole model
+	DirectX::BoundingBox box;
+	DirectX::BoundingSphere sphere;
+
+	// Bind pose bounds of the vertices each bone influences, so posed bounds can be found from the palette alone.
+	// Bones influencing no vertices have negative extents
+	std::vector<DirectX::BoundingBox> boneBounds;
+
+	// Meshlets of every subset, in subset order
+	std::vector<Meshlet> meshlets;
+};
+
+// Ways of evaluating the pose of a model, selectable at runtime to compare their cost
+enum class PoseEvaluation
+{
+	// Each bone sampled on its own, followed by separate to root and offset passes
+	Reference,
+
+	// Bones sampled four at a time, blending rotations with slerp or corrected nlerp
+	BatchedSlerp,
+	BatchedNlerp
+};
+
+// How vertices are blended between their bones
+enum class SkinningMode
+{
+	Matrix,
+
+	// Avoids the volume loss of blended matrices at twisting joints, but ignores bone scale
+	DualQuaternion
+};
+
+// Updates performed and updates skipped because nothing had changed, counted over one frame
+struct UpdateCounters
+{
+	unsigned performed = 0;
+	unsigned skipped = 0;
+};
+
+// Draw submission of one frame. Subsets sharing a bone palette are submitted as one batch
+struct DrawStats
+{
+	unsigned subsets = 0;
+	unsigned batches = 0;
+
+	// Subsets of each instance tested against the view frustum, and those found outside it
+	unsigned tested = 0;
+	unsigned culled = 0;
+
+	// Occluder triangles rasterized, and subsets in view found hidden behind them
+	unsigned occluderTriangles = 0;
+	unsigned occluded = 0;
+
+	// Triangles drawn at each level of detail
+	std::array<unsigned, MaxSubsetLods> lodTriangles = {};
+
+	// Meshlets of visible subsets drawn in full detail that were tested, and those found out of view or facing away
+	unsigned meshletsTested = 0;
+	unsigned meshletsOutside = 0;
+	unsigned meshletsBackFacing = 0;
+
+	// Average CPU time spent culling, rasterizing occluders and submitting the model, in milliseconds
+	double cullTime = 0.0;
+	double rasterTime = 0.0;
+	double submitTime = 0.0;
 };
 
 class IModel
@@ -156,8 +351,42 @@ public:
 	virtual ~IModel() = default;
 
 	virtual bool Load(const std::string& path) = 0;
-	virtual void Update(float dt) = 0;
+	virtual void Update(float dt, FrameArena& arena) = 0;
 	virtual void Render(Camera* camera) = 0;
+
+	virtual void SetPoseEvaluation(PoseEvaluation evaluation) = 0;
+	virtual void SetSkinningMode(SkinningMode mode) = 0;
+	virtual void SetPaused(bool paused) = 0;
+
+	// Skip subsets outside the camera's view
+	virtual void SetFrustumCulling(bool enabled) = 0;
+
+	// Skip subsets hidden behind occluders
+	virtual void SetOcclusionCulling(bool enabled) = 0;
+
+	// Draw coarser levels of detail of subsets that are small on screen
+	virtual void SetLevelOfDetail(bool enabled) = 0;
+
+	// Skip the meshlets of subsets in view that are out of view themselves or face away from the camera
+	virtual void SetMeshletCulling(bool enabled) = 0;
+
+	// Place copies of the model. Geometry is shared, each instance has its own transform and animation time
+	virtual void SetInstances(const std::vector<DirectX::XMFLOAT4X4>& transforms) = 0;
+
+	// Bounds of every instance in its current pose
+	virtual const DirectX::BoundingBox& GetBounds() const = 0;
+
+	// Average CPU time spent evaluating the pose, in nanoseconds per bone
+	virtual double GetPoseTimePerBone() const = 0;
+
+	// Poses evaluated and skipped during the last update
+	virtual UpdateCounters GetPoseUpdates() const = 0;
+
+	// Subsets and batches culled and drawn during the last render
+	virtual DrawStats GetDrawStats() const = 0;
+
+	// Triangles of one instance of the model at each level of detail, with subsets short of a level using their coarsest
+	virtual std::array<unsigned, MaxSubsetLods> GetLodTriangleCounts() const = 0;
 };
 
 class Model : public IModel
@@ -167,19 +396,156 @@ public:
 	virtual ~Model();
 
 	bool Load(const std::string& path) override;
-	void Update(float dt) override;
+	void Update(float dt, FrameArena& arena) override;
 	void Render(Camera* camera) override;
 
+	void SetPoseEvaluation(PoseEvaluation evaluation) override;
+	void SetSkinningMode(SkinningMode mode) override;
+	void SetPaused(bool paused) override;
+	void SetFrustumCulling(bool enabled) override;
+	void SetOcclusionCulling(bool enabled) override;
+	void SetLevelOfDetail(bool enabled) override;
+	void SetMeshletCulling(bool enabled) override;
+	void SetInstances(const std::vector<DirectX::XMFLOAT4X4>& transforms) override;
+	const DirectX::BoundingBox& GetBounds() const override;
+	double GetPoseTimePerBone() const override;
+	UpdateCounters GetPoseUpdates() const override;
+	DrawStats GetDrawStats() const override;
+	std::array<unsigned, MaxSubsetLods> GetLodTriangleCounts() const override;
+
 private:
+	// A placed copy of the model, with its own animation playback
+	struct Instance
+	{
+		DirectX::XMFLOAT4X4 transform;
+		float time = 0.0f;
+
+		// Largest scale of the transform, which errors in model units grow by
+		float scale = 1.0f;
+
+		// Animation playback position of every bone, and the palette of the whole skeleton
+		std::vector<KeyframeCursor> cursors;
+		std::vector<DirectX::XMFLOAT4> palette;
+
+		// Model space bounds of the current pose, as a whole and of each subset
+		DirectX::BoundingBox bounds;
+		std::vector<DirectX::BoundingBox> subsetBounds;
+	};
+
+	// Evaluates the instance's palette at its current time, or the bind pose without a clip
+	void EvaluatePose(Instance& instance, const AnimationClip* clip, FrameArena& arena);
+
+	// Bounds of the instance's pose, from the bind pose bounds of each bone moved by its palette transform
+	void ComputePoseBounds(Instance& instance);
+
+	// World space bounds of every subset of every instance, and the model bounds covering them
+	void UpdateCullingBounds();
+
+	// Samples each bone on its own and applies the transforms to root and bone offsets in separate passes
+	// Returns the palette of every bone, allocated from the frame arena
+	DirectX::XMMATRIX* EvaluateReferencePose(const AnimationClip& clip, float t, std::vector<KeyframeCursor>& cursors, FrameArena& arena);
+
+	// Copies the bones a subset uses out of the instance's palette
+	void GatherSubsetPalette(const Instance& instance, const Subset& subset, DirectX::XMFLOAT4* destination) const;
+
+	// Groups consecutive subsets that use the same bones into runs drawn from one batch, each covering every instance
+	void CreateDrawBatch();
+
+	// Picks the subsets rasterized as occluders and copies out their positions
+	void SelectOccluders();
+
+	// Picks the level of detail of every visible subset of every instance from its size on screen
+	void SelectLods(Camera* camera);
+
+	// Adds draws of an instance's meshlets of a subset that are in view and face the eye, merging neighbouring ones.
+	// Returns the number of triangles drawn
+	unsigned AddMeshletCommands(size_t subsetIndex, size_t instance);
+
 	DXRenderer* m_Renderer = nullptr;
 	IShader* m_Shader = nullptr;
 
 	std::unique_ptr<MeshData> m_MeshData = nullptr;
 
+	// Pose evaluation
+	std::unique_ptr<PoseEvaluator> m_PoseEvaluator = nullptr;
+	PoseEvaluation m_PoseEvaluation = PoseEvaluation::BatchedNlerp;
+	double m_PoseTimePerBone = 0.0;
+
+	SkinningMode m_SkinningMode = SkinningMode::Matrix;
+
+	// The pose only changes while a clip is playing, otherwise it is evaluated once after anything affecting it changes
+	bool m_Paused = false;
+	bool m_PoseDirty = true;
+	UpdateCounters m_PoseUpdates;
+
+	// Instances, all drawn together. The palette of the subset being drawn is used with a single instance,
+	// otherwise the palettes of every run of every instance are uploaded at once
+	std::vector<Instance> m_Instances;
+	std::unique_ptr<VertexBuffer> m_InstanceBuffer = nullptr;
+	std::vector<DirectX::XMFLOAT4> m_SubsetPalette;
+	std::vector<DirectX::XMFLOAT4> m_InstancePalettes;
+	unsigned m_PaletteBonesPerInstance = 0;
+
 	// Texture resources
 	std::unique_ptr<Texture2D> m_DiffuseTexture = nullptr;
 	std::unique_ptr<Texture2D> m_NormalTexture = nullptr;
 
 	std::unique_ptr<VertexBuffer> m_VertexBuffer = nullptr;
 	std::unique_ptr<IndexBuffer> m_IndexBuffer = nullptr;
+
+	// Bounds of the current poses. Culling objects are laid out subset by subset, each covering every instance
+	DirectX::BoundingBox m_Bounds;
+	CullingBounds m_CullingBounds;
+	std::vector<DirectX::BoundingBox> m_PosedBoneBounds;
+	std::vector<uint8_t> m_Visible;
+	std::vector<uint8_t> m_InstanceVisible;
+	bool m_FrustumCulling = true;
+
+	// Occluders are tagged subsets and large unskinned ones, rasterized for each instance they are in view in
+	struct Occluder
+	{
+		size_t subset = 0;
+		size_t firstVertex = 0;
+		size_t vertexCount = 0;
+		size_t firstIndex = 0;
+		size_t indexCount = 0;
+	};
+
+	std::vector<Occluder> m_Occluders;
+	std::vector<DirectX::XMFLOAT3> m_OccluderPositions;
+	std::vector<UINT> m_OccluderIndices;
+	OcclusionBuffer m_OcclusionBuffer;
+	bool m_OcclusionCulling = true;
+
+	// Level of detail of every subset of every instance, laid out as the culling objects
+	std::vector<uint8_t> m_Lods;
+	bool m_LevelOfDetail = true;
+
+	// Bounds of every meshlet of every instance, laid out instance by instance, and those in view. Meshlets are tested
+	// for facing away in model space, from the camera position moved into each instance
+	CullingBounds m_MeshletBounds;
+	std::vector<uint8_t> m_MeshletVisible;
+	std::vector<DirectX::XMFLOAT3> m_InstanceEyes;
+	bool m_MeshletCulling = true;
+
+	// Every subset's full detail draw command, and the runs of them sharing a bone palette
+	struct DrawRun
+	{
+		const Subset* subset = nullptr;
+		UINT firstCommand = 0;
+		UINT commandCount = 0;
+
+		// First bone of the run's palette within each instance's palettes
+		unsigned boneOffset = 0;
+
+		// Commands of the visible instances of the run's subsets, rebuilt every frame
+		UINT visibleFirst = 0;
+		UINT visibleCount = 0;
+	};
+
+	std::vector<DrawCommand> m_Commands;
+	std::vector<DrawCommand> m_VisibleCommands;
+	std::unique_ptr<DrawBatch> m_DrawBatch = nullptr;
+	std::vector<DrawRun> m_DrawRuns;
+	DrawStats m_DrawStats;
 };
@@ -6,6 +6,16 @@
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include "MeshSimplifier.h"
+#include "MeshletBuilder.h"
+#include "MeshOptimizer.h"
+#include "MeshProcessor.h"
+#include <execution>
+#include <xmmintrin.h>
+#include <numeric>
+#include <cstring>
+#include <cfloat>
+#include <cctype>
 
 namespace
 {
@@ -22,87 +32,862 @@ namespace
 		return _matrix;
 	}
 
-	void LoadVertices(aiMesh* mesh, MeshData* meshData, unsigned& vertex_count)
+	// Number of vertices or faces converted by a single parallel work item
+	constexpr unsigned ImportChunkSize = 16384;
+
+	// Range of vertices or faces within a mesh to be converted by one worker
+	struct ImportChunk
+	{
+		unsigned mesh = 0;
+		unsigned begin = 0;
+		unsigned end = 0;
+	};
+
+	// Triangulated meshes have exactly 3 indices per face so faces can be split across workers
+	bool HasOnlyTriangles(aiMesh* mesh)
+	{
+		return mesh->mPrimitiveTypes == aiPrimitiveType_TRIANGLE;
+	}
+
+	unsigned CountIndices(aiMesh* mesh)
+	{
+		if (HasOnlyTriangles(mesh))
+		{
+			return mesh->mNumFaces * 3;
+		}
+
+		auto index_count = 0u;
+		for (auto i = 0u; i < mesh->mNumFaces; ++i)
+		{
+			index_count += mesh->mFaces[i].mNumIndices;
+		}
+
+		return index_count;
+	}
+
+	// Splits [0, count) of a mesh into chunks of at most ImportChunkSize
+	void AddImportChunks(unsigned mesh_index, unsigned count, std::vector<ImportChunk>& chunks)
+	{
+		for (auto begin = 0u; begin < count; begin += ImportChunkSize)
+		{
+			ImportChunk chunk;
+			chunk.mesh = mesh_index;
+			chunk.begin = begin;
+			chunk.end = std::min(begin + ImportChunkSize, count);
+			chunks.push_back(chunk);
+		}
+	}
+
+	static_assert(sizeof(aiVector3D) == sizeof(float) * 3, "Vertex conversion expects single precision Assimp data");
+	static_assert(sizeof(aiColor4D) == sizeof(float) * 4, "Vertex conversion expects single precision Assimp data");
+
+	// Address of the attribute of the i'th vertex, given the attribute address of the first
+	inline float* VertexAttribute(float* first, unsigned i)
+	{
+		return reinterpret_cast<float*>(reinterpret_cast<char*>(first) + static_cast<size_t>(i) * sizeof(Vertex));
+	}
+
+	// Stores the lower 3 or 2 lanes without touching the neighbouring attribute
+	inline void StoreFloat3(float* destination, __m128 value)
+	{
+		_mm_storel_pi(reinterpret_cast<__m64*>(destination), value);
+		_mm_store_ss(destination + 2, _mm_movehl_ps(value, value));
+	}
+
+	inline void StoreFloat2(float* destination, __m128 value)
+	{
+		_mm_storel_pi(reinterpret_cast<__m64*>(destination), value);
+	}
+
+	// Scatters a packed float3 stream into the interleaved vertices. Four vertices are deinterleaved per
+	// iteration from three unaligned loads. Only the first 'components' floats of each element are written
+	template <unsigned components>
+	void ScatterFloat3Stream(const aiVector3D* source, unsigned count, float* destination)
 	{
-		for (auto i = 0u; i < mesh->mNumVertices; ++i)
+		static_assert(components == 2 || components == 3, "Only float2 and float3 attributes are supported");
+
+		auto store = [](float* d, __m128 value)
+		{
+			if constexpr (components == 3)
+				StoreFloat3(d, value);
+			else
+				StoreFloat2(d, value);
+		};
+
+		auto i = 0u;
+		for (; i + 4 <= count; i += 4)
 		{
-			vertex_count++;
+			const float* s = &source[i].x;
+			__m128 a = _mm_loadu_ps(s);     // x0 y0 z0 x1
+			__m128 b = _mm_loadu_ps(s + 4); // y1 z1 x2 y2
+			__m128 c = _mm_loadu_ps(s + 8); // z2 x3 y3 z3
 
-			// Set the positions
-			float x = static_cast<float>(mesh->mVertices[i].x);
-			float y = static_cast<float>(mesh->mVertices[i].y);
-			float z = static_cast<float>(mesh->mVertices[i].z);
+			__m128 t = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 3, 3));
+			__m128 v1 = _mm_shuffle_ps(t, b, _MM_SHUFFLE(1, 1, 2, 0));
+			__m128 v2 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 0, 3, 2));
+			__m128 v3 = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 2, 1));
 
-			// Create a vertex to store the mesh's vertices temporarily
-			Vertex vertex;
-			vertex.position.x = x;
-			vertex.position.y = y;
-			vertex.position.z = z;
+			store(VertexAttribute(destination, i + 0), a);
+			store(VertexAttribute(destination, i + 1), v1);
+			store(VertexAttribute(destination, i + 2), v2);
+			store(VertexAttribute(destination, i + 3), v3);
+		}
 
-			// Detect and write colours
-			if (mesh->HasVertexColors(0))
+		// Remaining vertices without reading past the end of the stream
+		for (; i < count; ++i)
+		{
+			float* d = VertexAttribute(destination, i);
+			for (auto k = 0u; k < components; ++k)
 			{
-				auto assimp_colour = mesh->mColors[0][i];
+				d[k] = (&source[i].x)[k];
+			}
+		}
+	}
+
+	// Scatters a packed float4 stream into the interleaved vertices
+	void ScatterFloat4Stream(const aiColor4D* source, unsigned count, float* destination)
+	{
+		for (auto i = 0u; i < count; ++i)
+		{
+			_mm_storeu_ps(VertexAttribute(destination, i), _mm_loadu_ps(&source[i].r));
+		}
+	}
+
+	// Converts a range of vertices one attribute stream at a time. Attribute presence is checked once per
+	// stream rather than per vertex, and absent attributes keep the zeroes written when the vertex array
+	// was sized
+	void LoadVertices(aiMesh* mesh, unsigned begin, unsigned end, Vertex* vertices)
+	{
+		auto count = end - begin;
+		auto first = vertices + begin;
 
-				vertex.colour.r = assimp_colour.r;
-				vertex.colour.g = assimp_colour.g;
-				vertex.colour.b = assimp_colour.b;
-				vertex.colour.a = assimp_colour.a;
+		// Positions
+		ScatterFloat3Stream<3>(mesh->mVertices + begin, count, &first->position.x);
+
+		// Colours
+		if (mesh->HasVertexColors(0))
+		{
+			ScatterFloat4Stream(mesh->mColors[0] + begin, count, &first->colour.r);
+		}
+
+		// Texture UV's
+		if (mesh->mTextureCoords[0])
+		{
+			ScatterFloat3Stream<2>(mesh->mTextureCoords[0] + begin, count, &first->texture.u);
+		}
+
+		// Normals
+		if (mesh->HasNormals())
+		{
+			ScatterFloat3Stream<3>(mesh->mNormals + begin, count, &first->normal.x);
+		}
+
+		// Tangents and bi-tangents
+		if (mesh->HasTangentsAndBitangents())
+		{
+			ScatterFloat3Stream<3>(mesh->mTangents + begin, count, &first->tangent.x);
+			ScatterFloat3Stream<3>(mesh->mBitangents + begin, count, &first->bi_tangent.x);
+		}
+	}
+
+	void LoadIndices(aiMesh* mesh, unsigned begin, unsigned end, UINT* indices)
+	{
+		if (HasOnlyTriangles(mesh))
+		{
+			// Faces map directly to index offsets
+			for (auto i = begin; i < end; ++i)
+			{
+				const auto& face = mesh->mFaces[i];
+				indices[i * 3 + 0] = face.mIndices[0];
+				indices[i * 3 + 1] = face.mIndices[1];
+				indices[i * 3 + 2] = face.mIndices[2];
 			}
 
-			// Detect and write normals
-			if (mesh->HasNormals())
+			return;
+		}
+
+		// Mixed primitive types are only ever loaded as a single chunk
+		auto index = 0u;
+		for (auto i = begin; i < end; ++i)
+		{
+			// Get the face
+			const auto& face = mesh->mFaces[i];
+
+			// Add the indices of the face to the vector
+			for (auto k = 0u; k < face.mNumIndices; ++k)
 			{
-				vertex.normal.x = mesh->mNormals[i].x;
-				vertex.normal.y = mesh->mNormals[i].y;
-				vertex.normal.z = mesh->mNormals[i].z;
+				indices[index++] = face.mIndices[k];
 			}
+		}
+	}
 
-			// Has texture UV's
-			if (mesh->mTextureCoords[0])
+	// Assign the vertex weights of a mesh. Each mesh only writes to its own range of vertices
+	// Vertex bone indices refer to the mesh's own bone list, which becomes the palette of its subset
+	void LoadVertexWeights(aiMesh* mesh, Vertex* vertices)
+	{
+		for (auto bone_index = 0u; bone_index < mesh->mNumBones; ++bone_index)
+		{
+			auto ai_bone = mesh->mBones[bone_index];
+			for (auto bone_weight_index = 0u; bone_weight_index < ai_bone->mNumWeights; bone_weight_index++)
 			{
-				vertex.texture.u = mesh->mTextureCoords[0][i].x;
-				vertex.texture.v = mesh->mTextureCoords[0][i].y;
+				auto vertexID = ai_bone->mWeights[bone_weight_index].mVertexId;
+				auto weight = ai_bone->mWeights[bone_weight_index].mWeight;
+				auto& vertex = vertices[vertexID];
+
+				for (int vertex_weight_index = 0; vertex_weight_index < 4; ++vertex_weight_index)
+				{
+					if (vertex.weight[vertex_weight_index] == 0.0)
+					{
+						vertex.weight[vertex_weight_index] = weight;
+						vertex.bone[vertex_weight_index] = static_cast<int>(bone_index);
+						break;
+					}
+				}
 			}
+		}
+	}
+
+	// Subsets with fewer triangles cost too little to be worth levels of detail
+	constexpr unsigned MinLodTriangles = 256;
 
-			// Detect and write tangents and bi-tangents
-			if (mesh->HasTangentsAndBitangents())
+	// Subsets with fewer triangles than this many full meshlets are culled as a whole
+	constexpr unsigned MinMeshletsPerSubset = 4;
+
+	// Weights below this are left out of bone bounds, since they barely move the vertex
+	constexpr float BoundsInfluenceThreshold = 1.0e-4f;
+
+	// Bounds that contain nothing. The extents are negative so they can be told apart from real bounds
+	const DirectX::BoundingBox EmptyBounds(DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), DirectX::XMFLOAT3(-1.0f, -1.0f, -1.0f));
+
+	// Bind pose bounds of a subset's vertices, found with SIMD min and max reductions over the positions. The
+	// sphere is centred on the box. Each of the subset's bones also gets the bounds of the vertices it influences
+	void ComputeSubsetBounds(const Vertex* vertices, unsigned count, Subset* subset, std::vector<DirectX::BoundingBox>* bone_bounds)
+	{
+		auto min = DirectX::XMVectorReplicate(FLT_MAX);
+		auto max = DirectX::XMVectorReplicate(-FLT_MAX);
+		std::vector<DirectX::XMVECTOR> bone_min(subset->boneCount, min);
+		std::vector<DirectX::XMVECTOR> bone_max(subset->boneCount, max);
+
+		for (auto i = 0u; i < count; ++i)
+		{
+			auto& vertex = vertices[i];
+			auto position = DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertex.position));
+			min = DirectX::XMVectorMin(min, position);
+			max = DirectX::XMVectorMax(max, position);
+
+			// Same weights as the vertex shader, where the last is whatever the first three leave
+			const float weights[4] = { vertex.weight[0], vertex.weight[1], vertex.weight[2], 1.0f - vertex.weight[0] - vertex.weight[1] - vertex.weight[2] };
+			for (int j = 0; j < 4; ++j)
+			{
+				auto bone = static_cast<unsigned>(vertex.bone[j]);
+				if (weights[j] > BoundsInfluenceThreshold && bone < subset->boneCount)
+				{
+					bone_min[bone] = DirectX::XMVectorMin(bone_min[bone], position);
+					bone_max[bone] = DirectX::XMVectorMax(bone_max[bone], position);
+				}
+			}
+		}
+
+		bone_bounds->assign(subset->boneCount, EmptyBounds);
+		if (count == 0)
+		{
+			subset->box = DirectX::BoundingBox(DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f));
+			subset->sphere = DirectX::BoundingSphere(DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), 0.0f);
+			return;
+		}
+
+		DirectX::BoundingBox::CreateFromPoints(subset->box, min, max);
+
+		auto centre = DirectX::XMLoadFloat3(&subset->box.Center);
+		auto radius_squared = DirectX::XMVectorZero();
+		for (auto i = 0u; i < count; ++i)
+		{
+			auto position = DirectX::XMLoadFloat3(reinterpret_cast<const DirectX::XMFLOAT3*>(&vertices[i].position));
+			radius_squared = DirectX::XMVectorMax(radius_squared, DirectX::XMVector3LengthSq(DirectX::XMVectorSubtract(position, centre)));
+		}
+
+		subset->sphere = DirectX::BoundingSphere(subset->box.Center, std::sqrt(DirectX::XMVectorGetX(radius_squared)));
+
+		for (auto j = 0u; j < subset->boneCount; ++j)
+		{
+			if (DirectX::XMVector3LessOrEqual(bone_min[j], bone_max[j]))
 			{
-				vertex.tangent.x = mesh->mTangents[i].x;
-				vertex.tangent.y = mesh->mTangents[i].y;
-				vertex.tangent.z = mesh->mTangents[i].z;
+				DirectX::BoundingBox::CreateFromPoints((*bone_bounds)[j], bone_min[j], bone_max[j]);
+			}
+		}
+	}
 
-				vertex.bi_tangent.x = mesh->mBitangents[i].x;
-				vertex.bi_tangent.y = mesh->mBitangents[i].y;
-				vertex.bi_tangent.z = mesh->mBitangents[i].z;
+	// Builds the skeleton of a scene. Bone names are interned into integer ids through a hash map so bones
+	// shared between meshes are stored once, and bones are emitted in parent-before-child order so the
+	// hierarchy can be walked in a single forward pass
+	class SkeletonBuilder
+	{
+	public:
+		void Build(const aiScene* scene, MeshData* meshData)
+		{
+			// Unique bones across all meshes
+			std::unordered_map<std::string, const aiBone*> scene_bones;
+			for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+			{
+				auto mesh = scene->mMeshes[mesh_index];
+				for (auto bone_index = 0u; bone_index < mesh->mNumBones; ++bone_index)
+				{
+					scene_bones.emplace(mesh->mBones[bone_index]->mName.C_Str(), mesh->mBones[bone_index]);
+				}
 			}
 
-			// Add the vertex to the vertices vector
-			meshData->vertices.push_back(vertex);
+			// Walking the node hierarchy depth first visits every parent before its children
+			AddBones(scene->mRootNode, -1, scene_bones, meshData);
+
+			// Bones that are not part of the node hierarchy become roots
+			for (auto& bone : scene_bones)
+			{
+				if (m_BoneIds.find(bone.first) == m_BoneIds.end())
+				{
+					AddBone(bone.second, bone.first, "", -1, meshData);
+				}
+			}
+
+			// Map each mesh's bones to their skeleton id
+			m_MeshBoneIds.resize(scene->mNumMeshes);
+			for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+			{
+				auto mesh = scene->mMeshes[mesh_index];
+				m_MeshBoneIds[mesh_index].resize(mesh->mNumBones);
+				for (auto bone_index = 0u; bone_index < mesh->mNumBones; ++bone_index)
+				{
+					m_MeshBoneIds[mesh_index][bone_index] = FindBone(mesh->mBones[bone_index]->mName.C_Str());
+				}
+			}
+		}
+
+		// Returns the skeleton id of the bone or -1 if the name is not a bone
+		int FindBone(const std::string& name) const
+		{
+			auto bone = m_BoneIds.find(name);
+			return bone != m_BoneIds.end() ? bone->second : -1;
+		}
+
+		// Skeleton ids of a mesh's bones, indexed by the mesh's bone index
+		const std::vector<int>& GetMeshBoneIds(unsigned mesh_index) const
+		{
+			return m_MeshBoneIds[mesh_index];
 		}
+
+	private:
+		std::unordered_map<std::string, int> m_BoneIds;
+		std::vector<std::vector<int>> m_MeshBoneIds;
+
+		void AddBones(const aiNode* node, int parent_id, const std::unordered_map<std::string, const aiBone*>& scene_bones, MeshData* meshData)
+		{
+			auto bone = scene_bones.find(node->mName.C_Str());
+			if (bone != scene_bones.end() && m_BoneIds.find(bone->first) == m_BoneIds.end())
+			{
+				auto parent_name = node->mParent != nullptr ? node->mParent->mName.C_Str() : "";
+				parent_id = AddBone(bone->second, bone->first, parent_name, parent_id, meshData);
+			}
+
+			for (auto i = 0u; i < node->mNumChildren; ++i)
+			{
+				AddBones(node->mChildren[i], parent_id, scene_bones, meshData);
+			}
+		}
+
+		int AddBone(const aiBone* ai_bone, const std::string& name, const std::string& parent_name, int parent_id, MeshData* meshData)
+		{
+			auto id = static_cast<int>(meshData->bones.size());
+			m_BoneIds.emplace(name, id);
+
+			BoneInfo boneInfo = {};
+			boneInfo.parentId = parent_id;
+			boneInfo.name = name;
+			boneInfo.parentName = parent_name;
+			DirectX::XMStoreFloat4x3(&boneInfo.offset, ConvertToDirectXMatrix(ai_bone->mOffsetMatrix));
+			meshData->bones.push_back(boneInfo);
+
+			return id;
+		}
+	};
+
+	// Bones without an animation channel hold their bind pose from the node hierarchy
+	// Keys of one channel as imported, before they are compressed
+	struct ImportedChannel
+	{
+		std::vector<float> translationTimes;
+		std::vector<DirectX::XMFLOAT3> translations;
+		std::vector<float> rotationTimes;
+		std::vector<DirectX::XMFLOAT4> rotations;
+		std::vector<float> scaleTimes;
+		std::vector<DirectX::XMFLOAT3> scales;
+	};
+
+	// Single key channel holding the bind pose of a bone
+	ImportedChannel GetBindPoseChannel(const aiScene* scene, const std::string& name)
+	{
+		aiVector3D scale(1.0f, 1.0f, 1.0f), pos(0.0f, 0.0f, 0.0f);
+		aiQuaternion rotation;
+
+		auto node = scene->mRootNode->FindNode(name.c_str());
+		if (node != nullptr)
+		{
+			node->mTransformation.Decompose(scale, rotation, pos);
+		}
+
+		ImportedChannel channel;
+		channel.translationTimes.push_back(0.0f);
+		channel.translations.push_back(DirectX::XMFLOAT3(pos.x, pos.y, pos.z));
+		channel.rotationTimes.push_back(0.0f);
+		channel.rotations.push_back(DirectX::XMFLOAT4(rotation.x, rotation.y, rotation.z, rotation.w));
+		channel.scaleTimes.push_back(0.0f);
+		channel.scales.push_back(DirectX::XMFLOAT3(scale.x, scale.y, scale.z));
+		return channel;
 	}
 
-	void LoadIndices(aiMesh* mesh, MeshData* meshData, unsigned& index_count)
+	// Position, rotation and scale keys are read separately since their counts may differ
+	ImportedChannel ReadChannel(const aiNodeAnim* channel, const ImportedChannel& bindPose)
 	{
-		for (auto i = 0u; i < mesh->mNumFaces; ++i)
+		ImportedChannel imported;
+		for (unsigned k = 0; k < channel->mNumPositionKeys; ++k)
 		{
-			// Get the face
-			const auto& face = mesh->mFaces[i];
+			auto& key = channel->mPositionKeys[k];
+			imported.translationTimes.push_back(static_cast<float>(key.mTime));
+			imported.translations.push_back(DirectX::XMFLOAT3(key.mValue.x, key.mValue.y, key.mValue.z));
+		}
 
-			// Add the indices of the face to the vector
-			for (auto k = 0u; k < face.mNumIndices; ++k)
+		for (unsigned k = 0; k < channel->mNumRotationKeys; ++k)
+		{
+			auto& key = channel->mRotationKeys[k];
+			imported.rotationTimes.push_back(static_cast<float>(key.mTime));
+			imported.rotations.push_back(DirectX::XMFLOAT4(key.mValue.x, key.mValue.y, key.mValue.z, key.mValue.w));
+		}
+
+		for (unsigned k = 0; k < channel->mNumScalingKeys; ++k)
+		{
+			auto& key = channel->mScalingKeys[k];
+			imported.scaleTimes.push_back(static_cast<float>(key.mTime));
+			imported.scales.push_back(DirectX::XMFLOAT3(key.mValue.x, key.mValue.y, key.mValue.z));
+		}
+
+		// Tracks without keys hold the bind pose
+		if (imported.translations.empty())
+		{
+			imported.translationTimes = bindPose.translationTimes;
+			imported.translations = bindPose.translations;
+		}
+
+		if (imported.rotations.empty())
+		{
+			imported.rotationTimes = bindPose.rotationTimes;
+			imported.rotations = bindPose.rotations;
+		}
+
+		if (imported.scales.empty())
+		{
+			imported.scaleTimes = bindPose.scaleTimes;
+			imported.scales = bindPose.scales;
+		}
+
+		return imported;
+	}
+
+	// Bytes the channel takes up as imported
+	size_t GetMemoryUsage(const ImportedChannel& channel)
+	{
+		return (channel.translationTimes.size() + channel.rotationTimes.size() + channel.scaleTimes.size()) * sizeof(float) +
+			channel.translations.size() * sizeof(DirectX::XMFLOAT3) +
+			channel.rotations.size() * sizeof(DirectX::XMFLOAT4) +
+			channel.scales.size() * sizeof(DirectX::XMFLOAT3);
+	}
+
+	template <typename T>
+	void SetTrack(const std::vector<float>& times, std::vector<T> values, KeyframeTrack<T>* track)
+	{
+		// A track that never changes only needs its first key
+		auto constant = std::all_of(values.begin(), values.end(), [&](const T& value) { return std::memcmp(&value, &values.front(), sizeof(T)) == 0; });
+		if (constant)
+		{
+			values.resize(1);
+		}
+
+		track->Keys.Assign(constant ? std::vector<float>(1, times.front()) : times);
+		track->Values = std::move(values);
+	}
+
+	// Returns the key at or before t and writes the blend factor towards the next key
+	size_t FindKey(const std::vector<float>& times, float t, float* lerpPercent)
+	{
+		*lerpPercent = 0.0f;
+		if (times.size() < 2 || t <= times.front())
+		{
+			return 0;
+		}
+
+		if (t >= times.back())
+		{
+			return times.size() - 1;
+		}
+
+		auto index = static_cast<size_t>(std::distance(times.begin(), std::upper_bound(times.begin(), times.end(), t))) - 1;
+		*lerpPercent = (t - times[index]) / (times[index + 1] - times[index]);
+		return index;
+	}
+
+	DirectX::XMMATRIX SampleChannel(const ImportedChannel& channel, float t)
+	{
+		auto lerpPercent = 0.0f;
+
+		auto i = FindKey(channel.translationTimes, t, &lerpPercent);
+		auto next = std::min(i + 1, channel.translations.size() - 1);
+		auto P = DirectX::XMVectorLerp(XMLoadFloat3(&channel.translations[i]), XMLoadFloat3(&channel.translations[next]), lerpPercent);
+
+		i = FindKey(channel.rotationTimes, t, &lerpPercent);
+		next = std::min(i + 1, channel.rotations.size() - 1);
+		auto Q = DirectX::XMQuaternionSlerp(XMLoadFloat4(&channel.rotations[i]), XMLoadFloat4(&channel.rotations[next]), lerpPercent);
+
+		i = FindKey(channel.scaleTimes, t, &lerpPercent);
+		next = std::min(i + 1, channel.scales.size() - 1);
+		auto S = DirectX::XMVectorLerp(XMLoadFloat3(&channel.scales[i]), XMLoadFloat3(&channel.scales[next]), lerpPercent);
+
+		return DirectX::XMMatrixAffineTransformation(S, DirectX::XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f), Q, P);
+	}
+
+	// Turns parent relative transforms into model space. Bones are stored parent-before-child
+	void ToRoot(const std::vector<BoneInfo>& bones, std::vector<DirectX::XMMATRIX>& transforms)
+	{
+		for (size_t i = 0; i < bones.size(); ++i)
+		{
+			if (bones[i].parentId >= 0)
+			{
+				transforms[i] = DirectX::XMMatrixMultiply(transforms[i], transforms[bones[i].parentId]);
+			}
+		}
+	}
+
+	// Bones reach at least this share of the model's radius, so that bones with no vertices or children, such as the
+	// root of a rigid prop, still keep their rotation and scale keys
+	constexpr float MinBoneReachShare = 0.01f;
+
+	// Most keys a span between two kept keys may skip, which bounds the keys tested as it grows on long smooth channels
+	constexpr size_t MaxSkippedKeys = 128;
+
+	// Every time any channel of a clip has a key, sorted and without repeats
+	std::vector<float> GetKeyTimes(const std::vector<ImportedChannel>& channels)
+	{
+		std::vector<float> times;
+		for (auto& channel : channels)
+		{
+			times.insert(times.end(), channel.translationTimes.begin(), channel.translationTimes.end());
+			times.insert(times.end(), channel.rotationTimes.begin(), channel.rotationTimes.end());
+			times.insert(times.end(), channel.scaleTimes.begin(), channel.scaleTimes.end());
+		}
+
+		std::sort(times.begin(), times.end());
+		times.erase(std::unique(times.begin(), times.end()), times.end());
+		return times;
+	}
+
+	// How far a change to each bone moves the skeleton in model space
+	struct BoneReach
+	{
+		// Distance to the furthest descendant or influenced vertex, or to the parent for leaf bones, over the whole clip
+		float distance = 0.0f;
+
+		// Bones on the longest root to leaf chain through this bone
+		unsigned chainLength = 1;
+	};
+
+	// Bone distances are measured at every key time, and each bone reaches at least as far as the bind pose vertices it
+	// influences
+	std::vector<BoneReach> GetBoneReach(const MeshData& meshData, const std::vector<ImportedChannel>& channels)
+	{
+		auto& bones = meshData.bones;
+		std::vector<float> vertex_reach(bones.size(), meshData.sphere.Radius * MinBoneReachShare);
+		for (size_t i = 0; i < bones.size() && i < meshData.boneBounds.size(); ++i)
+		{
+			auto& bounds = meshData.boneBounds[i];
+			if (bounds.Extents.x < 0.0f)
+				continue;
+
+			auto bind_pose = DirectX::XMMatrixInverse(nullptr, DirectX::XMLoadFloat4x3(&bones[i].offset));
+			auto centre_distance = DirectX::XMVector3Length(DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&bounds.Center), bind_pose.r[3]));
+			auto extent = DirectX::XMVector3Length(DirectX::XMLoadFloat3(&bounds.Extents));
+			vertex_reach[i] = std::max(vertex_reach[i], DirectX::XMVectorGetX(DirectX::XMVectorAdd(centre_distance, extent)));
+		}
+
+		std::vector<BoneReach> reach(bones.size());
+		std::vector<unsigned> depth(bones.size(), 1);
+		std::vector<unsigned> height(bones.size(), 1);
+		for (size_t i = 0; i < bones.size(); ++i)
+		{
+			auto parentId = bones[i].parentId;
+			if (parentId >= 0)
+			{
+				depth[i] = depth[parentId] + 1;
+			}
+		}
+
+		// Children come after their parents, so walking backwards sees every child first
+		for (size_t i = bones.size(); i-- > 0;)
+		{
+			auto parentId = bones[i].parentId;
+			if (parentId >= 0)
+			{
+				height[parentId] = std::max(height[parentId], height[i] + 1);
+			}
+		}
+
+		std::vector<DirectX::XMMATRIX> pose(bones.size());
+		std::vector<float> lengths(bones.size());
+		std::vector<float> distances(bones.size());
+		auto times = GetKeyTimes(channels);
+		if (times.empty())
+		{
+			times.push_back(0.0f);
+		}
+
+		for (auto t : times)
+		{
+			for (size_t i = 0; i < bones.size(); ++i)
+			{
+				pose[i] = SampleChannel(channels[i], t);
+			}
+
+			ToRoot(bones, pose);
+
+			for (size_t i = 0; i < bones.size(); ++i)
+			{
+				auto parentId = bones[i].parentId;
+				lengths[i] = 0.0f;
+				if (parentId >= 0)
+				{
+					lengths[i] = DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(pose[i].r[3], pose[parentId].r[3])));
+				}
+
+				distances[i] = std::max(lengths[i], vertex_reach[i]);
+			}
+
+			for (size_t i = bones.size(); i-- > 0;)
+			{
+				auto parentId = bones[i].parentId;
+				if (parentId >= 0)
+				{
+					distances[parentId] = std::max(distances[parentId], distances[i] + lengths[i]);
+				}
+			}
+
+			for (size_t i = 0; i < bones.size(); ++i)
+			{
+				reach[i].distance = std::max(reach[i].distance, distances[i]);
+			}
+		}
+
+		for (size_t i = 0; i < bones.size(); ++i)
+		{
+			reach[i].chainLength = depth[i] + height[i] - 1;
+		}
+
+		return reach;
+	}
+
+	// Removes the keys that interpolating between the kept keys reproduces within the tolerance
+	template <typename T, typename ErrorFunction>
+	void ReduceKeys(std::vector<float>& times, std::vector<T>& values, float tolerance, ErrorFunction error)
+	{
+		if (values.size() < 3)
+		{
+			return;
+		}
+
+		// Channels that stay within the tolerance of their first key only need that key
+		auto constant = std::all_of(values.begin() + 1, values.end(), [&](const T& value) { return error(values.front(), values.front(), 0.0f, value) <= tolerance; });
+		if (constant)
+		{
+			times.resize(1);
+			values.resize(1);
+			return;
+		}
+
+		std::vector<float> kept_times(1, times.front());
+		std::vector<T> kept_values(1, values.front());
+
+		// Grow the span from the last kept key until a skipped key no longer fits or it skips MaxSkippedKeys. The key
+		// skipped last is tested first, being the likeliest to break the span
+		size_t anchor = 0;
+		for (size_t end = anchor + 2; end < values.size(); ++end)
+		{
+			auto fits_key = [&](size_t i)
+			{
+				auto lerpPercent = (times[i] - times[anchor]) / (times[end] - times[anchor]);
+				return error(values[anchor], values[end], lerpPercent, values[i]) <= tolerance;
+			};
+
+			auto fits = end - anchor - 1 <= MaxSkippedKeys && fits_key(end - 1);
+			for (size_t i = anchor + 1; fits && i < end - 1; ++i)
+			{
+				fits = fits_key(i);
+			}
+
+			if (!fits)
 			{
-				index_count++;
-				meshData->indices.push_back(face.mIndices[k]);
+				anchor = end - 1;
+				kept_times.push_back(times[anchor]);
+				kept_values.push_back(values[anchor]);
 			}
 		}
+
+		kept_times.push_back(times.back());
+		kept_values.push_back(values.back());
+
+		times = std::move(kept_times);
+		values = std::move(kept_values);
+	}
+
+	// Removes keys from every channel of a clip. Errors add up along a chain of bones, so each bone gets an
+	// equal share of its tolerance for the longest chain it is part of. Rotation and scale errors are
+	// measured at the bone's reach so they bound how far the furthest descendant moves
+	void ReduceClip(const std::vector<BoneInfo>& bones, const std::vector<BoneReach>& reach, const ModelLoader::ImportSettings& settings, std::vector<ImportedChannel>& channels)
+	{
+		std::vector<unsigned> bone_ids(channels.size());
+		std::iota(bone_ids.begin(), bone_ids.end(), 0u);
+		std::for_each(std::execution::par, bone_ids.begin(), bone_ids.end(), [&](unsigned bone_id)
+		{
+			auto tolerance = settings.keyTolerance;
+			auto bone_tolerance = settings.boneKeyTolerances.find(bones[bone_id].name);
+			if (bone_tolerance != settings.boneKeyTolerances.end())
+			{
+				tolerance = bone_tolerance->second;
+			}
+
+			if (tolerance <= 0.0f)
+			{
+				return;
+			}
+
+			tolerance /= static_cast<float>(reach[bone_id].chainLength);
+			auto distance = reach[bone_id].distance;
+			auto& channel = channels[bone_id];
+
+			ReduceKeys(channel.translationTimes, channel.translations, tolerance, [](const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b, float t, const DirectX::XMFLOAT3& expected)
+			{
+				auto value = DirectX::XMVectorLerp(XMLoadFloat3(&a), XMLoadFloat3(&b), t);
+				return DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(value, XMLoadFloat3(&expected))));
+			});
+
+			// A rotation error of angle theta moves a point at distance d by 2 * sin(theta / 2) * d
+			ReduceKeys(channel.rotationTimes, channel.rotations, tolerance, [distance](const DirectX::XMFLOAT4& a, const DirectX::XMFLOAT4& b, float t, const DirectX::XMFLOAT4& expected)
+			{
+				auto value = DirectX::XMQuaternionSlerp(XMLoadFloat4(&a), XMLoadFloat4(&b), t);
+				auto cosine = std::min(std::abs(DirectX::XMVectorGetX(DirectX::XMQuaternionDot(value, XMLoadFloat4(&expected)))), 1.0f);
+				return 2.0f * std::sqrt(1.0f - cosine * cosine) * distance;
+			});
+
+			ReduceKeys(channel.scaleTimes, channel.scales, tolerance, [distance](const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b, float t, const DirectX::XMFLOAT3& expected)
+			{
+				auto value = DirectX::XMVectorLerp(XMLoadFloat3(&a), XMLoadFloat3(&b), t);
+				return DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(value, XMLoadFloat3(&expected)))) * distance;
+			});
+		});
+	}
+
+	size_t CountKeys(const std::vector<ImportedChannel>& channels)
+	{
+		size_t count = 0;
+		for (auto& channel : channels)
+		{
+			count += channel.translations.size() + channel.rotations.size() + channel.scales.size();
+		}
+
+		return count;
+	}
+
+	// Largest model space distance between the imported and the compressed clip at every imported key time.
+	// Each bone is measured at its origin and at its reach along each axis
+	float MeasureError(const std::vector<BoneInfo>& bones, const std::vector<BoneReach>& reach, const std::vector<ImportedChannel>& channels, const AnimationClip& clip)
+	{
+		auto times = GetKeyTimes(channels);
+		std::vector<KeyframeCursor> cursors(bones.size());
+		std::vector<DirectX::XMMATRIX> expected(bones.size());
+		std::vector<DirectX::XMMATRIX> actual(bones.size());
+
+		auto max_error = DirectX::XMVectorZero();
+		for (auto t : times)
+		{
+			for (size_t i = 0; i < bones.size(); ++i)
+			{
+				expected[i] = SampleChannel(channels[i], t);
+			}
+
+			clip.Interpolate(t, cursors, actual.data());
+			ToRoot(bones, expected);
+			ToRoot(bones, actual);
+
+			for (size_t i = 0; i < bones.size(); ++i)
+			{
+				auto distance = reach[i].distance;
+				const DirectX::XMVECTOR points[4] =
+				{
+					DirectX::XMVectorZero(),
+					DirectX::XMVectorSet(distance, 0.0f, 0.0f, 0.0f),
+					DirectX::XMVectorSet(0.0f, distance, 0.0f, 0.0f),
+					DirectX::XMVectorSet(0.0f, 0.0f, distance, 0.0f)
+				};
+
+				for (auto& point : points)
+				{
+					auto difference = DirectX::XMVectorSubtract(DirectX::XMVector3Transform(point, expected[i]), DirectX::XMVector3Transform(point, actual[i]));
+					max_error = DirectX::XMVectorMax(max_error, DirectX::XMVector3Length(difference));
+				}
+			}
+		}
+
+		return DirectX::XMVectorGetX(max_error);
+	}
+
+	// Compresses the imported channels into the tracks of the clip. Translations are quantized within the range of the whole clip
+	void CompressClip(const std::vector<ImportedChannel>& channels, AnimationClip* clip)
+	{
+		auto min = DirectX::XMVectorReplicate(std::numeric_limits<float>::max());
+		auto max = DirectX::XMVectorReplicate(-std::numeric_limits<float>::max());
+		for (auto& channel : channels)
+		{
+			for (auto& translation : channel.translations)
+			{
+				min = DirectX::XMVectorMin(min, XMLoadFloat3(&translation));
+				max = DirectX::XMVectorMax(max, XMLoadFloat3(&translation));
+			}
+		}
+
+		if (!channels.empty())
+		{
+			XMStoreFloat3(&clip->Translations.Min, min);
+			XMStoreFloat3(&clip->Translations.Extent, DirectX::XMVectorSubtract(max, min));
+		}
+
+		clip->BoneAnimations.resize(channels.size());
+		for (size_t i = 0; i < channels.size(); ++i)
+		{
+			auto& channel = channels[i];
+			auto& animation = clip->BoneAnimations[i];
+
+			std::vector<PackedTranslation> translations(channel.translations.size());
+			std::transform(channel.translations.begin(), channel.translations.end(), translations.begin(), [&](const DirectX::XMFLOAT3& translation) { return clip->Translations.Pack(translation); });
+			SetTrack(channel.translationTimes, std::move(translations), &animation.Translation);
+
+			std::vector<PackedQuaternion> rotations(channel.rotations.size());
+			std::transform(channel.rotations.begin(), channel.rotations.end(), rotations.begin(), PackedQuaternion::Pack);
+			SetTrack(channel.rotationTimes, std::move(rotations), &animation.Rotation);
+
+			SetTrack(channel.scaleTimes, channel.scales, &animation.Scale);
+		}
 	}
 }
 
-bool ModelLoader::Load(const std::string& path, MeshData* meshData)
+bool ModelLoader::Load(const std::string& path, MeshData* meshData, const ImportSettings& settings)
 {
+	// Assimp only parses and triangulates. Welding, normals and tangents are done below, where large meshes are spread
+	// over several workers
 	Assimp::Importer importer;
-	auto scene = importer.ReadFile(path, aiProcessPreset_TargetRealtime_Fast | aiProcess_ConvertToLeftHanded | aiProcess_PopulateArmatureData);
+	auto scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_SortByPType | aiProcess_GenUVCoords | aiProcess_ConvertToLeftHanded | aiProcess_PopulateArmatureData);
 
 	// Load model
 	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
@@ -111,10 +896,10 @@ bool ModelLoader::Load(const std::string& path, MeshData* meshData)
 		return false;
 	}
 
+	// Size the output and lay out every subset up front
 	auto index_count_total = 0u;
 	auto vertex_count_total = 0u;
 
-	// Iterate over the meshes
 	meshData->subsets.resize(scene->mNumMeshes);
 	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
 	{
@@ -123,61 +908,371 @@ bool ModelLoader::Load(const std::string& path, MeshData* meshData)
 		Subset subset;
 		subset.startIndex = index_count_total;
 		subset.baseVertex = vertex_count_total;
+		subset.totalIndex = CountIndices(mesh);
+		subset.vertexCount = mesh->mNumVertices;
+		subset.lods[0] = { subset.startIndex, subset.totalIndex, 0.0f };
 
-		LoadVertices(mesh, meshData, vertex_count_total);
+		std::string name = mesh->mName.C_Str();
+		std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		subset.occluder = name.find("occluder") != std::string::npos;
+		meshData->subsets[mesh_index] = subset;
 
-		auto index_count = 0u;
-		LoadIndices(mesh, meshData, index_count);
+		index_count_total += subset.totalIndex;
+		vertex_count_total += mesh->mNumVertices;
+	}
 
-		index_count_total += index_count;
-		subset.totalIndex = index_count;
-		meshData->subsets[mesh_index] = subset;
+	meshData->vertices.resize(vertex_count_total);
+	meshData->indices.resize(index_count_total);
 
-		// Load bones
-		for (auto bone_index = 0u; bone_index < mesh->mNumBones; ++bone_index)
+	// Split meshes into chunks so that large meshes are spread over several workers
+	std::vector<ImportChunk> vertex_chunks;
+	std::vector<ImportChunk> index_chunks;
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		auto mesh = scene->mMeshes[mesh_index];
+		AddImportChunks(mesh_index, mesh->mNumVertices, vertex_chunks);
+
+		if (HasOnlyTriangles(mesh))
 		{
-			auto ai_bone = mesh->mBones[bone_index];
+			AddImportChunks(mesh_index, mesh->mNumFaces, index_chunks);
+		}
+		else
+		{
+			index_chunks.push_back({ mesh_index, 0, mesh->mNumFaces });
+		}
+	}
 
-			BoneInfo boneInfo = {};
-			boneInfo.name = ai_bone->mName.C_Str();
-			boneInfo.parentName = ai_bone->mNode->mParent->mName.C_Str();
-			meshData->bones.push_back(boneInfo);
+	// Convert vertices and indices concurrently into the preallocated storage
+	auto conversion_start = std::chrono::high_resolution_clock::now();
+	std::for_each(std::execution::par, vertex_chunks.begin(), vertex_chunks.end(), [&](const ImportChunk& chunk)
+	{
+		auto& subset = meshData->subsets[chunk.mesh];
+		LoadVertices(scene->mMeshes[chunk.mesh], chunk.begin, chunk.end, meshData->vertices.data() + subset.baseVertex);
+	});
 
-			meshData->bones[bone_index].offset = ConvertToDirectXMatrix(ai_bone->mOffsetMatrix);;
+	std::for_each(std::execution::par, index_chunks.begin(), index_chunks.end(), [&](const ImportChunk& chunk)
+	{
+		auto& subset = meshData->subsets[chunk.mesh];
+		LoadIndices(scene->mMeshes[chunk.mesh], chunk.begin, chunk.end, meshData->indices.data() + subset.startIndex);
+	});
 
-			// Vertex weight data
-			for (auto bone_weight_index = 0u; bone_weight_index < ai_bone->mNumWeights; bone_weight_index++)
-			{
-				auto vertexID = ai_bone->mWeights[bone_weight_index].mVertexId;
-				auto weight = ai_bone->mWeights[bone_weight_index].mWeight;
-				auto& vertex = meshData->vertices[vertexID];
+	auto conversion_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - conversion_start).count();
+	if (conversion_time > 0.0)
+	{
+		std::cout << "Converted " << vertex_count_total << " vertices in " << conversion_time * 1000.0 << " ms ("
+			<< vertex_count_total / conversion_time / 1000000.0 << " M vertices/s)\n";
+	}
 
-				for (int vertex_weight_index = 0; vertex_weight_index < 4; ++vertex_weight_index)
+	// Build the skeleton once for the whole scene
+	SkeletonBuilder skeleton;
+	skeleton.Build(scene, meshData);
+
+	// Bone palette of each subset
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		auto& bone_ids = skeleton.GetMeshBoneIds(mesh_index);
+		auto& subset = meshData->subsets[mesh_index];
+		subset.boneStart = static_cast<unsigned>(meshData->subsetBones.size());
+		subset.boneCount = static_cast<unsigned>(bone_ids.size());
+		meshData->subsetBones.insert(meshData->subsetBones.end(), bone_ids.begin(), bone_ids.end());
+	}
+
+	// Vertex weight data, one worker per mesh
+	std::vector<unsigned> mesh_indices(scene->mNumMeshes);
+	std::iota(mesh_indices.begin(), mesh_indices.end(), 0u);
+	std::for_each(std::execution::par, mesh_indices.begin(), mesh_indices.end(), [&](unsigned mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		LoadVertexWeights(scene->mMeshes[mesh_index], meshData->vertices.data() + subset.baseVertex);
+	});
+
+	// Generate what the file left out, then weld identical vertices, as Assimp orders its steps. Vertices are still as
+	// the file has them, so hard edges and mirrored texture seams keep their own vertices until they turn out the same.
+	// Normals come before tangents since tangents lie in their plane, and weights are in place since welding compares them.
+	// Flat normals need a vertex per corner, so meshes given them are first split into their own corners, which then
+	// live in mesh_corners
+	auto processing_start = std::chrono::high_resolution_clock::now();
+	std::vector<std::vector<Vertex>> mesh_corners(scene->mNumMeshes);
+	std::for_each(std::execution::par, mesh_indices.begin(), mesh_indices.end(), [&](unsigned mesh_index)
+	{
+		auto mesh = scene->mMeshes[mesh_index];
+		auto& subset = meshData->subsets[mesh_index];
+		auto vertices = meshData->vertices.data() + subset.baseVertex;
+		auto indices = meshData->indices.data() + subset.startIndex;
+		if (HasOnlyTriangles(mesh))
+		{
+			auto has_normals = mesh->HasNormals();
+			if (!has_normals && settings.generateNormals)
+			{
+				if (settings.normalSmoothingAngle <= 0.0f)
 				{
-					if (vertex.weight[vertex_weight_index] == 0.0)
+					auto& corners = mesh_corners[mesh_index];
+					corners.resize(subset.totalIndex);
+					for (auto i = 0u; i < subset.totalIndex; ++i)
 					{
-						vertex.weight[vertex_weight_index] = weight;
-						vertex.bone[vertex_weight_index] = bone_index;
-						break;
+						corners[i] = vertices[indices[i]];
+						indices[i] = i;
 					}
+
+					vertices = corners.data();
+					subset.vertexCount = subset.totalIndex;
 				}
+
+				MeshProcessor::GenerateNormals(vertices, subset.vertexCount, indices, subset.totalIndex, settings.normalSmoothingAngle);
+				has_normals = true;
+			}
+
+			if (has_normals && settings.generateTangents && mesh->HasTextureCoords(0) && !mesh->HasTangentsAndBitangents())
+			{
+				MeshProcessor::GenerateTangents(vertices, subset.vertexCount, indices, subset.totalIndex);
 			}
 		}
 
-		// Calculate parent
-		for (int i = 0; i < meshData->bones.size(); ++i)
+		if (settings.weldVertices)
 		{
-			int parentId = 0;
-			for (int j = 0; j < meshData->bones.size(); ++j)
+			subset.vertexCount = static_cast<unsigned>(MeshProcessor::WeldVertices(vertices, subset.vertexCount, indices, subset.totalIndex));
+		}
+	});
+
+	// Welding leaves gaps after each mesh's vertices, closed by moving the following meshes down. Split meshes may have
+	// grown past their place, so when there are any every mesh is gathered into a new array instead
+	auto split = std::any_of(mesh_corners.begin(), mesh_corners.end(), [](const std::vector<Vertex>& corners) { return !corners.empty(); });
+	std::vector<Vertex> split_vertices;
+	if (split)
+	{
+		split_vertices.resize(std::accumulate(meshData->subsets.begin(), meshData->subsets.end(), size_t(0), [](size_t count, const Subset& subset) { return count + subset.vertexCount; }));
+	}
+
+	auto& processed_vertices = split ? split_vertices : meshData->vertices;
+	auto processed_vertex_count = 0u;
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		auto& corners = mesh_corners[mesh_index];
+		auto first = corners.empty() ? meshData->vertices.begin() + subset.baseVertex : corners.begin();
+		if (split || subset.baseVertex != processed_vertex_count)
+		{
+			std::copy(first, first + subset.vertexCount, processed_vertices.begin() + processed_vertex_count);
+			subset.baseVertex = processed_vertex_count;
+		}
+
+		processed_vertex_count += subset.vertexCount;
+	}
+
+	if (split)
+	{
+		meshData->vertices = std::move(split_vertices);
+	}
+
+	meshData->vertices.resize(processed_vertex_count);
+
+	auto processing_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - processing_start).count();
+	if (processing_time > 0.0)
+	{
+		std::cout << "Processed " << index_count_total / 3 << " triangles in " << processing_time * 1000.0 << " ms ("
+			<< index_count_total / 3 / processing_time / 1000000.0 << " M triangles/s), taking " << vertex_count_total
+			<< " vertices to " << processed_vertex_count << '\n';
+	}
+
+	// Bounds of each subset and of the bones it uses, one worker per mesh
+	auto bounds_start = std::chrono::high_resolution_clock::now();
+	std::vector<std::vector<DirectX::BoundingBox>> subset_bone_bounds(scene->mNumMeshes);
+	std::for_each(std::execution::par, mesh_indices.begin(), mesh_indices.end(), [&](unsigned mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		ComputeSubsetBounds(meshData->vertices.data() + subset.baseVertex, subset.vertexCount, &subset, &subset_bone_bounds[mesh_index]);
+	});
+
+	// Bones shared between subsets get the bounds of all their vertices
+	meshData->boneBounds.assign(meshData->bones.size(), EmptyBounds);
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		for (auto i = 0u; i < subset.boneCount; ++i)
+		{
+			auto& local = subset_bone_bounds[mesh_index][i];
+			auto& bone = meshData->boneBounds[meshData->subsetBones[subset.boneStart + i]];
+			if (local.Extents.x >= 0.0f)
 			{
-				if (meshData->bones[i].parentName == meshData->bones[j].name)
+				if (bone.Extents.x < 0.0f)
 				{
-					parentId = j;
-					break;
+					bone = local;
 				}
+				else
+				{
+					DirectX::BoundingBox::CreateMerged(bone, bone, local);
+				}
+			}
+		}
+	}
+
+	// Model bounds. The sphere is centred on the box and reaches the furthest subset sphere
+	meshData->box = DirectX::BoundingBox(DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f));
+	auto has_bounds = false;
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		if (meshData->subsets[mesh_index].vertexCount > 0)
+		{
+			auto& box = meshData->subsets[mesh_index].box;
+			has_bounds ? DirectX::BoundingBox::CreateMerged(meshData->box, meshData->box, box) : void(meshData->box = box);
+			has_bounds = true;
+		}
+	}
+
+	auto model_centre = DirectX::XMLoadFloat3(&meshData->box.Center);
+	auto model_radius = 0.0f;
+	for (auto& subset : meshData->subsets)
+	{
+		auto distance = DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&subset.sphere.Center), model_centre)));
+		model_radius = std::max(model_radius, distance + subset.sphere.Radius);
+	}
+
+	meshData->sphere = DirectX::BoundingSphere(meshData->box.Center, model_radius);
+
+	auto bounds_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - bounds_start).count();
+	std::cout << "Computed bounds in " << bounds_time * 1000.0 << " ms\n";
+
+	// Levels of detail of each triangulated subset, one worker per mesh. Their indices follow every full mesh's, using
+	// the same vertices
+	auto lod_start = std::chrono::high_resolution_clock::now();
+	auto lod_count = std::min(settings.lodCount, MaxSubsetLods);
+	std::vector<std::vector<MeshSimplifier::Lod>> mesh_lods(scene->mNumMeshes);
+	std::for_each(std::execution::par, mesh_indices.begin(), mesh_indices.end(), [&](unsigned mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		if (!HasOnlyTriangles(scene->mMeshes[mesh_index]) || subset.totalIndex / 3 < MinLodTriangles)
+			return;
+
+		mesh_lods[mesh_index] = MeshSimplifier::BuildLods(meshData->vertices.data() + subset.baseVertex, subset.vertexCount,
+			meshData->indices.data() + subset.startIndex, subset.totalIndex, lod_count, settings.lodRatio, settings.lodErrorBudget * subset.sphere.Radius);
+	});
+
+	std::array<size_t, MaxSubsetLods> lod_triangles = {};
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		for (auto& lod : mesh_lods[mesh_index])
+		{
+			auto& subset_lod = subset.lods[subset.lodCount++];
+			subset_lod.startIndex = static_cast<unsigned>(meshData->indices.size());
+			subset_lod.totalIndex = static_cast<unsigned>(lod.indices.size());
+			subset_lod.error = lod.error;
+			meshData->indices.insert(meshData->indices.end(), lod.indices.begin(), lod.indices.end());
+		}
+
+		for (auto lod = 0u; lod < lod_count; ++lod)
+		{
+			lod_triangles[lod] += subset.lods[std::min(lod, subset.lodCount - 1)].totalIndex / 3;
+		}
+	}
+
+	auto lod_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - lod_start).count();
+	std::cout << "Built levels of detail in " << lod_time * 1000.0 << " ms with";
+	for (auto lod = 0u; lod < lod_count; ++lod)
+	{
+		std::cout << ' ' << lod_triangles[lod];
+	}
+
+	std::cout << " triangles\n";
+
+	// Meshlets of each large unskinned subset's full mesh, reordering its indices in place, one worker per mesh.
+	// Skinned subsets move away from their bind pose bounds and normals, so they are culled as a whole
+	auto meshlet_start = std::chrono::high_resolution_clock::now();
+	std::vector<std::vector<Meshlet>> mesh_meshlets(scene->mNumMeshes);
+	std::for_each(std::execution::par, mesh_indices.begin(), mesh_indices.end(), [&](unsigned mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		if (!HasOnlyTriangles(scene->mMeshes[mesh_index]) || subset.boneCount > 0 || subset.totalIndex / 3 < settings.meshletTriangles * MinMeshletsPerSubset)
+			return;
+
+		mesh_meshlets[mesh_index] = MeshletBuilder::Build(meshData->vertices.data() + subset.baseVertex, subset.vertexCount,
+			meshData->indices.data() + subset.startIndex, subset.totalIndex, settings.meshletVertices, settings.meshletTriangles);
+	});
+
+	auto meshlet_count = std::accumulate(mesh_meshlets.begin(), mesh_meshlets.end(), size_t(0), [](size_t count, const std::vector<Meshlet>& meshlets) { return count + meshlets.size(); });
+	auto meshlet_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - meshlet_start).count();
+	std::cout << "Built " << meshlet_count << " meshlets in " << meshlet_time * 1000.0 << " ms\n";
+
+	// Triangle and vertex order of each triangulated subset, one worker per mesh: triangles for the vertex cache, then
+	// clusters of them for overdraw, then vertices in the order the triangles use them. Meshlets are the clusters where
+	// there are any, keeping their triangles and culling bounds
+	if (settings.optimizeMeshes)
+	{
+		auto optimize_start = std::chrono::high_resolution_clock::now();
+		std::vector<MeshOptimizer::DrawCost> costs_before(scene->mNumMeshes);
+		std::vector<MeshOptimizer::DrawCost> costs_after(scene->mNumMeshes);
+		std::for_each(std::execution::par, mesh_indices.begin(), mesh_indices.end(), [&](unsigned mesh_index)
+		{
+			auto& subset = meshData->subsets[mesh_index];
+			if (!HasOnlyTriangles(scene->mMeshes[mesh_index]) || subset.totalIndex == 0)
+				return;
+
+			auto vertices = meshData->vertices.data() + subset.baseVertex;
+			auto indices = meshData->indices.data() + subset.startIndex;
+			auto& meshlets = mesh_meshlets[mesh_index];
+			if (settings.measureMeshes)
+			{
+				costs_before[mesh_index] = MeshOptimizer::Analyze(vertices, subset.vertexCount, indices, subset.totalIndex);
 			}
 
-			meshData->bones[i].parentId = parentId;
+			if (meshlets.empty())
+			{
+				MeshOptimizer::OptimizeVertexCache(indices, subset.totalIndex, subset.vertexCount);
+			}
+
+			for (auto& meshlet : meshlets)
+			{
+				MeshOptimizer::OptimizeVertexCache(indices + meshlet.startIndex, meshlet.totalIndex, subset.vertexCount);
+			}
+
+			MeshOptimizer::OptimizeOverdraw(vertices, subset.vertexCount, indices, subset.totalIndex, &meshlets);
+
+			for (auto lod = 1u; lod < subset.lodCount; ++lod)
+			{
+				MeshOptimizer::OptimizeVertexCache(meshData->indices.data() + subset.lods[lod].startIndex, subset.lods[lod].totalIndex, subset.vertexCount);
+			}
+
+			// Levels of detail use the full mesh's vertices, so follow its renumbering
+			auto remap = MeshOptimizer::OptimizeVertexFetch(vertices, subset.vertexCount, indices, subset.totalIndex);
+			for (auto lod = 1u; lod < subset.lodCount; ++lod)
+			{
+				auto lod_indices = meshData->indices.begin() + subset.lods[lod].startIndex;
+				std::transform(lod_indices, lod_indices + subset.lods[lod].totalIndex, lod_indices, [&](UINT index) { return remap[index]; });
+			}
+
+			if (settings.measureMeshes)
+			{
+				costs_after[mesh_index] = MeshOptimizer::Analyze(vertices, subset.vertexCount, indices, subset.totalIndex);
+			}
+		});
+
+		auto optimize_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - optimize_start).count();
+		std::cout << "Optimized subsets in " << optimize_time * 1000.0 << " ms\n";
+
+		if (settings.measureMeshes)
+		{
+			MeshOptimizer::DrawCost before, after;
+			for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+			{
+				before.Add(costs_before[mesh_index]);
+				after.Add(costs_after[mesh_index]);
+			}
+
+			std::cout << "Measured " << after.triangles << " triangles: ACMR " << before.GetAcmr() << " -> " << after.GetAcmr()
+				<< ", ATVR " << before.GetAtvr() << " -> " << after.GetAtvr() << ", overdraw " << before.GetOverdraw() << " -> " << after.GetOverdraw()
+				<< ", overfetch " << before.GetOverfetch() << " -> " << after.GetOverfetch() << '\n';
+		}
+	}
+
+	for (auto mesh_index = 0u; mesh_index < scene->mNumMeshes; ++mesh_index)
+	{
+		auto& subset = meshData->subsets[mesh_index];
+		subset.meshletStart = static_cast<unsigned>(meshData->meshlets.size());
+		subset.meshletCount = static_cast<unsigned>(mesh_meshlets[mesh_index].size());
+		for (auto& meshlet : mesh_meshlets[mesh_index])
+		{
+			meshlet.startIndex += subset.startIndex;
+			meshData->meshlets.push_back(meshlet);
 		}
 	}
 
@@ -187,31 +1282,50 @@ bool ModelLoader::Load(const std::string& path, MeshData* meshData)
 		auto animation = scene->mAnimations[animation_index];
 		auto ticksPerSecond = static_cast<float>(animation->mTicksPerSecond);
 
-		AnimationClip clip;
-		clip.BoneAnimations.resize(animation->mNumChannels);
+		// Channels are stored by bone id so the clip lines up with the skeleton
+		std::vector<ImportedChannel> channels(meshData->bones.size());
+		std::vector<bool> animated(meshData->bones.size(), false);
 		for (unsigned i = 0; i < animation->mNumChannels; ++i)
 		{
 			auto channel = animation->mChannels[i];
 			std::string name = channel->mNodeName.C_Str();
-			for (unsigned k = 0; k < channel->mNumPositionKeys; ++k)
+
+			auto bone_id = skeleton.FindBone(name);
+			if (bone_id < 0)
 			{
-				auto time = channel->mPositionKeys[k].mTime;
-				auto pos = channel->mPositionKeys[k].mValue;
-				auto rotation = channel->mRotationKeys[k].mValue;
-				auto scale = channel->mScalingKeys[k].mValue;
+				continue;
+			}
 
-				Keyframe frame;
-				frame.TimePos = static_cast<float>(time);
-				frame.Translation = DirectX::XMFLOAT3(pos.x, pos.y, pos.z);
-				frame.RotationQuat = DirectX::XMFLOAT4(rotation.x, rotation.y, rotation.z, rotation.w);
-				frame.Scale = DirectX::XMFLOAT3(scale.x, scale.y, scale.z);
+			channels[bone_id] = ReadChannel(channel, GetBindPoseChannel(scene, name));
+			animated[bone_id] = true;
+		}
 
-				clip.BoneAnimations[i].Keyframes.push_back(frame);
+		// Bones without a channel hold their bind pose
+		auto imported_bytes = size_t(0);
+		for (size_t bone_id = 0; bone_id < channels.size(); ++bone_id)
+		{
+			if (!animated[bone_id])
+			{
+				channels[bone_id] = GetBindPoseChannel(scene, meshData->bones[bone_id].name);
 			}
+
+			imported_bytes += GetMemoryUsage(channels[bone_id]);
 		}
 
+		// Drop the keys the tracks can do without, then quantize what is left
+		auto reach = GetBoneReach(*meshData, channels);
+		auto reduced = channels;
+		ReduceClip(meshData->bones, reach, settings, reduced);
+
+		AnimationClip clip;
+		CompressClip(reduced, &clip);
+
 		std::string animation_name = animation->mName.C_Str();
-		meshData->animations["Take1"] = clip;
+		std::cout << "Reduced animation '" << animation_name << "' from " << CountKeys(channels) << " to " << CountKeys(reduced)
+			<< " keys, max error " << MeasureError(meshData->bones, reach, channels, clip) << '\n';
+		std::cout << "Compressed animation '" << animation_name << "' from " << imported_bytes / 1024.0 << " KB to " << clip.GetMemoryUsage() / 1024.0 << " KB\n";
+
+		meshData->animations["Take1"] = std::move(clip);
 	}
 
 	return true;
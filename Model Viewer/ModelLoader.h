@@ -5,5 +5,44 @@
 
 namespace ModelLoader
 {
-	bool Load(const std::string& path, MeshData* meshData);
-}
\ No newline at end of file
+	// Options that change the imported data
+	struct ImportSettings
+	{
+		// Largest model space error, in asset units, that removing animation keys may introduce. 0 keeps every key
+		float keyTolerance = 0.001f;
+
+		// Tolerance of individual bones by name, overriding keyTolerance
+		std::unordered_map<std::string, float> boneKeyTolerances;
+
+		// Levels of detail built for each subset, including the full mesh, each with about lodRatio of the triangles
+		// of the one before. Up to MaxSubsetLods
+		unsigned lodCount = 4;
+		float lodRatio = 0.5f;
+
+		// Largest error a level of detail may add, as a share of its subset's bounding radius. Simplification stops there
+		float lodErrorBudget = 0.05f;
+
+		// Geometry processing in place of Assimp's. Triangulated meshes get normals and tangents when the file has
+		// none, then identical vertices are merged
+		bool weldVertices = true;
+		bool generateNormals = true;
+		bool generateTangents = true;
+
+		// Largest angle, in degrees, between triangles whose normals are smoothed together where they meet. 0 gives
+		// flat normals as Assimp generated them, splitting shared vertices into a copy per triangle corner first
+		float normalSmoothingAngle = 0.0f;
+
+		// Largest meshlets the full meshes of unskinned subsets are split into
+		unsigned meshletVertices = 64;
+		unsigned meshletTriangles = 124;
+
+		// Reorders the triangles and vertices of triangulated subsets for the vertex cache, overdraw and vertex fetch
+		bool optimizeMeshes = true;
+
+		// Logs the vertex cache, vertex fetch and overdraw cost of the subsets before and after optimizing them. Only
+		// changes what is logged, so the mesh cache ignores it
+		bool measureMeshes = false;
+	};
+
+	bool Load(const std::string& path, MeshData* meshData, const ImportSettings& settings = ImportSettings());
+}
@@ -0,0 +1,373 @@
+#include "Pch.h"
+#include "Occlusion.h"
+#include <cfloat>
+#include <random>
+#include <limits>
+
+namespace
+{
+	// Depth a box's nearest corner is brought forward by before testing. An occluder's own bounds touch its surface, so
+	// without it rounding alone could hide the occluder behind itself and make it flicker
+	constexpr float DepthBias = 1.0e-5f;
+
+	// Screen position of a clip space position in front of the near plane, with depth from 0 to 1
+	DirectX::XMFLOAT3 ToScreen(const DirectX::XMFLOAT4& clip, int width, int height)
+	{
+		auto inverse_w = 1.0f / clip.w;
+		return { (clip.x * inverse_w * 0.5f + 0.5f) * width, (0.5f - clip.y * inverse_w * 0.5f) * height, clip.z * inverse_w };
+	}
+
+	// Keeps the depth of whichever is nearer, the buffer or the triangle, at the pixel centres the triangle covers.
+	// Rows are walked Lanes::Width pixels at a time from a multiple of the width, which the buffer width is a multiple of
+	template <typename Lanes>
+	void RasterizeTriangle(const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b, const DirectX::XMFLOAT3& c, float* depth, int width, int height)
+	{
+		// Edge functions are made positive inside whichever way the triangle winds
+		auto area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+		if (std::abs(area) < 1.0e-6f)
+			return;
+
+		const DirectX::XMFLOAT3* v[3] = { &a, &b, &c };
+		if (area < 0.0f)
+		{
+			std::swap(v[1], v[2]);
+			area = -area;
+		}
+
+		auto min_x = std::max(0, static_cast<int>(std::floor(std::min({ a.x, b.x, c.x }))));
+		auto max_x = std::min(width - 1, static_cast<int>(std::floor(std::max({ a.x, b.x, c.x }))));
+		auto min_y = std::max(0, static_cast<int>(std::floor(std::min({ a.y, b.y, c.y }))));
+		auto max_y = std::min(height - 1, static_cast<int>(std::floor(std::max({ a.y, b.y, c.y }))));
+		if (min_x > max_x || min_y > max_y)
+			return;
+
+		// Edge i runs from v[i] to v[i + 1] as A x + B y + C
+		typename Lanes::Float edge_a[3];
+		float edge_b[3], edge_c[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			auto& p = *v[i];
+			auto& q = *v[(i + 1) % 3];
+			edge_a[i] = Lanes::Set(p.y - q.y);
+			edge_b[i] = q.x - p.x;
+			edge_c[i] = p.x * q.y - p.y * q.x;
+		}
+
+		// Depth after the perspective divide is affine in screen space
+		auto& p0 = *v[0];
+		auto& p1 = *v[1];
+		auto& p2 = *v[2];
+		auto depth_dx = ((p1.z - p0.z) * (p2.y - p0.y) - (p2.z - p0.z) * (p1.y - p0.y)) / area;
+		auto depth_dy = ((p2.z - p0.z) * (p1.x - p0.x) - (p1.z - p0.z) * (p2.x - p0.x)) / area;
+
+		alignas(64) static const float lane_offsets[16] = { 0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f, 8.5f, 9.5f, 10.5f, 11.5f, 12.5f, 13.5f, 14.5f, 15.5f };
+		auto lane_x = Lanes::Load(lane_offsets);
+		auto zero = Lanes::Set(0.0f);
+		auto slope = Lanes::Set(depth_dx);
+		auto start_x = min_x - min_x % static_cast<int>(Lanes::Width);
+		for (auto y = min_y; y <= max_y; ++y)
+		{
+			auto centre_y = y + 0.5f;
+			typename Lanes::Float row_edge[3];
+			for (int i = 0; i < 3; ++i)
+			{
+				row_edge[i] = Lanes::Set(edge_b[i] * centre_y + edge_c[i]);
+			}
+
+			auto row_depth = Lanes::Set(p0.z + depth_dy * (centre_y - p0.y) - depth_dx * p0.x);
+			auto line = depth + static_cast<size_t>(y) * width;
+			for (auto x = start_x; x <= max_x; x += static_cast<int>(Lanes::Width))
+			{
+				auto centre_x = Lanes::Add(Lanes::Set(static_cast<float>(x)), lane_x);
+				auto inside = Lanes::And(Lanes::GreaterEqual(Lanes::MulAdd(edge_a[0], centre_x, row_edge[0]), zero),
+					Lanes::And(Lanes::GreaterEqual(Lanes::MulAdd(edge_a[1], centre_x, row_edge[1]), zero),
+						Lanes::GreaterEqual(Lanes::MulAdd(edge_a[2], centre_x, row_edge[2]), zero)));
+
+				auto current = Lanes::Load(line + x);
+				auto nearest = Lanes::Min(current, Lanes::MulAdd(slope, centre_x, row_depth));
+				Lanes::Store(line + x, Lanes::Select(inside, current, nearest));
+			}
+		}
+	}
+}
+
+OcclusionBuffer::OcclusionBuffer(int width, int height)
+{
+	constexpr int row_alignment = 16;
+	m_Width = (std::max(width, 1) + row_alignment - 1) / row_alignment * row_alignment;
+	m_Height = (std::max(height, 1) + TileSize - 1) / TileSize * TileSize;
+	m_TilesX = m_Width / TileSize;
+	m_TilesY = m_Height / TileSize;
+
+	m_Depth.assign(static_cast<size_t>(m_Width) * m_Height, 1.0f);
+	m_TileDepth.assign(static_cast<size_t>(m_TilesX) * m_TilesY, 1.0f);
+	DirectX::XMStoreFloat4x4(&m_ViewProjection, DirectX::XMMatrixIdentity());
+}
+
+void OcclusionBuffer::Begin(DirectX::FXMMATRIX viewProjection, SimdPath path)
+{
+	DirectX::XMStoreFloat4x4(&m_ViewProjection, viewProjection);
+	m_Path = path;
+	m_TriangleCount = 0;
+	std::fill(m_Depth.begin(), m_Depth.end(), 1.0f);
+}
+
+void OcclusionBuffer::Rasterize(const DirectX::XMFLOAT3* positions, size_t vertexCount, const UINT* indices, size_t indexCount, DirectX::FXMMATRIX world)
+{
+	auto transform = DirectX::XMMatrixMultiply(world, DirectX::XMLoadFloat4x4(&m_ViewProjection));
+	m_ClipVertices.resize(vertexCount);
+	for (size_t i = 0; i < vertexCount; ++i)
+	{
+		DirectX::XMStoreFloat4(&m_ClipVertices[i], DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&positions[i]), transform));
+	}
+
+	Simd::Dispatch(m_Path, [&](auto lanes)
+	{
+		using Lanes = decltype(lanes);
+		for (size_t i = 0; i + 2 < indexCount; i += 3)
+		{
+			const DirectX::XMFLOAT4* triangle[3] = { &m_ClipVertices[indices[i]], &m_ClipVertices[indices[i + 1]], &m_ClipVertices[indices[i + 2]] };
+
+			// Clip against the near plane, where depth reaches 0. Cutting off a corner leaves a quad
+			DirectX::XMFLOAT4 polygon[4];
+			size_t count = 0;
+			for (int j = 0; j < 3; ++j)
+			{
+				auto& p = *triangle[j];
+				auto& q = *triangle[(j + 1) % 3];
+				if (p.z >= 0.0f)
+				{
+					polygon[count++] = p;
+				}
+
+				if ((p.z >= 0.0f) != (q.z >= 0.0f))
+				{
+					auto t = p.z / (p.z - q.z);
+					polygon[count++] = { p.x + (q.x - p.x) * t, p.y + (q.y - p.y) * t, 0.0f, p.w + (q.w - p.w) * t };
+				}
+			}
+
+			if (count < 3)
+				continue;
+
+			DirectX::XMFLOAT3 screen[4];
+			for (size_t j = 0; j < count; ++j)
+			{
+				screen[j] = ToScreen(polygon[j], m_Width, m_Height);
+			}
+
+			for (size_t j = 2; j < count; ++j)
+			{
+				RasterizeTriangle<Lanes>(screen[0], screen[j - 1], screen[j], m_Depth.data(), m_Width, m_Height);
+			}
+
+			++m_TriangleCount;
+		}
+	});
+}
+
+void OcclusionBuffer::End()
+{
+	for (auto tile_y = 0; tile_y < m_TilesY; ++tile_y)
+	{
+		for (auto tile_x = 0; tile_x < m_TilesX; ++tile_x)
+		{
+			auto farthest = 0.0f;
+			for (auto y = 0; y < TileSize; ++y)
+			{
+				auto line = &m_Depth[static_cast<size_t>(tile_y * TileSize + y) * m_Width + tile_x * TileSize];
+				farthest = std::max(farthest, *std::max_element(line, line + TileSize));
+			}
+
+			m_TileDepth[static_cast<size_t>(tile_y) * m_TilesX + tile_x] = farthest;
+		}
+	}
+}
+
+bool OcclusionBuffer::IsOccluded(const DirectX::BoundingBox& box) const
+{
+	// Screen rectangle and nearest depth of the corners. Boxes reaching past the near plane are never hidden
+	DirectX::XMFLOAT3 corners[DirectX::BoundingBox::CORNER_COUNT];
+	box.GetCorners(corners);
+
+	auto view_projection = DirectX::XMLoadFloat4x4(&m_ViewProjection);
+	auto min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX, nearest = FLT_MAX;
+	for (auto& corner : corners)
+	{
+		DirectX::XMFLOAT4 clip;
+		DirectX::XMStoreFloat4(&clip, DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&corner), view_projection));
+		if (clip.z < 0.0f)
+			return false;
+
+		auto screen = ToScreen(clip, m_Width, m_Height);
+		min_x = std::min(min_x, screen.x);
+		min_y = std::min(min_y, screen.y);
+		max_x = std::max(max_x, screen.x);
+		max_y = std::max(max_y, screen.y);
+		nearest = std::min(nearest, screen.z);
+	}
+	nearest -= DepthBias;
+
+	// Every pixel the rectangle touches, off screen parts being left to frustum culling
+	auto x0 = std::max(0, static_cast<int>(std::floor(min_x)));
+	auto x1 = std::min(m_Width - 1, static_cast<int>(std::floor(max_x)));
+	auto y0 = std::max(0, static_cast<int>(std::floor(min_y)));
+	auto y1 = std::min(m_Height - 1, static_cast<int>(std::floor(max_y)));
+	if (x0 > x1 || y0 > y1)
+		return false;
+
+	// Tiles entirely in front of the box hide their part of it. Others are checked pixel by pixel
+	for (auto tile_y = y0 / TileSize; tile_y <= y1 / TileSize; ++tile_y)
+	{
+		for (auto tile_x = x0 / TileSize; tile_x <= x1 / TileSize; ++tile_x)
+		{
+			if (m_TileDepth[static_cast<size_t>(tile_y) * m_TilesX + tile_x] < nearest)
+				continue;
+
+			for (auto y = std::max(y0, tile_y * TileSize); y <= std::min(y1, tile_y * TileSize + TileSize - 1); ++y)
+			{
+				for (auto x = std::max(x0, tile_x * TileSize); x <= std::min(x1, tile_x * TileSize + TileSize - 1); ++x)
+				{
+					if (m_Depth[static_cast<size_t>(y) * m_Width + x] >= nearest)
+						return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+size_t OcclusionBuffer::Cull(const CullingBounds& bounds, uint8_t* visible) const
+{
+	size_t hidden = 0;
+	for (size_t i = 0; i < bounds.Size(); ++i)
+	{
+		if (!visible[i])
+			continue;
+
+		DirectX::BoundingBox box(DirectX::XMFLOAT3(bounds.centreX[i], bounds.centreY[i], bounds.centreZ[i]),
+			DirectX::XMFLOAT3(bounds.extentX[i], bounds.extentY[i], bounds.extentZ[i]));
+
+		if (IsOccluded(box))
+		{
+			visible[i] = 0;
+			++hidden;
+		}
+	}
+
+	return hidden;
+}
+
+void OcclusionBuffer::Benchmark()
+{
+	// A grid of buildings with props scattered along the streets and through the blocks
+	constexpr int blocks = 16;
+	constexpr float block_size = 10.0f;
+	constexpr float street_width = 4.0f;
+	constexpr float pitch = block_size + street_width;
+	constexpr float half_span = blocks * pitch * 0.5f;
+
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> building_height(8.0f, 40.0f);
+	std::uniform_real_distribution<float> position(-half_span, half_span);
+	std::uniform_real_distribution<float> prop_size(0.5f, 1.0f);
+
+	// Buildings are scaled from a unit cube
+	const DirectX::XMFLOAT3 cube_positions[8] =
+	{
+		{ -1.0f, -1.0f, -1.0f }, { 1.0f, -1.0f, -1.0f }, { 1.0f, 1.0f, -1.0f }, { -1.0f, 1.0f, -1.0f },
+		{ -1.0f, -1.0f, 1.0f }, { 1.0f, -1.0f, 1.0f }, { 1.0f, 1.0f, 1.0f }, { -1.0f, 1.0f, 1.0f }
+	};
+
+	const UINT cube_indices[36] =
+	{
+		0, 1, 2, 0, 2, 3, 4, 6, 5, 4, 7, 6, 0, 4, 5, 0, 5, 1,
+		3, 2, 6, 3, 6, 7, 1, 5, 6, 1, 6, 2, 0, 3, 7, 0, 7, 4
+	};
+
+	std::vector<DirectX::XMFLOAT4X4> buildings(blocks * blocks);
+	for (int i = 0; i < blocks * blocks; ++i)
+	{
+		auto height = building_height(random);
+		auto x = (i % blocks - blocks / 2) * pitch;
+		auto z = (i / blocks - blocks / 2) * pitch;
+		DirectX::XMStoreFloat4x4(&buildings[i], DirectX::XMMatrixMultiply(DirectX::XMMatrixScaling(block_size * 0.5f, height * 0.5f, block_size * 0.5f),
+			DirectX::XMMatrixTranslation(x, height * 0.5f, z)));
+	}
+
+	constexpr size_t prop_count = 20000;
+	CullingBounds props;
+	props.Resize(prop_count);
+	for (size_t i = 0; i < prop_count; ++i)
+	{
+		auto size = prop_size(random);
+		DirectX::BoundingBox box(DirectX::XMFLOAT3(position(random), size, position(random)), DirectX::XMFLOAT3(size, size, size));
+		props.Set(i, box, size * std::sqrt(3.0f));
+	}
+
+	// Seen from street level, looking along a street
+	auto street_x = -street_width * 0.5f - block_size * 0.5f;
+	auto view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(street_x, 1.7f, -half_span, 1.0f), DirectX::XMVectorSet(street_x + 20.0f, 1.7f, 0.0f, 1.0f),
+		DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	auto projection = DirectX::XMMatrixPerspectiveFovLH(DirectX::XMConvertToRadians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f);
+	auto view_projection = DirectX::XMMatrixMultiply(view, projection);
+
+	// Only props in view are tested for occlusion
+	std::vector<uint8_t> in_view(prop_count);
+	auto in_view_count = Culling::Cull(Culling::ExtractFrustumPlanes(view_projection), props, in_view.data());
+
+	auto rasterize = [&](OcclusionBuffer& buffer, SimdPath path)
+	{
+		buffer.Begin(view_projection, path);
+		for (auto& building : buildings)
+		{
+			buffer.Rasterize(cube_positions, 8, cube_indices, 36, DirectX::XMLoadFloat4x4(&building));
+		}
+
+		buffer.End();
+	};
+
+	OcclusionBuffer reference;
+	rasterize(reference, SimdPath::Scalar);
+
+	for (auto path = SimdPath::Scalar; path <= Simd::GetBestPath(); path = static_cast<SimdPath>(static_cast<int>(path) + 1))
+	{
+		// Best of several runs, to keep the first touch of the data out of the result
+		OcclusionBuffer buffer;
+		auto best_raster_time = std::numeric_limits<double>::max();
+		auto best_cull_time = std::numeric_limits<double>::max();
+		size_t hidden = 0;
+		for (int run = 0; run < 10; ++run)
+		{
+			auto start_time = std::chrono::high_resolution_clock::now();
+			rasterize(buffer, path);
+			auto raster_end_time = std::chrono::high_resolution_clock::now();
+
+			auto visible = in_view;
+			hidden = buffer.Cull(props, visible.data());
+			auto cull_end_time = std::chrono::high_resolution_clock::now();
+
+			best_raster_time = std::min(best_raster_time, std::chrono::duration<double>(raster_end_time - start_time).count());
+			best_cull_time = std::min(best_cull_time, std::chrono::duration<double>(cull_end_time - raster_end_time).count());
+		}
+
+		std::cout << "Occlusion " << Simd::GetPathName(path) << ": " << buffer.GetTriangleCount() << " triangles rasterized in " << best_raster_time * 1000.0
+			<< " ms, " << hidden << " of " << in_view_count << " props in view hidden (" << (in_view_count > 0 ? 100.0 * hidden / in_view_count : 0.0)
+			<< "%) in " << best_cull_time * 1000.0 << " ms\n";
+
+		// Fused multiply-add rounding can flip pixels lying exactly on an edge, so only more than a few differing counts
+		auto& depth = buffer.GetDepth();
+		auto& expected = reference.GetDepth();
+		size_t differing = 0;
+		for (size_t i = 0; i < depth.size(); ++i)
+		{
+			differing += std::abs(depth[i] - expected[i]) > 1.0e-4f ? 1 : 0;
+		}
+
+		if (differing > depth.size() / 1000)
+		{
+			std::cerr << "Occlusion " << Simd::GetPathName(path) << " depth differs from the scalar path in " << differing << " pixels\n";
+		}
+	}
+}
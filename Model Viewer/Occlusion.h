@@ -0,0 +1,61 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <DirectXCollision.h>
+#include "Culling.h"
+
+///<summary>
+/// Low resolution software depth buffer for occlusion culling. Occluder
+/// triangles are rasterized a row of SIMD lanes at a time, then the buffer
+/// is reduced to the farthest depth of each tile. Bounds are hidden when
+/// their nearest point is behind every tile, or failing that every pixel,
+/// they cover. Runs entirely on the CPU.
+///</summary>
+class OcclusionBuffer
+{
+public:
+	// Width is rounded up to a whole number of the widest SIMD rows and height to whole tiles
+	explicit OcclusionBuffer(int width = 320, int height = 192);
+
+	// Clears the depth and sets the view occluders and bounds are seen from
+	void Begin(DirectX::FXMMATRIX viewProjection, SimdPath path = Simd::GetBestPath());
+
+	// Rasterizes occluder triangles. Positions are in model space and placed by world
+	void Rasterize(const DirectX::XMFLOAT3* positions, size_t vertexCount, const UINT* indices, size_t indexCount, DirectX::FXMMATRIX world);
+
+	// Reduces the depth to the farthest of each tile. Called after the last occluder
+	void End();
+
+	// Whether world space bounds are hidden behind the occluders
+	bool IsOccluded(const DirectX::BoundingBox& box) const;
+
+	// Clears visible[i] for each visible object found hidden. Returns the number hidden
+	size_t Cull(const CullingBounds& bounds, uint8_t* visible) const;
+
+	// Triangles rasterized since Begin
+	constexpr size_t GetTriangleCount() { return m_TriangleCount; }
+
+	// Depth of each pixel, row by row
+	const std::vector<float>& GetDepth() const { return m_Depth; }
+
+	// Times rasterizing and culling a synthetic city on every supported path and prints the results
+	static void Benchmark();
+
+private:
+	static constexpr int TileSize = 8;
+
+	int m_Width = 0;
+	int m_Height = 0;
+	int m_TilesX = 0;
+	int m_TilesY = 0;
+
+	std::vector<float> m_Depth;
+	std::vector<float> m_TileDepth;
+
+	DirectX::XMFLOAT4X4 m_ViewProjection;
+	SimdPath m_Path = SimdPath::Scalar;
+	size_t m_TriangleCount = 0;
+
+	// Occluder vertices in clip space, kept for clipping triangles against the near plane
+	std::vector<DirectX::XMFLOAT4> m_ClipVertices;
+};
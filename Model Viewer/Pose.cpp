@@ -0,0 +1,246 @@
+#include "Pch.h"
+#include "Pose.h"
+
+namespace
+{
+	constexpr size_t LaneCount = 4;
+
+	// Lane-wise a + (b - a) * t
+	DirectX::XMVECTOR Lerp(DirectX::FXMVECTOR a, DirectX::FXMVECTOR b, DirectX::FXMVECTOR t)
+	{
+		return DirectX::XMVectorMultiplyAdd(DirectX::XMVectorSubtract(b, a), t, a);
+	}
+
+	// Lane-wise four component dot product of quaternions stored as components
+	DirectX::XMVECTOR Dot(const DirectX::XMMATRIX& a, const DirectX::XMMATRIX& b)
+	{
+		auto dot = DirectX::XMVectorMultiply(a.r[0], b.r[0]);
+		dot = DirectX::XMVectorMultiplyAdd(a.r[1], b.r[1], dot);
+		dot = DirectX::XMVectorMultiplyAdd(a.r[2], b.r[2], dot);
+		return DirectX::XMVectorMultiplyAdd(a.r[3], b.r[3], dot);
+	}
+
+	// Keys either side of t for one lane
+	template <typename T>
+	size_t FindKeys(const KeyframeTrack<T>& track, float t, size_t& cursor, float& lerpPercent, size_t* next)
+	{
+		auto i = track.Keys.Find(t, cursor, lerpPercent);
+		*next = std::min(i + 1, track.Values.size() - 1);
+		return i;
+	}
+}
+
+void StoreBoneTransform(DirectX::FXMMATRIX transform, SkinningMode mode, DirectX::XMFLOAT4* rows)
+{
+	if (mode == SkinningMode::Matrix)
+	{
+		DirectX::XMStoreFloat3x4(reinterpret_cast<DirectX::XMFLOAT3X4*>(rows), transform);
+		return;
+	}
+
+	// Dual quaternions only hold rotation and translation, so the scale is dropped
+	DirectX::XMVECTOR scale, rotation, translation;
+	DirectX::XMMatrixDecompose(&scale, &rotation, &translation, transform);
+
+	// Dual part is half the translation times the rotation. XMQuaternionMultiply(a, b) returns b * a
+	auto dual = DirectX::XMVectorScale(DirectX::XMQuaternionMultiply(rotation, DirectX::XMVectorSetW(translation, 0.0f)), 0.5f);
+
+	DirectX::XMStoreFloat4(&rows[0], rotation);
+	DirectX::XMStoreFloat4(&rows[1], dual);
+}
+
+DirectX::XMMATRIX LoadBoneTransform(const DirectX::XMFLOAT4* rows, SkinningMode mode)
+{
+	if (mode == SkinningMode::Matrix)
+	{
+		return DirectX::XMLoadFloat3x4(reinterpret_cast<const DirectX::XMFLOAT3X4*>(rows));
+	}
+
+	// Translation is 2 * dual * conjugate(real)
+	auto rotation = DirectX::XMLoadFloat4(&rows[0]);
+	auto dual = DirectX::XMLoadFloat4(&rows[1]);
+	auto translation = DirectX::XMVectorScale(DirectX::XMQuaternionMultiply(DirectX::XMQuaternionConjugate(rotation), dual), 2.0f);
+
+	auto transform = DirectX::XMMatrixRotationQuaternion(rotation);
+	transform.r[3] = DirectX::XMVectorSetW(translation, 1.0f);
+	return transform;
+}
+
+void PoseEvaluator::Evaluate(const AnimationClip& clip, const std::vector<BoneInfo>& bones, float t, RotationBlend blend,
+	std::vector<KeyframeCursor>& cursors, SkinningMode mode, DirectX::XMFLOAT4* palette, size_t paletteSize)
+{
+	auto numBones = std::min(bones.size(), clip.BoneAnimations.size());
+	m_Transforms.resize(numBones);
+
+	for (size_t first = 0; first < numBones; first += LaneCount)
+	{
+		SampleGroup(clip, first, std::min(LaneCount, numBones - first), t, blend, cursors);
+	}
+
+	// Transform to root and apply the bone offsets in one pass. Bones are stored parent-before-child
+	auto rows = GetPaletteRowsPerBone(mode);
+	for (size_t i = 0; i < numBones; ++i)
+	{
+		auto parentId = bones[i].parentId;
+		if (parentId >= 0)
+		{
+			m_Transforms[i] = DirectX::XMMatrixMultiply(m_Transforms[i], m_Transforms[parentId]);
+		}
+
+		if (i < paletteSize)
+		{
+			StoreBoneTransform(DirectX::XMMatrixMultiply(XMLoadFloat4x3(&bones[i].offset), m_Transforms[i]), mode, &palette[i * rows]);
+		}
+	}
+}
+
+void PoseEvaluator::SampleGroup(const AnimationClip& clip, size_t first, size_t count, float t, RotationBlend blend, std::vector<KeyframeCursor>& cursors)
+{
+	// Keys either side of t with one bone per row. Unused rows hold the identity
+	auto p0 = DirectX::XMMatrixSet(0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f);
+	auto p1 = p0;
+	auto q0 = DirectX::XMMatrixSet(0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+	auto q1 = q0;
+	auto s0 = DirectX::XMMatrixSet(1.0f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f);
+	auto s1 = s0;
+
+	alignas(16) float translation_t[LaneCount] = {};
+	alignas(16) float rotation_t[LaneCount] = {};
+	alignas(16) float scale_t[LaneCount] = {};
+
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		auto& animation = clip.BoneAnimations[first + lane];
+		auto& cursor = cursors[first + lane];
+		size_t next = 0;
+
+		auto i = FindKeys(animation.Translation, t, cursor.Translation, translation_t[lane], &next);
+		p0.r[lane] = clip.Translations.Unpack(animation.Translation.Values[i]);
+		p1.r[lane] = clip.Translations.Unpack(animation.Translation.Values[next]);
+
+		i = FindKeys(animation.Rotation, t, cursor.Rotation, rotation_t[lane], &next);
+		q0.r[lane] = animation.Rotation.Values[i].Unpack();
+		q1.r[lane] = animation.Rotation.Values[next].Unpack();
+
+		i = FindKeys(animation.Scale, t, cursor.Scale, scale_t[lane], &next);
+		s0.r[lane] = XMLoadFloat3(&animation.Scale.Values[i]);
+		s1.r[lane] = XMLoadFloat3(&animation.Scale.Values[next]);
+	}
+
+	// Rows become lanes, so r[0] holds the x component of every bone
+	p0 = DirectX::XMMatrixTranspose(p0);
+	p1 = DirectX::XMMatrixTranspose(p1);
+	q0 = DirectX::XMMatrixTranspose(q0);
+	q1 = DirectX::XMMatrixTranspose(q1);
+	s0 = DirectX::XMMatrixTranspose(s0);
+	s1 = DirectX::XMMatrixTranspose(s1);
+
+	// Translation and scale
+	auto tP = DirectX::XMLoadFloat4A(reinterpret_cast<const DirectX::XMFLOAT4A*>(translation_t));
+	auto px = Lerp(p0.r[0], p1.r[0], tP);
+	auto py = Lerp(p0.r[1], p1.r[1], tP);
+	auto pz = Lerp(p0.r[2], p1.r[2], tP);
+
+	auto tS = DirectX::XMLoadFloat4A(reinterpret_cast<const DirectX::XMFLOAT4A*>(scale_t));
+	auto sx = Lerp(s0.r[0], s1.r[0], tS);
+	auto sy = Lerp(s0.r[1], s1.r[1], tS);
+	auto sz = Lerp(s0.r[2], s1.r[2], tS);
+
+	// Rotation. Flip the second key where needed so every lane takes the shortest path
+	auto one = DirectX::XMVectorSplatOne();
+	auto tQ = DirectX::XMLoadFloat4A(reinterpret_cast<const DirectX::XMFLOAT4A*>(rotation_t));
+	auto dot = Dot(q0, q1);
+	auto sign = DirectX::XMVectorSelect(one, DirectX::XMVectorNegate(one), DirectX::XMVectorLess(dot, DirectX::XMVectorZero()));
+	dot = DirectX::XMVectorMultiply(dot, sign);
+	for (size_t i = 0; i < 4; ++i)
+	{
+		q1.r[i] = DirectX::XMVectorMultiply(q1.r[i], sign);
+	}
+
+	DirectX::XMVECTOR w0, w1;
+	if (blend == RotationBlend::Nlerp)
+	{
+		// Polynomial fit of the slerp angle error from "Approximating slerp" (Kapoulkine)
+		auto A = DirectX::XMVectorMultiplyAdd(dot, DirectX::XMVectorReplicate(-1.43519f), DirectX::XMVectorReplicate(3.55645f));
+		A = DirectX::XMVectorMultiplyAdd(dot, A, DirectX::XMVectorReplicate(-3.2452f));
+		A = DirectX::XMVectorMultiplyAdd(dot, A, DirectX::XMVectorReplicate(1.0904f));
+
+		auto B = DirectX::XMVectorMultiplyAdd(dot, DirectX::XMVectorReplicate(0.215638f), DirectX::XMVectorReplicate(-1.06021f));
+		B = DirectX::XMVectorMultiplyAdd(dot, B, DirectX::XMVectorReplicate(0.848013f));
+
+		auto half = DirectX::XMVectorReplicate(0.5f);
+		auto centred = DirectX::XMVectorSubtract(tQ, half);
+		auto k = DirectX::XMVectorMultiplyAdd(DirectX::XMVectorMultiply(centred, centred), A, B);
+
+		// t + t * (t - 0.5) * (t - 1) * k
+		auto correction = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(tQ, centred), DirectX::XMVectorSubtract(tQ, one));
+		w1 = DirectX::XMVectorMultiplyAdd(correction, k, tQ);
+		w0 = DirectX::XMVectorSubtract(one, w1);
+	}
+	else
+	{
+		auto theta = DirectX::XMVectorACos(dot);
+		auto inverseSinTheta = DirectX::XMVectorReciprocal(DirectX::XMVectorSin(theta));
+		w0 = DirectX::XMVectorMultiply(DirectX::XMVectorSin(DirectX::XMVectorMultiply(DirectX::XMVectorSubtract(one, tQ), theta)), inverseSinTheta);
+		w1 = DirectX::XMVectorMultiply(DirectX::XMVectorSin(DirectX::XMVectorMultiply(tQ, theta)), inverseSinTheta);
+
+		// Nearly equal rotations fall back to lerp
+		auto nearlyEqual = DirectX::XMVectorGreater(dot, DirectX::XMVectorReplicate(0.9999f));
+		w0 = DirectX::XMVectorSelect(w0, DirectX::XMVectorSubtract(one, tQ), nearlyEqual);
+		w1 = DirectX::XMVectorSelect(w1, tQ, nearlyEqual);
+	}
+
+	DirectX::XMMATRIX q;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		q.r[i] = DirectX::XMVectorMultiplyAdd(q1.r[i], w1, DirectX::XMVectorMultiply(q0.r[i], w0));
+	}
+
+	auto inverseLength = DirectX::XMVectorReciprocalSqrt(Dot(q, q));
+	auto x = DirectX::XMVectorMultiply(q.r[0], inverseLength);
+	auto y = DirectX::XMVectorMultiply(q.r[1], inverseLength);
+	auto z = DirectX::XMVectorMultiply(q.r[2], inverseLength);
+	auto w = DirectX::XMVectorMultiply(q.r[3], inverseLength);
+
+	// Scale * Rotation * Translation, matching XMMatrixAffineTransformation
+	auto two = DirectX::XMVectorReplicate(2.0f);
+	auto xx = DirectX::XMVectorMultiply(x, x), yy = DirectX::XMVectorMultiply(y, y), zz = DirectX::XMVectorMultiply(z, z);
+	auto xy = DirectX::XMVectorMultiply(x, y), xz = DirectX::XMVectorMultiply(x, z), yz = DirectX::XMVectorMultiply(y, z);
+	auto wx = DirectX::XMVectorMultiply(w, x), wy = DirectX::XMVectorMultiply(w, y), wz = DirectX::XMVectorMultiply(w, z);
+
+	DirectX::XMMATRIX row0, row1, row2, row3;
+	row0.r[0] = DirectX::XMVectorMultiply(DirectX::XMVectorNegativeMultiplySubtract(two, DirectX::XMVectorAdd(yy, zz), one), sx);
+	row0.r[1] = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(two, DirectX::XMVectorAdd(xy, wz)), sx);
+	row0.r[2] = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(two, DirectX::XMVectorSubtract(xz, wy)), sx);
+	row0.r[3] = DirectX::XMVectorZero();
+
+	row1.r[0] = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(two, DirectX::XMVectorSubtract(xy, wz)), sy);
+	row1.r[1] = DirectX::XMVectorMultiply(DirectX::XMVectorNegativeMultiplySubtract(two, DirectX::XMVectorAdd(xx, zz), one), sy);
+	row1.r[2] = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(two, DirectX::XMVectorAdd(yz, wx)), sy);
+	row1.r[3] = DirectX::XMVectorZero();
+
+	row2.r[0] = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(two, DirectX::XMVectorAdd(xz, wy)), sz);
+	row2.r[1] = DirectX::XMVectorMultiply(DirectX::XMVectorMultiply(two, DirectX::XMVectorSubtract(yz, wx)), sz);
+	row2.r[2] = DirectX::XMVectorMultiply(DirectX::XMVectorNegativeMultiplySubtract(two, DirectX::XMVectorAdd(xx, yy), one), sz);
+	row2.r[3] = DirectX::XMVectorZero();
+
+	row3.r[0] = px;
+	row3.r[1] = py;
+	row3.r[2] = pz;
+	row3.r[3] = one;
+
+	// Lanes back to rows, one matrix per bone
+	row0 = DirectX::XMMatrixTranspose(row0);
+	row1 = DirectX::XMMatrixTranspose(row1);
+	row2 = DirectX::XMMatrixTranspose(row2);
+	row3 = DirectX::XMMatrixTranspose(row3);
+
+	for (size_t lane = 0; lane < count; ++lane)
+	{
+		auto& transform = m_Transforms[first + lane];
+		transform.r[0] = row0.r[lane];
+		transform.r[1] = row1.r[lane];
+		transform.r[2] = row2.r[lane];
+		transform.r[3] = row3.r[lane];
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Model.h"
+
+// How rotations are blended between keys
+enum class RotationBlend
+{
+	Slerp,
+
+	// Normalised lerp with a correction to t that keeps the angular velocity close to slerp
+	Nlerp
+};
+
+// float4 rows each bone takes up in the skinning palette
+constexpr size_t GetPaletteRowsPerBone(SkinningMode mode)
+{
+	return mode == SkinningMode::DualQuaternion ? 2 : 3;
+}
+
+// Writes one bone of the skinning palette in the layout the skinning mode expects
+void StoreBoneTransform(DirectX::FXMMATRIX transform, SkinningMode mode, DirectX::XMFLOAT4* rows);
+
+// Reads one bone of the skinning palette back as a matrix
+DirectX::XMMATRIX LoadBoneTransform(const DirectX::XMFLOAT4* rows, SkinningMode mode);
+
+///<summary>
+/// Evaluates the skinning palette of a whole skeleton at once. Bones are
+/// sampled in groups of four with one bone per SIMD lane, then the
+/// transforms to root and the bone offsets are applied in a single pass.
+///</summary>
+class PoseEvaluator
+{
+public:
+	// Samples the clip at t and writes the palette of the first paletteSize bones
+	void Evaluate(const AnimationClip& clip, const std::vector<BoneInfo>& bones, float t, RotationBlend blend,
+		std::vector<KeyframeCursor>& cursors, SkinningMode mode, DirectX::XMFLOAT4* palette, size_t paletteSize);
+
+private:
+	// Samples up to four bones starting at first into m_Transforms
+	void SampleGroup(const AnimationClip& clip, size_t first, size_t count, float t, RotationBlend blend, std::vector<KeyframeCursor>& cursors);
+
+	// Parent relative transforms, turned into model space by the palette pass
+	std::vector<DirectX::XMMATRIX> m_Transforms;
+};
@@ -2,6 +2,7 @@
 #include "Renderer.h"
 #include <DirectXColors.h>
 #include "Model.h"
+#include "Shader.h"
 #include "LoadTextureDDS.h" // OpenGL built with care
 #include "DDSTextureLoader.h" // DirectX from microsoft
 
@@ -41,7 +42,6 @@ bool DXRenderer::Create(Window* window)
 
 	CreateRasterStateSolid();
 	CreateRasterStateWireframe();
-	m_DeviceContext->RSSetState(m_RasterStateSolid.Get());
 
 	// Create an MSAA render target.
 	auto max_sample_count = 8;
@@ -112,9 +112,6 @@ void DXRenderer::Clear()
 		m_DeviceContext->ClearDepthStencilView(m_DepthStencilView.Get(), D3D11_CLEAR_DEPTH, 1.0f, 0);
 		m_DeviceContext->OMSetRenderTargets(1, m_RenderTargetView.GetAddressOf(), m_DepthStencilView.Get());
 	}
-
-	m_DeviceContext->PSSetSamplers(0, 1, m_AnisotropicSampler.GetAddressOf());
-	m_DeviceContext->PSSetSamplers(1, 1, m_ShadowSampler.GetAddressOf());
 }
 
 void DXRenderer::Present()
@@ -143,6 +140,38 @@ void DXRenderer::DrawIndex(UINT total_indices, UINT start_index, UINT base_verte
 	m_DeviceContext->DrawIndexed(total_indices, start_index, base_vertex);
 }
 
+std::unique_ptr<DrawBatch> DXRenderer::CreateDrawBatch(const std::vector<DrawCommand>& commands)
+{
+	auto batch = std::make_unique<DXDrawBatch>();
+	batch->commands = commands;
+
+	return std::move(batch);
+}
+
+void DXRenderer::UpdateDrawBatch(DrawBatch* draw_batch, const std::vector<DrawCommand>& commands)
+{
+	auto batch = reinterpret_cast<DXDrawBatch*>(draw_batch);
+	batch->commands.assign(commands.begin(), commands.end());
+}
+
+void DXRenderer::DrawBatched(DrawBatch* draw_batch, UINT first, UINT count)
+{
+	// Direct3D 11 has no multi-draw, but one virtual call per batch still keeps the per draw cost to the API call
+	auto batch = reinterpret_cast<DXDrawBatch*>(draw_batch);
+	for (auto command = batch->commands.data() + first, end = command + count; command != end; ++command)
+	{
+		if (command->instanceCount == 1 && command->baseInstance == 0)
+		{
+			m_DeviceContext->DrawIndexed(command->indexCount, command->firstIndex, command->baseVertex);
+		}
+		else
+		{
+			m_DeviceContext->DrawIndexedInstanced(command->indexCount, command->instanceCount, command->firstIndex,
+				command->baseVertex, command->baseInstance);
+		}
+	}
+}
+
 std::unique_ptr<VertexBuffer> DXRenderer::CreateVertexBuffer(const std::vector<Vertex>& vertices)
 {
 	auto vertex_buffer = std::make_unique<DXVertexBuffer>();
@@ -165,7 +194,38 @@ void DXRenderer::ApplyVertexBuffer(VertexBuffer* buffer)
 	UINT offset = 0;
 
 	auto vertex_buffer = reinterpret_cast<DXVertexBuffer*>(buffer);
-	m_DeviceContext->IASetVertexBuffers(0, 1, vertex_buffer->buffer.GetAddressOf(), &stride, &offset);
+	ApplyState(m_BoundState.vertexBuffer, vertex_buffer->buffer.Get(), [&]
+	{
+		m_DeviceContext->IASetVertexBuffers(0, 1, vertex_buffer->buffer.GetAddressOf(), &stride, &offset);
+	});
+}
+
+std::unique_ptr<VertexBuffer> DXRenderer::CreateInstanceBuffer(const std::vector<InstanceData>& instances)
+{
+	auto instance_buffer = std::make_unique<DXVertexBuffer>();
+
+	D3D11_BUFFER_DESC instancebuffer_desc = {};
+	instancebuffer_desc.Usage = D3D11_USAGE_IMMUTABLE;
+	instancebuffer_desc.ByteWidth = static_cast<UINT>(sizeof(InstanceData) * instances.size());
+	instancebuffer_desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+
+	D3D11_SUBRESOURCE_DATA instancebuffer_data = {};
+	instancebuffer_data.pSysMem = instances.data();
+	DX::Check(m_Device->CreateBuffer(&instancebuffer_desc, &instancebuffer_data, instance_buffer->buffer.ReleaseAndGetAddressOf()));
+
+	return std::move(instance_buffer);
+}
+
+void DXRenderer::ApplyInstanceBuffer(VertexBuffer* buffer)
+{
+	UINT stride = sizeof(InstanceData);
+	UINT offset = 0;
+
+	auto instance_buffer = reinterpret_cast<DXVertexBuffer*>(buffer);
+	ApplyState(m_BoundState.instanceBuffer, instance_buffer->buffer.Get(), [&]
+	{
+		m_DeviceContext->IASetVertexBuffers(1, 1, instance_buffer->buffer.GetAddressOf(), &stride, &offset);
+	});
 }
 
 std::unique_ptr<IndexBuffer> DXRenderer::CreateIndexBuffer(const std::vector<UINT>& indices)
@@ -188,12 +248,65 @@ std::unique_ptr<IndexBuffer> DXRenderer::CreateIndexBuffer(const std::vector<UIN
 void DXRenderer::ApplyIndexBuffer(IndexBuffer* index_buffer)
 {
 	auto buffer = reinterpret_cast<DXIndexBuffer*>(index_buffer);
-	m_DeviceContext->IASetIndexBuffer(buffer->buffer.Get(), DXGI_FORMAT_R32_UINT, 0);
+	ApplyState(m_BoundState.indexBuffer, buffer->buffer.Get(), [&]
+	{
+		m_DeviceContext->IASetIndexBuffer(buffer->buffer.Get(), DXGI_FORMAT_R32_UINT, 0);
+	});
+}
+
+std::unique_ptr<PipelineState> DXRenderer::CreatePipelineState(const PipelineStateDesc& desc)
+{
+	auto pipeline_state = std::make_unique<DXPipelineState>();
+
+	auto shader = reinterpret_cast<DXShader*>(desc.shader);
+	pipeline_state->vertexShader = shader->GetVertexShader();
+	pipeline_state->pixelShader = shader->GetPixelShader();
+	pipeline_state->inputLayout = shader->GetVertexLayout();
+
+	pipeline_state->rasterState = desc.wireframe ? m_RasterStateWireframe : m_RasterStateSolid;
+	pipeline_state->samplers[0] = CreateAnisotropicSampler(desc.anisotropicFilterLevel);
+	pipeline_state->samplers[1] = m_ShadowSampler;
+	pipeline_state->topology = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+
+	return std::move(pipeline_state);
 }
 
-void DXRenderer::SetPrimitiveTopology()
+void DXRenderer::ApplyPipelineState(PipelineState* pipeline_state)
 {
-	m_DeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	auto state = reinterpret_cast<DXPipelineState*>(pipeline_state);
+
+	ApplyState(m_BoundState.inputLayout, state->inputLayout.Get(), [&]
+	{
+		m_DeviceContext->IASetInputLayout(state->inputLayout.Get());
+	});
+
+	ApplyState(m_BoundState.vertexShader, state->vertexShader.Get(), [&]
+	{
+		m_DeviceContext->VSSetShader(state->vertexShader.Get(), nullptr, 0);
+	});
+
+	ApplyState(m_BoundState.pixelShader, state->pixelShader.Get(), [&]
+	{
+		m_DeviceContext->PSSetShader(state->pixelShader.Get(), nullptr, 0);
+	});
+
+	ApplyState(m_BoundState.rasterState, state->rasterState.Get(), [&]
+	{
+		m_DeviceContext->RSSetState(state->rasterState.Get());
+	});
+
+	for (UINT i = 0; i < state->samplers.size(); ++i)
+	{
+		ApplyState(m_BoundState.samplers[i], state->samplers[i].Get(), [&]
+		{
+			m_DeviceContext->PSSetSamplers(i, 1, state->samplers[i].GetAddressOf());
+		});
+	}
+
+	ApplyState(m_BoundState.topology, state->topology, [&]
+	{
+		m_DeviceContext->IASetPrimitiveTopology(state->topology);
+	});
 }
 
 std::unique_ptr<Texture2D> DXRenderer::CreateTexture2D(const std::string& path)
@@ -212,19 +325,16 @@ std::unique_ptr<Texture2D> DXRenderer::CreateTexture2D(const std::string& path)
 void DXRenderer::ApplyTexture2D(UINT slot, Texture2D* resource)
 {
 	auto res = reinterpret_cast<DXTexture2D*>(resource);
-	m_DeviceContext->PSSetShaderResources(slot, 1, res->resource.GetAddressOf());
-}
-
-void DXRenderer::ToggleWireframe(bool wireframe)
-{
-	if (wireframe)
+	if (slot >= m_BoundState.textures.size())
 	{
-		m_DeviceContext->RSSetState(m_RasterStateWireframe.Get());
+		m_DeviceContext->PSSetShaderResources(slot, 1, res->resource.GetAddressOf());
+		return;
 	}
-	else
+
+	ApplyState(m_BoundState.textures[slot], res->resource.Get(), [&]
 	{
-		m_DeviceContext->RSSetState(m_RasterStateSolid.Get());
-	}
+		m_DeviceContext->PSSetShaderResources(slot, 1, res->resource.GetAddressOf());
+	});
 }
 
 void DXRenderer::QueryHardwareInfo()
@@ -431,7 +541,7 @@ int DXRenderer::GetMaxAnisotropicFilterLevel()
 	return D3D11_REQ_MAXANISOTROPY;
 }
 
-void DXRenderer::SetAnisotropicFilter(int level)
+ComPtr<ID3D11SamplerState> DXRenderer::CreateAnisotropicSampler(int level)
 {
 	D3D11_SAMPLER_DESC samplerDesc = {};
 	samplerDesc.Filter = D3D11_FILTER_ANISOTROPIC;
@@ -444,7 +554,9 @@ void DXRenderer::SetAnisotropicFilter(int level)
 	samplerDesc.MinLOD = 0;
 	samplerDesc.MaxLOD = 1000.0f;
 
-	DX::Check(m_Device->CreateSamplerState(&samplerDesc, &m_AnisotropicSampler));
+	ComPtr<ID3D11SamplerState> sampler = nullptr;
+	DX::Check(m_Device->CreateSamplerState(&samplerDesc, sampler.GetAddressOf()));
+	return sampler;
 }
 
 void DXRenderer::SetVync(bool enable)
@@ -488,7 +600,6 @@ void DXRenderer::CreateRasterStateWireframe()
 
 GLRenderer::~GLRenderer()
 {
-	glDeleteSamplers(1, &m_TextureSampler);
 	glDeleteTextures(1, &m_BackBuffer);
 	glDeleteBuffers(1, &m_FrameBuffer);
 	glDeleteRenderbuffers(1, &m_DepthBuffer);
@@ -554,9 +665,6 @@ void GLRenderer::Clear()
 	{
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
-
-	glBindSampler(0, m_TextureSampler);
-	glBindSampler(1, m_TextureSampler);
 }
 
 void GLRenderer::Present()
@@ -581,28 +689,176 @@ void GLRenderer::DrawIndex(UINT total_indices, UINT start_index, UINT base_verte
 	glDrawElementsBaseVertex(m_PrimitiveTopology, total_indices, GL_UNSIGNED_INT, nullptr, base_vertex);
 }
 
+std::unique_ptr<DrawBatch> GLRenderer::CreateDrawBatch(const std::vector<DrawCommand>& commands)
+{
+	static_assert(sizeof(DrawCommand) == 5 * sizeof(GLuint), "DrawCommand must match DrawElementsIndirectCommand");
+
+	auto batch = std::make_unique<GLDrawBatch>();
+	batch->Create(std::max<size_t>(commands.size(), 1));
+	std::copy(commands.begin(), commands.end(), batch->data);
+
+	return std::move(batch);
+}
+
+void GLRenderer::UpdateDrawBatch(DrawBatch* draw_batch, const std::vector<DrawCommand>& commands)
+{
+	auto batch = reinterpret_cast<GLDrawBatch*>(draw_batch);
+	if (commands.size() > batch->capacity)
+	{
+		// Storage can't grow, so move to a larger buffer. It is created before the old one is released so the
+		// name differs and the bound state sees the change. GL keeps the old storage until draws using it finish
+		GLDrawBatch larger;
+		larger.Create(commands.size());
+		batch->Release();
+		std::swap(batch->buffer, larger.buffer);
+		std::swap(batch->data, larger.data);
+		batch->capacity = larger.capacity;
+		batch->region = 0;
+		std::copy(commands.begin(), commands.end(), batch->data);
+		return;
+	}
+
+	auto destination = batch->NextRegion();
+	std::copy(commands.begin(), commands.end(), destination);
+}
+
+void GLDrawBatch::Create(size_t commandCapacity)
+{
+	// Coherent, so writes are visible to the GPU without flushing
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	capacity = commandCapacity;
+	region = 0;
+	glCreateBuffers(1, &buffer);
+	glNamedBufferStorage(buffer, capacity * RegionCount * sizeof(DrawCommand), nullptr, flags);
+	data = static_cast<DrawCommand*>(glMapNamedBufferRange(buffer, 0, capacity * RegionCount * sizeof(DrawCommand), flags));
+}
+
+void GLDrawBatch::Release()
+{
+	for (auto& fence : fences)
+	{
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	if (buffer != 0)
+	{
+		glUnmapNamedBuffer(buffer);
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+		data = nullptr;
+	}
+}
+
+DrawCommand* GLDrawBatch::NextRegion()
+{
+	auto& previous = fences[region];
+	glDeleteSync(previous);
+	previous = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	region = (region + 1) % RegionCount;
+	auto& fence = fences[region];
+	if (fence != nullptr)
+	{
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	return data + region * capacity;
+}
+
+void GLRenderer::DrawBatched(DrawBatch* draw_batch, UINT first, UINT count)
+{
+	auto batch = reinterpret_cast<GLDrawBatch*>(draw_batch);
+	ApplyState(m_BoundState.indirectBuffer, batch->buffer, [&]
+	{
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch->buffer);
+	});
+
+	auto offset = reinterpret_cast<const void*>(batch->GetRegionOffset() + static_cast<uintptr_t>(first) * sizeof(DrawCommand));
+	glMultiDrawElementsIndirect(m_PrimitiveTopology, GL_UNSIGNED_INT, offset, count, 0);
+}
+
 std::unique_ptr<VertexBuffer> GLRenderer::CreateVertexBuffer(const std::vector<Vertex>& vertices)
 {
 	auto vertex_buffer = std::make_unique<GLVertexBuffer>();
 
-	// Vertex array object
+	// Vertex array object, left bound for the index buffer
 	glCreateVertexArrays(1, &vertex_buffer->vertexArrayObject);
 	glBindVertexArray(vertex_buffer->vertexArrayObject);
+	m_BoundState.vertexArray = vertex_buffer->vertexArrayObject;
 
 	// Create vertex buffer
 	glCreateBuffers(1, &vertex_buffer->buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer->buffer);
-
 	glNamedBufferStorage(vertex_buffer->buffer, sizeof(Vertex) * vertices.size(), nullptr, GL_DYNAMIC_STORAGE_BIT);
 	glNamedBufferSubData(vertex_buffer->buffer, 0, sizeof(Vertex) * vertices.size(), vertices.data());
 
+	// Vertex format is captured by the vertex array object once, rather than respecified before every draw
+	auto vertex_array = vertex_buffer->vertexArrayObject;
+	glVertexArrayVertexBuffer(vertex_array, 0, vertex_buffer->buffer, 0, sizeof(Vertex));
+
+	const std::array<std::pair<GLint, GLuint>, 7> float_attributes = { {
+		{ 3, 0 }, { 4, 12 }, { 2, 28 }, { 3, 36 }, { 3, 48 }, { 3, 60 }, { 4, 72 } } };
+
+	for (GLuint i = 0; i < float_attributes.size(); ++i)
+	{
+		glEnableVertexArrayAttrib(vertex_array, i);
+		glVertexArrayAttribFormat(vertex_array, i, float_attributes[i].first, GL_FLOAT, GL_FALSE, float_attributes[i].second);
+		glVertexArrayAttribBinding(vertex_array, i, 0);
+	}
+
+	// Bone indices
+	glEnableVertexArrayAttrib(vertex_array, 7);
+	glVertexArrayAttribIFormat(vertex_array, 7, 4, GL_INT, 88);
+	glVertexArrayAttribBinding(vertex_array, 7, 0);
+
+	// Instance stream, advanced once per instance from binding 1
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		glEnableVertexArrayAttrib(vertex_array, 8 + i);
+		glVertexArrayAttribFormat(vertex_array, 8 + i, 4, GL_FLOAT, GL_FALSE, offsetof(InstanceData, transform) + i * sizeof(DirectX::XMFLOAT4));
+		glVertexArrayAttribBinding(vertex_array, 8 + i, 1);
+	}
+
+	glEnableVertexArrayAttrib(vertex_array, 11);
+	glVertexArrayAttribIFormat(vertex_array, 11, 1, GL_UNSIGNED_INT, offsetof(InstanceData, paletteBase));
+	glVertexArrayAttribBinding(vertex_array, 11, 1);
+	glVertexArrayBindingDivisor(vertex_array, 1, 1);
+
 	return std::move(vertex_buffer);
 }
 
+std::unique_ptr<VertexBuffer> GLRenderer::CreateInstanceBuffer(const std::vector<InstanceData>& instances)
+{
+	auto instance_buffer = std::make_unique<GLVertexBuffer>();
+
+	glCreateBuffers(1, &instance_buffer->buffer);
+	glNamedBufferStorage(instance_buffer->buffer, sizeof(InstanceData) * instances.size(), instances.data(), 0);
+
+	return std::move(instance_buffer);
+}
+
+void GLRenderer::ApplyInstanceBuffer(VertexBuffer* instance_buffer)
+{
+	// The instance stream is part of the vertex array object, so attach it to the one bound
+	auto buffer = reinterpret_cast<GLVertexBuffer*>(instance_buffer);
+	ApplyState(m_BoundState.instanceBuffer, std::make_pair(m_BoundState.vertexArray, buffer->buffer), [&]
+	{
+		glVertexArrayVertexBuffer(m_BoundState.vertexArray, 1, buffer->buffer, 0, sizeof(InstanceData));
+	});
+}
+
 void GLRenderer::ApplyVertexBuffer(VertexBuffer* vertex_buffer)
 {
 	auto buffer = reinterpret_cast<GLVertexBuffer*>(vertex_buffer);
-	glBindVertexArray(buffer->vertexArrayObject);
+	ApplyState(m_BoundState.vertexArray, buffer->vertexArrayObject, [&]
+	{
+		glBindVertexArray(buffer->vertexArrayObject);
+	});
 }
 
 std::unique_ptr<IndexBuffer> GLRenderer::CreateIndexBuffer(const std::vector<UINT>& indices)
@@ -621,10 +877,46 @@ void GLRenderer::ApplyIndexBuffer(IndexBuffer* index_buffer)
 	// OpenGL doesn't require us to specific bind the index buffer, since it will bind it to the currently bound vertex array object
 }
 
-void GLRenderer::SetPrimitiveTopology()
+std::unique_ptr<PipelineState> GLRenderer::CreatePipelineState(const PipelineStateDesc& desc)
 {
+	auto pipeline_state = std::make_unique<GLPipelineState>();
+
+	pipeline_state->program = reinterpret_cast<GLShader*>(desc.shader)->GetShaderId();
+	pipeline_state->polygonMode = desc.wireframe ? GL_LINE : GL_FILL;
+	pipeline_state->topology = GL_TRIANGLES;
+
+	glCreateSamplers(1, &pipeline_state->sampler);
+	glSamplerParameterf(pipeline_state->sampler, GL_TEXTURE_MAX_ANISOTROPY, static_cast<GLfloat>(std::max(desc.anisotropicFilterLevel, 1)));
+	glSamplerParameteri(pipeline_state->sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glSamplerParameteri(pipeline_state->sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	return std::move(pipeline_state);
+}
+
+void GLRenderer::ApplyPipelineState(PipelineState* pipeline_state)
+{
+	auto state = reinterpret_cast<GLPipelineState*>(pipeline_state);
+
+	ApplyState(m_BoundState.program, state->program, [&]
+	{
+		glUseProgram(state->program);
+	});
+
+	ApplyState(m_BoundState.polygonMode, state->polygonMode, [&]
+	{
+		glPolygonMode(GL_FRONT_AND_BACK, state->polygonMode);
+	});
+
+	for (GLuint i = 0; i < m_BoundState.samplers.size(); ++i)
+	{
+		ApplyState(m_BoundState.samplers[i], state->sampler, [&]
+		{
+			glBindSampler(i, state->sampler);
+		});
+	}
+
 	// Remember primitive topology as it's part of the OpenGL draw function
-	m_PrimitiveTopology = GL_TRIANGLES;
+	m_PrimitiveTopology = state->topology;
 }
 
 std::unique_ptr<Texture2D> GLRenderer::CreateTexture2D(const std::string& path)
@@ -649,19 +941,16 @@ std::unique_ptr<Texture2D> GLRenderer::CreateTexture2D(const std::string& path)
 void GLRenderer::ApplyTexture2D(UINT slot, Texture2D* resource)
 {
 	auto res = reinterpret_cast<GLTexture2D*>(resource);
-	glBindTextureUnit(slot, res->resource);
-}
-
-void GLRenderer::ToggleWireframe(bool wireframe)
-{
-	if (wireframe)
+	if (slot >= m_BoundState.textures.size())
 	{
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		glBindTextureUnit(slot, res->resource);
+		return;
 	}
-	else
+
+	ApplyState(m_BoundState.textures[slot], res->resource, [&]
 	{
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	}
+		glBindTextureUnit(slot, res->resource);
+	});
 }
 
 void GLRenderer::QueryHardwareInfo()
@@ -758,21 +1047,6 @@ int GLRenderer::GetMaxAnisotropicFilterLevel()
 	return max_anisotrophic;
 }
 
-void GLRenderer::SetAnisotropicFilter(int level)
-{
-	if (level == 0)
-	{
-		glDeleteSamplers(1, &m_TextureSampler);
-		return;
-	}
-
-	glCreateSamplers(1, &m_TextureSampler);
-
-	glSamplerParameterf(m_TextureSampler, GL_TEXTURE_MAX_ANISOTROPY, static_cast<GLfloat>(level));
-	glSamplerParameterf(m_TextureSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glSamplerParameterf(m_TextureSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-}
-
 void GLRenderer::SetVync(bool enable)
 {
 	m_Vsync = enable;
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "Window.h"
+#include <DirectXMath.h>
 struct Vertex;
+class IShader;
 
 namespace DX
 {
@@ -54,6 +56,14 @@ struct GLVertexBuffer : public VertexBuffer
 	GLuint buffer = 0;
 };
 
+// Per instance vertex stream. The transform is stored as the top three rows of its transposed affine matrix,
+// and the palette base is the first bone of the instance's palettes in the bone palette buffer
+struct InstanceData
+{
+	DirectX::XMFLOAT4 transform[3];
+	uint32_t paletteBase = 0;
+};
+
 // Index buffer
 struct IndexBuffer
 {
@@ -100,6 +110,105 @@ struct GLTexture2D : public Texture2D
 	GLuint resource = 0;
 };
 
+// One indexed draw within a batch. Laid out as an OpenGL indirect draw command so a batch can be uploaded as is
+struct DrawCommand
+{
+	UINT indexCount = 0;
+	UINT instanceCount = 1;
+	UINT firstIndex = 0;
+	INT baseVertex = 0;
+	UINT baseInstance = 0;
+};
+
+// Draw commands submitted together, rewritten whenever the set of draws changes
+struct DrawBatch
+{
+	virtual ~DrawBatch() = default;
+};
+
+// DirectX draw batch, submitted in a loop inside the renderer
+struct DXDrawBatch : public DrawBatch
+{
+	std::vector<DrawCommand> commands;
+};
+
+// OpenGL draw batch, held in a persistently mapped indirect buffer and submitted with a single multi-draw. The buffer
+// is split into one region per update in flight, each fenced when the batch moves on from it and waited on before it
+// is written again, so an update never overwrites commands a previous frame's draws may still be reading
+struct GLDrawBatch : public DrawBatch
+{
+	virtual ~GLDrawBatch()
+	{
+		Release();
+	}
+
+	// Create the buffer with room for capacity commands in each region, starting at the first
+	void Create(size_t commandCapacity);
+	void Release();
+
+	// Fence the current region and move on to the next, waiting for the GPU if it is still reading it. Returns where
+	// to write its commands
+	DrawCommand* NextRegion();
+
+	// Offset of the current region's first command in the buffer
+	size_t GetRegionOffset() const { return region * capacity * sizeof(DrawCommand); }
+
+	static constexpr size_t RegionCount = 3;
+
+	GLuint buffer = 0;
+	DrawCommand* data = nullptr;
+	size_t capacity = 0;
+	size_t region = 0;
+	std::array<GLsync, RegionCount> fences = {};
+};
+
+// Settings a pipeline state is built from
+struct PipelineStateDesc
+{
+	IShader* shader = nullptr;
+	bool wireframe = false;
+	int anisotropicFilterLevel = 1;
+};
+
+// Shader, input layout, raster, sampler and topology state bundled together. A pipeline state is
+// immutable, so changing a setting means creating a new one rather than editing the bound one
+struct PipelineState
+{
+	virtual ~PipelineState() = default;
+};
+
+// DirectX pipeline state
+struct DXPipelineState : public PipelineState
+{
+	ComPtr<ID3D11VertexShader> vertexShader = nullptr;
+	ComPtr<ID3D11PixelShader> pixelShader = nullptr;
+	ComPtr<ID3D11InputLayout> inputLayout = nullptr;
+	ComPtr<ID3D11RasterizerState> rasterState = nullptr;
+	std::array<ComPtr<ID3D11SamplerState>, 2> samplers;
+	D3D11_PRIMITIVE_TOPOLOGY topology = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+};
+
+// OpenGL pipeline state. The vertex format is held by each vertex buffer's vertex array object
+struct GLPipelineState : public PipelineState
+{
+	virtual ~GLPipelineState()
+	{
+		glDeleteSamplers(1, &sampler);
+	}
+
+	GLuint program = 0;
+	GLenum polygonMode = GL_FILL;
+	GLuint sampler = 0;
+	GLenum topology = GL_TRIANGLES;
+};
+
+// State changes sent to the device and those dropped because the state was already bound, counted over one frame
+struct StateChangeCounters
+{
+	unsigned issued = 0;
+	unsigned filtered = 0;
+};
+
 // Base rendering class
 class IRenderer
 {
@@ -122,20 +231,38 @@ public:
 	// Draw indices
 	virtual void DrawIndex(UINT total_indices, UINT start_index, UINT base_vertex) = 0;
 
+	// Create a batch of draw commands
+	virtual std::unique_ptr<DrawBatch> CreateDrawBatch(const std::vector<DrawCommand>& commands) = 0;
+
+	// Replace the commands of a batch
+	virtual void UpdateDrawBatch(DrawBatch* batch, const std::vector<DrawCommand>& commands) = 0;
+
+	// Draw count commands of a batch, starting at first
+	virtual void DrawBatched(DrawBatch* batch, UINT first, UINT count) = 0;
+
 	// Create vertex buffer
 	virtual std::unique_ptr<VertexBuffer> CreateVertexBuffer(const std::vector<Vertex>& vertices) = 0;
 
 	// Apply vertex buffer to pipeline
 	virtual void ApplyVertexBuffer(VertexBuffer* vertex_buffer) = 0;
 
+	// Create instance buffer
+	virtual std::unique_ptr<VertexBuffer> CreateInstanceBuffer(const std::vector<InstanceData>& instances) = 0;
+
+	// Apply instance buffer, read once per instance alongside the vertex buffer
+	virtual void ApplyInstanceBuffer(VertexBuffer* instance_buffer) = 0;
+
 	// Create index buffer
 	virtual std::unique_ptr<IndexBuffer> CreateIndexBuffer(const std::vector<UINT>& indices) = 0;
 
 	// Apply index buffer
 	virtual void ApplyIndexBuffer(IndexBuffer* index_buffer) = 0;
 
-	// Set primitive topology
-	virtual void SetPrimitiveTopology() = 0;
+	// Create pipeline state
+	virtual std::unique_ptr<PipelineState> CreatePipelineState(const PipelineStateDesc& desc) = 0;
+
+	// Apply pipeline state, only changing the parts that differ from what is bound
+	virtual void ApplyPipelineState(PipelineState* pipeline_state) = 0;
 
 	// Create texture 2D
 	virtual std::unique_ptr<Texture2D> CreateTexture2D(const std::string& path) = 0;
@@ -152,9 +279,6 @@ public:
 	// Query GPU video memory in bytes
 	virtual SIZE_T GetVRAM() = 0;
 
-	// Toggle wireframe rendering
-	virtual void ToggleWireframe(bool wireframe) = 0;
-
 	// Create anti-aliasing backbuffer
 	virtual bool CreateAntiAliasingTarget(int msaa_level, int window_width, int window_height) = 0;
 
@@ -167,11 +291,30 @@ public:
 	// Get the anisotropic filter level
 	virtual int GetMaxAnisotropicFilterLevel() = 0;
 
-	// Set the anisotropic filter level
-	virtual void SetAnisotropicFilter(int level) = 0;
-
 	// Enable V-sync
 	virtual void SetVync(bool enable) = 0;
+
+	// State changes issued and filtered since the counters were last reset
+	StateChangeCounters GetStateChanges() const { return m_StateChanges; }
+	void ResetStateChanges() { m_StateChanges = {}; }
+
+protected:
+	// Applies a piece of state only when it differs from the bound value, which is then updated
+	template <typename T, typename Set>
+	void ApplyState(T& bound, const T& value, Set&& set)
+	{
+		if (bound == value)
+		{
+			++m_StateChanges.filtered;
+			return;
+		}
+
+		set();
+		bound = value;
+		++m_StateChanges.issued;
+	}
+
+	StateChangeCounters m_StateChanges;
 };
 
 class DXRenderer : public IRenderer
@@ -189,20 +332,30 @@ public:
 	// Draw indices
 	virtual void DrawIndex(UINT total_indices, UINT start_index, UINT base_vertex) override;
 
+	// Draw batches
+	std::unique_ptr<DrawBatch> CreateDrawBatch(const std::vector<DrawCommand>& commands) override;
+	void UpdateDrawBatch(DrawBatch* batch, const std::vector<DrawCommand>& commands) override;
+	void DrawBatched(DrawBatch* batch, UINT first, UINT count) override;
+
 	// Create vertex buffer
 	std::unique_ptr<VertexBuffer> CreateVertexBuffer(const std::vector<Vertex>& vertices) override;
 
 	// Apply vertex buffer
 	void ApplyVertexBuffer(VertexBuffer* vertex_buffer) override;
 
+	// Instance buffer
+	std::unique_ptr<VertexBuffer> CreateInstanceBuffer(const std::vector<InstanceData>& instances) override;
+	void ApplyInstanceBuffer(VertexBuffer* instance_buffer) override;
+
 	// Create index buffer
 	virtual std::unique_ptr<IndexBuffer> CreateIndexBuffer(const std::vector<UINT>& indices) override;
 
 	// Apply index buffer
 	virtual void ApplyIndexBuffer(IndexBuffer* index_buffer) override;
 
-	// Set primitive topology
-	virtual void SetPrimitiveTopology() override;
+	// Pipeline state
+	std::unique_ptr<PipelineState> CreatePipelineState(const PipelineStateDesc& desc) override;
+	void ApplyPipelineState(PipelineState* pipeline_state) override;
 
 	// Create texture 2D
 	virtual std::unique_ptr<Texture2D> CreateTexture2D(const std::string& path) override;
@@ -221,9 +374,6 @@ public:
 	const std::string& GetName() override { return m_DeviceName; }
 	SIZE_T GetVRAM() override { return m_DeviceVideoMemoryMb; }
 
-	// Wireframe
-	void ToggleWireframe(bool wireframe) override;
-
 	// Anti-aliasing
 	bool CreateAntiAliasingTarget(int msaa_level, int window_width, int window_height);
 	const std::vector<int>& GetSupportMsaaLevels() { return m_SupportMsaaLevels; }
@@ -231,7 +381,6 @@ public:
 
 	// Texture filtering
 	virtual int GetMaxAnisotropicFilterLevel() override;
-	virtual void SetAnisotropicFilter(int level) override;
 
 	// Vsync
 	virtual void SetVync(bool enable) override;
@@ -280,11 +429,29 @@ private:
 	SIZE_T m_DeviceVideoMemoryMb = 0;
 
 	// Texture filtering
-	ComPtr<ID3D11SamplerState> m_AnisotropicSampler = nullptr;
+	ComPtr<ID3D11SamplerState> CreateAnisotropicSampler(int level);
 
 	// Shaders
 	ComPtr<ID3D11SamplerState> m_ShadowSampler = nullptr;
 
+	// State last applied to the device context. The context holds a reference to everything bound,
+	// so a pointer here can't be reused by a new object while it is still current
+	struct BoundState
+	{
+		ID3D11VertexShader* vertexShader = nullptr;
+		ID3D11PixelShader* pixelShader = nullptr;
+		ID3D11InputLayout* inputLayout = nullptr;
+		ID3D11RasterizerState* rasterState = nullptr;
+		std::array<ID3D11SamplerState*, 2> samplers = {};
+		D3D11_PRIMITIVE_TOPOLOGY topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+		ID3D11Buffer* vertexBuffer = nullptr;
+		ID3D11Buffer* instanceBuffer = nullptr;
+		ID3D11Buffer* indexBuffer = nullptr;
+		std::array<ID3D11ShaderResourceView*, 8> textures = {};
+	};
+
+	BoundState m_BoundState;
+
 	// Vsync
 	bool m_Vsync = false;
 };
@@ -304,20 +471,30 @@ public:
 	// Draw indices
 	virtual void DrawIndex(UINT total_indices, UINT start_index, UINT base_vertex) override;
 
+	// Draw batches
+	std::unique_ptr<DrawBatch> CreateDrawBatch(const std::vector<DrawCommand>& commands) override;
+	void UpdateDrawBatch(DrawBatch* batch, const std::vector<DrawCommand>& commands) override;
+	void DrawBatched(DrawBatch* batch, UINT first, UINT count) override;
+
 	// Create vertex buffer
 	std::unique_ptr<VertexBuffer> CreateVertexBuffer(const std::vector<Vertex>& vertices) override;
 
 	// Apply vertex buffer
 	void ApplyVertexBuffer(VertexBuffer* vertex_buffer) override;
 
+	// Instance buffer
+	std::unique_ptr<VertexBuffer> CreateInstanceBuffer(const std::vector<InstanceData>& instances) override;
+	void ApplyInstanceBuffer(VertexBuffer* instance_buffer) override;
+
 	// Create index buffer
 	virtual std::unique_ptr<IndexBuffer> CreateIndexBuffer(const std::vector<UINT>& indices) override;
 
 	// Apply index buffer
 	virtual void ApplyIndexBuffer(IndexBuffer* index_buffer) override;
 
-	// Set primitive topology
-	virtual void SetPrimitiveTopology() override;
+	// Pipeline state
+	std::unique_ptr<PipelineState> CreatePipelineState(const PipelineStateDesc& desc) override;
+	void ApplyPipelineState(PipelineState* pipeline_state) override;
 
 	// Create texture 2D
 	virtual std::unique_ptr<Texture2D> CreateTexture2D(const std::string& path) override;
@@ -330,8 +507,6 @@ public:
 	const std::string& GetName() override { return m_DeviceName; }
 	SIZE_T GetVRAM() override { return m_DeviceVideoMemoryMb; }
 
-	void ToggleWireframe(bool wireframe) override;
-
 	// Anti-aliasing
 	const std::vector<int>& GetSupportMsaaLevels() override { return m_SupportMsaaLevels; }
 	bool CreateAntiAliasingTarget(int msaa_level, int window_width, int window_height);
@@ -339,7 +514,6 @@ public:
 
 	// Texture filtering
 	virtual int GetMaxAnisotropicFilterLevel() override;
-	virtual void SetAnisotropicFilter(int level) override;
 
 	// Vsync
 	virtual void SetVync(bool enable) override;
@@ -366,12 +540,25 @@ private:
 	// Device video memory
 	SIZE_T m_DeviceVideoMemoryMb = 0;
 
-	// Texture filtering
-	GLuint m_TextureSampler = 0;
-
 	// Vsync
 	bool m_Vsync = false;
 
 	// Topology
 	int m_PrimitiveTopology = 0;
+
+	// State last applied to the context
+	struct BoundState
+	{
+		GLuint program = 0;
+		GLenum polygonMode = GL_FILL;
+		std::array<GLuint, 2> samplers = {};
+		GLuint vertexArray = 0;
+
+		// Vertex array object the instance buffer was attached to, and the buffer
+		std::pair<GLuint, GLuint> instanceBuffer;
+		GLuint indirectBuffer = 0;
+		std::array<GLuint, 8> textures = {};
+	};
+
+	BoundState m_BoundState;
 };
\ No newline at end of file
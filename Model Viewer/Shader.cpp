@@ -2,8 +2,86 @@
 #include "Shader.h"
 #include <SDL_messagebox.h>
 #include <fstream>
+#include <cstring>
 #include "Model.h"
 
+bool UploadShadow::Update(const void* data, size_t size)
+{
+	if (m_Valid && m_Data.size() == size && std::memcmp(m_Data.data(), data, size) == 0)
+	{
+		return false;
+	}
+
+	auto bytes = static_cast<const uint8_t*>(data);
+	m_Data.assign(bytes, bytes + size);
+	m_Valid = true;
+	return true;
+}
+
+bool IShader::CountUpload(bool changed)
+{
+	++(changed ? m_Uploads.performed : m_Uploads.skipped);
+	return changed;
+}
+
+namespace
+{
+	// GL uniform block bindings and texture units, matching the slots the HLSL uses
+	constexpr GLuint WorldBinding = 0;
+	constexpr GLuint LightBinding = 1;
+	constexpr GLuint BoneBinding = 2;
+	constexpr GLuint BonePaletteUnit = 2;
+
+	// Uniform data streamed per frame. Each draw uses up to a full bone block
+	constexpr size_t UniformRingFrameSize = 2 * 1024 * 1024;
+
+	// Direct3D constant buffer ring, and the granularity of constant buffer offsets
+	constexpr size_t ConstantRingSize = 1024 * 1024;
+	constexpr size_t ConstantAlignment = 256;
+}
+
+bool DXConstantRing::Create(DXRenderer* renderer, size_t size, bool offsets)
+{
+	m_Renderer = renderer;
+	m_Size = (size + ConstantAlignment - 1) / ConstantAlignment * ConstantAlignment;
+	m_Offsets = offsets;
+
+	D3D11_BUFFER_DESC bd = {};
+	bd.Usage = D3D11_USAGE_DYNAMIC;
+	bd.ByteWidth = static_cast<UINT>(m_Size);
+	bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	return SUCCEEDED(m_Renderer->GetDevice()->CreateBuffer(&bd, nullptr, m_Buffer.ReleaseAndGetAddressOf()));
+}
+
+uint8_t* DXConstantRing::Map(size_t size, UINT* firstConstant, UINT* numConstants)
+{
+	// Offsets and sizes are in whole 16 constant blocks
+	auto aligned = (size + ConstantAlignment - 1) / ConstantAlignment * ConstantAlignment;
+	auto map_type = D3D11_MAP_WRITE_NO_OVERWRITE;
+	if (!m_Offsets || m_Offset == 0 || m_Offset + aligned > m_Size)
+	{
+		map_type = D3D11_MAP_WRITE_DISCARD;
+		m_Offset = 0;
+		++m_Generation;
+	}
+
+	D3D11_MAPPED_SUBRESOURCE mapped = {};
+	DX::Check(m_Renderer->GetDeviceContext()->Map(m_Buffer.Get(), 0, map_type, 0, &mapped));
+
+	auto offset = m_Offset;
+	m_Offset += aligned;
+
+	*firstConstant = static_cast<UINT>(offset / 16);
+	*numConstants = static_cast<UINT>(aligned / 16);
+	return static_cast<uint8_t*>(mapped.pData) + offset;
+}
+
+void DXConstantRing::Unmap()
+{
+	m_Renderer->GetDeviceContext()->Unmap(m_Buffer.Get(), 0);
+}
+
 DXShader::DXShader(IRenderer* renderer)
 {
 	m_Renderer = reinterpret_cast<DXRenderer*>(renderer);
@@ -17,55 +95,201 @@ bool DXShader::Create()
 	if (!CreatePixelShader("Data Files/Shaders/PixelShader.cso"))
 		return false;
 
-	// World buffer
-	D3D11_BUFFER_DESC bd = {};
-	bd.Usage = D3D11_USAGE_DEFAULT;
-	bd.ByteWidth = sizeof(ShaderData::WorldBuffer);
-	bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-	DX::Check(m_Renderer->GetDevice()->CreateBuffer(&bd, nullptr, m_WorldBuffer.ReleaseAndGetAddressOf()));
-
-	// Light buffer
-	D3D11_BUFFER_DESC lbd = {};
-	lbd.Usage = D3D11_USAGE_DEFAULT;
-	lbd.ByteWidth = sizeof(ShaderData::LightBuffer);
-	lbd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-	DX::Check(m_Renderer->GetDevice()->CreateBuffer(&lbd, nullptr, m_LightBuffer.ReleaseAndGetAddressOf()));
-
-	// Bone buffer
-	D3D11_BUFFER_DESC bone_bd = {};
-	bone_bd.Usage = D3D11_USAGE_DEFAULT;
-	bone_bd.ByteWidth = sizeof(ShaderData::BoneBuffer);
-	bone_bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-	DX::Check(m_Renderer->GetDevice()->CreateBuffer(&bone_bd, nullptr, m_BoneConstantBuffer.ReleaseAndGetAddressOf()));
+	// Constant buffer offsets need Direct3D 11.1, fall back to a discarded buffer per slot without them
+	D3D11_FEATURE_DATA_D3D11_OPTIONS options = {};
+	m_Renderer->GetDevice()->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options));
+	m_ConstantBufferOffsets = options.ConstantBufferOffsetting && options.MapNoOverwriteOnDynamicConstantBuffer &&
+		SUCCEEDED(m_Renderer->GetDeviceContext().As(&m_DeviceContext1));
+
+	auto ring_count = m_ConstantBufferOffsets ? 1 : m_ConstantRings.size();
+	for (size_t i = 0; i < ring_count; ++i)
+	{
+		if (!m_ConstantRings[i].Create(m_Renderer, m_ConstantBufferOffsets ? ConstantRingSize : sizeof(ShaderData::BoneBuffer), m_ConstantBufferOffsets))
+		{
+			return false;
+		}
+	}
 
 	return true;
 }
 
-void DXShader::Use()
+void DXShader::UpdateWorld(const ShaderData::WorldBuffer& data)
 {
-	m_Renderer->GetDeviceContext()->IASetInputLayout(m_VertexLayout.Get());
-	m_Renderer->GetDeviceContext()->VSSetShader(m_VertexShader.Get(), nullptr, 0);
-	m_Renderer->GetDeviceContext()->PSSetShader(m_PixelShader.Get(), nullptr, 0);
+	auto changed = CountUpload(m_WorldConstants.shadow.Update(&data, sizeof(data)));
+	StreamConstants(0, true, m_WorldConstants, changed, sizeof(data), [&](uint8_t* destination)
+	{
+		std::memcpy(destination, &data, sizeof(data));
+		m_UploadedBytes += sizeof(data);
+	});
 }
 
-void DXShader::UpdateWorld(const ShaderData::WorldBuffer& data)
+void DXShader::UpdateLights(const ShaderData::LightBuffer& data)
 {
-	m_Renderer->GetDeviceContext()->VSSetConstantBuffers(0, 1, m_WorldBuffer.GetAddressOf());
-	m_Renderer->GetDeviceContext()->PSSetConstantBuffers(0, 1, m_WorldBuffer.GetAddressOf());
-	m_Renderer->GetDeviceContext()->UpdateSubresource(m_WorldBuffer.Get(), 0, nullptr, &data, 0, 0);
+	auto changed = CountUpload(m_LightConstants.shadow.Update(&data, sizeof(data)));
+	StreamConstants(1, true, m_LightConstants, changed, sizeof(data), [&](uint8_t* destination)
+	{
+		std::memcpy(destination, &data, sizeof(data));
+		m_UploadedBytes += sizeof(data);
+	});
 }
 
-void DXShader::UpdateLights(const ShaderData::LightBuffer& data)
+void DXShader::UpdateBones(SkinningMode mode, const DirectX::XMFLOAT4* palette, size_t rowCount)
 {
-	m_Renderer->GetDeviceContext()->VSSetConstantBuffers(1, 1, m_LightBuffer.GetAddressOf());
-	m_Renderer->GetDeviceContext()->PSSetConstantBuffers(1, 1, m_LightBuffer.GetAddressOf());
-	m_Renderer->GetDeviceContext()->UpdateSubresource(m_LightBuffer.Get(), 0, nullptr, &data, 0, 0);
+	// Both shadows are updated so neither falls behind
+	auto mode_changed = m_BoneModeShadow.Update(&mode, sizeof(mode));
+	auto palette_changed = m_BoneConstants.shadow.Update(palette, rowCount * sizeof(DirectX::XMFLOAT4));
+	auto changed = CountUpload(mode_changed || palette_changed);
+
+	auto in_buffer = rowCount > ShaderData::BonePaletteRows;
+	if (in_buffer && changed)
+	{
+		UpdateBonePaletteBuffer(palette, rowCount);
+		m_InstancePaletteShadow.Invalidate();
+	}
+
+	// The whole block is reserved so the bound range always covers it, but only the rows in use are written
+	StreamConstants(2, false, m_BoneConstants, changed, sizeof(ShaderData::BoneBuffer), [&](uint8_t* destination)
+	{
+		auto data = reinterpret_cast<ShaderData::BoneBuffer*>(destination);
+		data->skinningMode = static_cast<uint32_t>(mode);
+		data->paletteInBuffer = in_buffer ? 1 : 0;
+		data->paletteOffset = 0;
+		m_UploadedBytes += offsetof(ShaderData::BoneBuffer, palette);
+		if (!in_buffer)
+		{
+			std::memcpy(data->palette, palette, rowCount * sizeof(DirectX::XMFLOAT4));
+			m_UploadedBytes += rowCount * sizeof(DirectX::XMFLOAT4);
+		}
+	});
 }
 
-void DXShader::UpdateBones(const ShaderData::BoneBuffer& data)
+void DXShader::UpdateInstancePalettes(const DirectX::XMFLOAT4* palettes, size_t rowCount)
 {
-	m_Renderer->GetDeviceContext()->VSSetConstantBuffers(2, 1, m_BoneConstantBuffer.GetAddressOf());
-	m_Renderer->GetDeviceContext()->UpdateSubresource(m_BoneConstantBuffer.Get(), 0, nullptr, &data, 0, 0);
+	if (CountUpload(m_InstancePaletteShadow.Update(palettes, rowCount * sizeof(DirectX::XMFLOAT4))))
+	{
+		UpdateBonePaletteBuffer(palettes, rowCount);
+	}
+}
+
+void DXShader::UpdateBoneOffset(SkinningMode mode, uint32_t boneOffset)
+{
+	// Shadowing only the header also marks the palette as changed for the next UpdateBones
+	const uint32_t header[] = { static_cast<uint32_t>(mode), 1, boneOffset };
+	m_BoneModeShadow.Update(&mode, sizeof(mode));
+	auto changed = CountUpload(m_BoneConstants.shadow.Update(header, sizeof(header)));
+
+	StreamConstants(2, false, m_BoneConstants, changed, sizeof(ShaderData::BoneBuffer), [&](uint8_t* destination)
+	{
+		std::memcpy(destination, header, sizeof(header));
+		m_UploadedBytes += offsetof(ShaderData::BoneBuffer, palette);
+	});
+}
+
+void DXShader::BeginFrame()
+{
+	// The GUI restores its own constant buffers after drawing, so nothing bound last frame can be relied on
+	m_BoundConstants = {};
+}
+
+void DXShader::EndFrame()
+{
+}
+
+template <typename Write>
+void DXShader::StreamConstants(UINT slot, bool pixelShader, StreamedConstants& block, bool changed, size_t size, Write&& write)
+{
+	// A discard since the data was written leaves its range undefined, so it is written again
+	auto& ring = m_ConstantRings[m_ConstantBufferOffsets ? 0 : slot];
+	if (changed || block.generation != ring.GetGeneration())
+	{
+		auto generation = ring.GetGeneration();
+		write(ring.Map(size, &block.firstConstant, &block.numConstants));
+		ring.Unmap();
+		block.generation = ring.GetGeneration();
+
+		// Discarding a shared ring loses the world and light data that later draws in this frame still read
+		if (m_ConstantBufferOffsets && block.generation != generation)
+		{
+			RestoreConstants(0, true, m_WorldConstants);
+			RestoreConstants(1, true, m_LightConstants);
+		}
+	}
+
+	// Only bind when the range has moved
+	auto& bound = m_BoundConstants[slot];
+	auto buffer = ring.GetBuffer();
+	if (bound.buffer == buffer && bound.firstConstant == block.firstConstant)
+	{
+		return;
+	}
+
+	if (m_ConstantBufferOffsets)
+	{
+		m_DeviceContext1->VSSetConstantBuffers1(slot, 1, &buffer, &block.firstConstant, &block.numConstants);
+		if (pixelShader)
+		{
+			m_DeviceContext1->PSSetConstantBuffers1(slot, 1, &buffer, &block.firstConstant, &block.numConstants);
+		}
+	}
+	else
+	{
+		m_Renderer->GetDeviceContext()->VSSetConstantBuffers(slot, 1, &buffer);
+		if (pixelShader)
+		{
+			m_Renderer->GetDeviceContext()->PSSetConstantBuffers(slot, 1, &buffer);
+		}
+	}
+
+	bound = { buffer, block.firstConstant };
+}
+
+void DXShader::RestoreConstants(UINT slot, bool pixelShader, StreamedConstants& block)
+{
+	auto& data = block.shadow.GetData();
+	if (block.generation == UINT64_MAX || block.generation == m_ConstantRings[0].GetGeneration())
+	{
+		return;
+	}
+
+	StreamConstants(slot, pixelShader, block, false, data.size(), [&](uint8_t* destination)
+	{
+		std::memcpy(destination, data.data(), data.size());
+		m_UploadedBytes += data.size();
+	});
+}
+
+void DXShader::UpdateBonePaletteBuffer(const DirectX::XMFLOAT4* palette, size_t rowCount)
+{
+	auto context = m_Renderer->GetDeviceContext();
+
+	// Grow to fit the largest palette seen so far
+	if (rowCount > m_BonePaletteCapacity)
+	{
+		D3D11_BUFFER_DESC bd = {};
+		bd.Usage = D3D11_USAGE_DYNAMIC;
+		bd.ByteWidth = static_cast<UINT>(rowCount * sizeof(DirectX::XMFLOAT4));
+		bd.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		bd.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+		bd.StructureByteStride = sizeof(DirectX::XMFLOAT4);
+		DX::Check(m_Renderer->GetDevice()->CreateBuffer(&bd, nullptr, m_BonePaletteBuffer.ReleaseAndGetAddressOf()));
+
+		D3D11_SHADER_RESOURCE_VIEW_DESC srvd = {};
+		srvd.Format = DXGI_FORMAT_UNKNOWN;
+		srvd.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+		srvd.Buffer.NumElements = static_cast<UINT>(rowCount);
+		DX::Check(m_Renderer->GetDevice()->CreateShaderResourceView(m_BonePaletteBuffer.Get(), &srvd, m_BonePaletteView.ReleaseAndGetAddressOf()));
+
+		m_BonePaletteCapacity = rowCount;
+	}
+
+	D3D11_MAPPED_SUBRESOURCE mapped = {};
+	DX::Check(context->Map(m_BonePaletteBuffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped));
+	std::memcpy(mapped.pData, palette, rowCount * sizeof(DirectX::XMFLOAT4));
+	context->Unmap(m_BonePaletteBuffer.Get(), 0);
+	m_UploadedBytes += rowCount * sizeof(DirectX::XMFLOAT4);
+
+	context->VSSetShaderResources(2, 1, m_BonePaletteView.GetAddressOf());
 }
 
 bool DXShader::CreateVertexShader(const std::string& vertex_shader_path)
@@ -91,6 +315,10 @@ bool DXShader::CreateVertexShader(const std::string& vertex_shader_path)
 		{ "BITTANGENT", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 60, D3D11_INPUT_PER_VERTEX_DATA, 0 },
 		{ "WEIGHT", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 72, D3D11_INPUT_PER_VERTEX_DATA, 0 },
 		{ "BONE", 0, DXGI_FORMAT_R32G32B32A32_SINT, 0, 88, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+		{ "INSTANCE", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 0, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "INSTANCE", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 16, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "INSTANCE", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 32, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+		{ "PALETTEBASE", 0, DXGI_FORMAT_R32_UINT, 1, 48, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
 	};
 
 	UINT numElements = ARRAYSIZE(layout);
@@ -113,12 +341,96 @@ bool DXShader::CreatePixelShader(const std::string& pixel_shader_path)
 	return true;
 }
 
+GLUniformRing::~GLUniformRing()
+{
+	for (auto fence : m_Fences)
+	{
+		glDeleteSync(fence);
+	}
+
+	if (m_Buffer != 0)
+	{
+		glUnmapNamedBuffer(m_Buffer);
+		glDeleteBuffers(1, &m_Buffer);
+	}
+}
+
+bool GLUniformRing::Create(size_t frameSize)
+{
+	GLint alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	m_Alignment = std::max<size_t>(alignment, 16);
+	m_FrameSize = (frameSize + m_Alignment - 1) / m_Alignment * m_Alignment;
+
+	// Coherent, so writes are visible to the GPU without flushing
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &m_Buffer);
+	glNamedBufferStorage(m_Buffer, m_FrameSize * FrameCount, nullptr, flags);
+	m_Data = static_cast<uint8_t*>(glMapNamedBufferRange(m_Buffer, 0, m_FrameSize * FrameCount, flags));
+	return m_Data != nullptr;
+}
+
+uint8_t* GLUniformRing::Allocate(size_t size, GLintptr* offset)
+{
+	auto start = (m_Offset + m_Alignment - 1) / m_Alignment * m_Alignment;
+	if (start + size > m_FrameSize)
+	{
+		// Out of space. Wait for the draws already submitted to finish and start the region again
+		static bool reported = false;
+		if (!reported)
+		{
+			std::cerr << "Uniform ring frame region of " << m_FrameSize << " bytes is full\n";
+			reported = true;
+		}
+
+		glFinish();
+		start = 0;
+		++m_Generation;
+	}
+
+	m_Offset = start + size;
+	*offset = static_cast<GLintptr>(m_Region * m_FrameSize + start);
+	return m_Data + *offset;
+}
+
+void GLUniformRing::BeginFrame()
+{
+	m_Region = (m_Region + 1) % FrameCount;
+	m_Offset = 0;
+	++m_Generation;
+
+	// Wait until the GPU has finished the frame that last used this region
+	auto& fence = m_Fences[m_Region];
+	if (fence != nullptr)
+	{
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+}
+
+void GLUniformRing::EndFrame()
+{
+	auto& fence = m_Fences[m_Region];
+	if (fence != nullptr)
+	{
+		glDeleteSync(fence);
+	}
+
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
 GLShader::GLShader(IRenderer* renderer) : m_Renderer(renderer)
 {
 }
 
 GLShader::~GLShader()
 {
+	glDeleteTextures(1, &m_BonePaletteTexture);
+	glDeleteBuffers(1, &m_BonePaletteBuffer);
 }
 
 bool GLShader::Create()
@@ -132,85 +444,158 @@ bool GLShader::Create()
 	glAttachShader(m_ShaderId, m_FragmentShader);
 
 	glLinkProgram(m_ShaderId);
-	return true;
-}
 
-void GLShader::Use()
-{
-	// Something pipeline
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
-	glEnableVertexAttribArray(0);
+	// Resolve the uniform blocks and samplers once, they are only bound by index afterwards
+	glUniformBlockBinding(m_ShaderId, glGetUniformBlockIndex(m_ShaderId, "cWorld"), WorldBinding);
+	glUniformBlockBinding(m_ShaderId, glGetUniformBlockIndex(m_ShaderId, "cLights"), LightBinding);
+	glUniformBlockBinding(m_ShaderId, glGetUniformBlockIndex(m_ShaderId, "cBones"), BoneBinding);
+	glProgramUniform1i(m_ShaderId, glGetUniformLocation(m_ShaderId, "gBonePalette"), BonePaletteUnit);
 
-	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(12));
-	glEnableVertexAttribArray(1);
+	// Uniform data for every draw is streamed through the ring
+	if (!m_UniformRing.Create(UniformRingFrameSize))
+	{
+		return false;
+	}
 
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(28));
-	glEnableVertexAttribArray(2);
+	// Bone palette texture buffer
+	glCreateBuffers(1, &m_BonePaletteBuffer);
+	glCreateTextures(GL_TEXTURE_BUFFER, 1, &m_BonePaletteTexture);
 
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(36));
-	glEnableVertexAttribArray(3);
+	return true;
+}
 
-	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(48));
-	glEnableVertexAttribArray(4);
+void GLShader::UpdateWorld(const ShaderData::WorldBuffer& data)
+{
+	auto changed = CountUpload(m_WorldBlock.shadow.Update(&data, sizeof(data)));
+	if (auto destination = StreamBlock(WorldBinding, m_WorldBlock, changed, sizeof(data)))
+	{
+		std::memcpy(destination, &data, sizeof(data));
+		m_UploadedBytes += sizeof(data);
+	}
+}
 
-	glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(60));
-	glEnableVertexAttribArray(5);
+void GLShader::UpdateLights(const ShaderData::LightBuffer& data)
+{
+	auto changed = CountUpload(m_LightBlock.shadow.Update(&data, sizeof(data)));
+	if (auto destination = StreamBlock(LightBinding, m_LightBlock, changed, sizeof(data)))
+	{
+		std::memcpy(destination, &data, sizeof(data));
+		m_UploadedBytes += sizeof(data);
+	}
+}
 
-	glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(72));
-	glEnableVertexAttribArray(6);
+void GLShader::UpdateBones(SkinningMode mode, const DirectX::XMFLOAT4* palette, size_t rowCount)
+{
+	// Both shadows are updated so neither falls behind
+	auto mode_changed = m_BoneModeShadow.Update(&mode, sizeof(mode));
+	auto palette_changed = m_BoneBlock.shadow.Update(palette, rowCount * sizeof(DirectX::XMFLOAT4));
+	auto changed = CountUpload(mode_changed || palette_changed);
+
+	// The whole block is reserved so the bound range always covers it, but only the rows in use are written
+	auto destination = StreamBlock(BoneBinding, m_BoneBlock, changed, sizeof(ShaderData::BoneBuffer));
+	if (!destination)
+	{
+		return;
+	}
 
-	glVertexAttribIPointer(7, 4, GL_INT, sizeof(Vertex), (GLvoid*)(88));
-	glEnableVertexAttribArray(7);
+	auto in_buffer = rowCount > ShaderData::BonePaletteRows;
+	auto data = reinterpret_cast<ShaderData::BoneBuffer*>(destination);
+	data->skinningMode = static_cast<uint32_t>(mode);
+	data->paletteInBuffer = in_buffer ? 1 : 0;
+	data->paletteOffset = 0;
+	m_UploadedBytes += offsetof(ShaderData::BoneBuffer, palette);
 
-	glUseProgram(m_ShaderId);
+	if (in_buffer)
+	{
+		// Reallocating the store each time leaves the previous palette to draws still reading it
+		if (changed)
+		{
+			glNamedBufferData(m_BonePaletteBuffer, rowCount * sizeof(DirectX::XMFLOAT4), palette, GL_STREAM_DRAW);
+			glTextureBuffer(m_BonePaletteTexture, GL_RGBA32F, m_BonePaletteBuffer);
+			m_UploadedBytes += rowCount * sizeof(DirectX::XMFLOAT4);
+			m_InstancePaletteShadow.Invalidate();
+		}
+
+		glBindTextureUnit(BonePaletteUnit, m_BonePaletteTexture);
+	}
+	else
+	{
+		std::memcpy(data->palette, palette, rowCount * sizeof(DirectX::XMFLOAT4));
+		m_UploadedBytes += rowCount * sizeof(DirectX::XMFLOAT4);
+	}
 }
 
-void GLShader::UpdateWorld(const ShaderData::WorldBuffer& data)
+void GLShader::UpdateInstancePalettes(const DirectX::XMFLOAT4* palettes, size_t rowCount)
 {
-	auto world_location = glGetUniformBlockIndex(GetShaderId(), "cWorld");
-	glUniformBlockBinding(GetShaderId(), world_location, 0);
-
-	unsigned int uboMatrices;
-	glGenBuffers(1, &uboMatrices);
+	if (CountUpload(m_InstancePaletteShadow.Update(palettes, rowCount * sizeof(DirectX::XMFLOAT4))))
+	{
+		glNamedBufferData(m_BonePaletteBuffer, rowCount * sizeof(DirectX::XMFLOAT4), palettes, GL_STREAM_DRAW);
+		glTextureBuffer(m_BonePaletteTexture, GL_RGBA32F, m_BonePaletteBuffer);
+		m_UploadedBytes += rowCount * sizeof(DirectX::XMFLOAT4);
+	}
 
-	glBindBuffer(GL_UNIFORM_BUFFER, uboMatrices);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(data), NULL, GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindTextureUnit(BonePaletteUnit, m_BonePaletteTexture);
+}
 
-	glBindBufferRange(GL_UNIFORM_BUFFER, 0, uboMatrices, 0, sizeof(data));
+void GLShader::UpdateBoneOffset(SkinningMode mode, uint32_t boneOffset)
+{
+	// Shadowing only the header also marks the palette as changed for the next UpdateBones
+	const uint32_t header[] = { static_cast<uint32_t>(mode), 1, boneOffset };
+	m_BoneModeShadow.Update(&mode, sizeof(mode));
+	auto changed = CountUpload(m_BoneBlock.shadow.Update(header, sizeof(header)));
 
-	glBindBuffer(GL_UNIFORM_BUFFER, uboMatrices);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	if (auto destination = StreamBlock(BoneBinding, m_BoneBlock, changed, sizeof(ShaderData::BoneBuffer)))
+	{
+		std::memcpy(destination, header, sizeof(header));
+		m_UploadedBytes += offsetof(ShaderData::BoneBuffer, palette);
+	}
 }
 
-void GLShader::UpdateLights(const ShaderData::LightBuffer& data)
+void GLShader::BeginFrame()
 {
-	auto gDirectionLight = glGetUniformLocation(GetShaderId(), "gDirectionLight");
-	DirectX::XMFLOAT4 direction_light = data.mDirectionalLight.mDirection;
-	glUniform4fv(gDirectionLight, 1, reinterpret_cast<float*>(&direction_light));
-
-	auto gDiffuseLight = glGetUniformLocation(GetShaderId(), "gDiffuseLight");
-	DirectX::XMFLOAT4 diffuse_light = data.mDirectionalLight.mDiffuse;
-	glUniform4fv(gDiffuseLight, 1, reinterpret_cast<float*>(&diffuse_light));
+	m_UniformRing.BeginFrame();
+}
 
-	auto gAmbientLightLoc = glGetUniformLocation(GetShaderId(), "gAmbientLight");
-	DirectX::XMFLOAT4 ambient_light = data.mDirectionalLight.mAmbient;
-	glUniform4fv(gAmbientLightLoc, 1, reinterpret_cast<float*>(&ambient_light));
+void GLShader::EndFrame()
+{
+	m_UniformRing.EndFrame();
+}
 
-	auto gSpecularLight = glGetUniformLocation(GetShaderId(), "gSpecularLight");
-	DirectX::XMFLOAT4 specular_light = data.mDirectionalLight.mSpecular;
-	glUniform4fv(gSpecularLight, 1, reinterpret_cast<float*>(&specular_light));
+uint8_t* GLShader::StreamBlock(GLuint binding, StreamedBlock& block, bool changed, size_t size)
+{
+	// Data written in an earlier frame lives in a region that is about to be reused, so it is carried into this one
+	uint8_t* destination = nullptr;
+	if (changed || block.generation != m_UniformRing.GetGeneration())
+	{
+		auto generation = m_UniformRing.GetGeneration();
+		destination = m_UniformRing.Allocate(size, &block.offset);
+		block.generation = m_UniformRing.GetGeneration();
+
+		// Wrapping overwrote the world and light data that later draws in this frame still read
+		if (block.generation != generation)
+		{
+			RestoreBlock(WorldBinding, m_WorldBlock);
+			RestoreBlock(LightBinding, m_LightBlock);
+		}
+	}
 
-	auto gCameraPos = glGetUniformLocation(GetShaderId(), "gCameraPos");
-	auto cameraPos = data.mDirectionalLight.mCameraPos;
-	glUniform4fv(gCameraPos, 1, reinterpret_cast<float*>(&cameraPos));
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, m_UniformRing.GetBuffer(), block.offset, size);
+	return destination;
 }
 
-void GLShader::UpdateBones(const ShaderData::BoneBuffer& data)
+void GLShader::RestoreBlock(GLuint binding, StreamedBlock& block)
 {
-	auto bone_pos = glGetUniformLocation(GetShaderId(), "gBoneTransform");
-	glUniformMatrix4fv(bone_pos, 95, GL_FALSE, reinterpret_cast<const float*>(&data.transform[0]));
+	auto& data = block.shadow.GetData();
+	if (block.generation == UINT64_MAX || block.generation == m_UniformRing.GetGeneration())
+	{
+		return;
+	}
+
+	if (auto destination = StreamBlock(binding, block, false, data.size()))
+	{
+		std::memcpy(destination, data.data(), data.size());
+		m_UploadedBytes += data.size();
+	}
 }
 
 GLuint GLShader::LoadVertexShader(std::string&& vertexPath)
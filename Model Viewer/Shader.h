@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Renderer.h"
+#include "Model.h"
 #include <DirectXMath.h>
 
 namespace ShaderData
@@ -41,13 +42,41 @@ namespace ShaderData
 		DirectionalLight mDirectionalLight;
 	};
 
-	// Skeletal bones
+	// Float4 rows that fit in the bone buffer. Larger palettes are read from the bone palette buffer instead
+	constexpr size_t BonePaletteRows = 96 * 3;
+
+	// Skeletal bones. Matrix skinning sends each bone as the top three rows of its transposed affine transform,
+	// dual quaternion skinning sends the real and dual parts of each bone
 	_declspec(align(16)) struct BoneBuffer
 	{
-		DirectX::XMMATRIX transform[96];
+		uint32_t skinningMode;
+		uint32_t paletteInBuffer;
+
+		// Bone added to every instance's palette base when reading the palette buffer
+		uint32_t paletteOffset;
+		uint32_t padding;
+		DirectX::XMFLOAT4 palette[BonePaletteRows];
 	};
 }
 
+// Copy of the data last uploaded to a buffer, so updates that would write the same bytes again can be skipped
+class UploadShadow
+{
+public:
+	// Records the data and returns true if it differs from the last upload
+	bool Update(const void* data, size_t size);
+
+	// Forget the data, so the next update is always uploaded
+	void Invalidate() { m_Valid = false; }
+
+	// The data last uploaded
+	const std::vector<uint8_t>& GetData() const { return m_Data; }
+
+private:
+	std::vector<uint8_t> m_Data;
+	bool m_Valid = false;
+};
+
 // Shader interface
 class IShader
 {
@@ -58,17 +87,60 @@ public:
 	// Create shaders
 	virtual bool Create() = 0;
 
-	// Apply shaders to the pipeline
-	virtual void Use() = 0;
-
 	// Update World
 	virtual void UpdateWorld(const ShaderData::WorldBuffer& data) = 0;
 
 	// Update Lights
 	virtual void UpdateLights(const ShaderData::LightBuffer& data) = 0;
 
-	// Update bone data
-	virtual void UpdateBones(const ShaderData::BoneBuffer& data) = 0;
+	// Update bone data. Only the palette rows given are uploaded
+	virtual void UpdateBones(SkinningMode mode, const DirectX::XMFLOAT4* palette, size_t rowCount) = 0;
+
+	// Upload the palettes of every instance to the palette buffer for instanced draws. Each instance reads
+	// its bones from its palette base plus the bone offset of the subsets being drawn
+	virtual void UpdateInstancePalettes(const DirectX::XMFLOAT4* palettes, size_t rowCount) = 0;
+	virtual void UpdateBoneOffset(SkinningMode mode, uint32_t boneOffset) = 0;
+
+	// Frame boundaries, around every update and draw of a frame
+	virtual void BeginFrame() = 0;
+	virtual void EndFrame() = 0;
+
+	// Buffer uploads performed and skipped, and bytes written, since the counters were last reset
+	UpdateCounters GetUploads() const { return m_Uploads; }
+	size_t GetUploadedBytes() const { return m_UploadedBytes; }
+	void ResetUploads() { m_Uploads = {}; m_UploadedBytes = 0; }
+
+protected:
+	// Counts an update and returns whether its data needs uploading
+	bool CountUpload(bool changed);
+
+	UpdateCounters m_Uploads;
+	size_t m_UploadedBytes = 0;
+};
+
+// Dynamic constant buffer suballocated per draw. Space is appended with MAP_WRITE_NO_OVERWRITE and the
+// whole buffer is discarded when it wraps, so the driver renames it rather than waiting on the GPU
+class DXConstantRing
+{
+public:
+	// Without constant buffer offsets every allocation discards the buffer and starts at the beginning
+	bool Create(DXRenderer* renderer, size_t size, bool offsets);
+
+	// Map space for the data. Returns where to write it, which stays mapped until Unmap
+	uint8_t* Map(size_t size, UINT* firstConstant, UINT* numConstants);
+	void Unmap();
+
+	// Changes whenever the buffer is discarded, so ranges written before it can be recognised
+	constexpr uint64_t GetGeneration() { return m_Generation; }
+	ID3D11Buffer* GetBuffer() const { return m_Buffer.Get(); }
+
+private:
+	DXRenderer* m_Renderer = nullptr;
+	ComPtr<ID3D11Buffer> m_Buffer = nullptr;
+	size_t m_Size = 0;
+	size_t m_Offset = 0;
+	bool m_Offsets = false;
+	uint64_t m_Generation = 0;
 };
 
 // Direct3D 11 shader
@@ -81,9 +153,6 @@ public:
 	// Create shaders
 	bool Create() override;
 
-	// Apply shaders to the pipeline
-	void Use() override;
-
 	// Update World
 	virtual void UpdateWorld(const ShaderData::WorldBuffer& data) override;
 
@@ -91,7 +160,20 @@ public:
 	virtual void UpdateLights(const ShaderData::LightBuffer& data) override;
 
 	// Update bone data
-	virtual void UpdateBones(const ShaderData::BoneBuffer& data) override;
+	virtual void UpdateBones(SkinningMode mode, const DirectX::XMFLOAT4* palette, size_t rowCount) override;
+
+	// Update instance palettes
+	virtual void UpdateInstancePalettes(const DirectX::XMFLOAT4* palettes, size_t rowCount) override;
+	virtual void UpdateBoneOffset(SkinningMode mode, uint32_t boneOffset) override;
+
+	// Frame boundaries
+	virtual void BeginFrame() override;
+	virtual void EndFrame() override;
+
+	// Shader objects, bundled into pipeline states by the renderer
+	constexpr ComPtr<ID3D11InputLayout>& GetVertexLayout() { return m_VertexLayout; }
+	constexpr ComPtr<ID3D11VertexShader>& GetVertexShader() { return m_VertexShader; }
+	constexpr ComPtr<ID3D11PixelShader>& GetPixelShader() { return m_PixelShader; }
 
 private:
 	DXRenderer* m_Renderer = nullptr;
@@ -104,9 +186,88 @@ private:
 	bool CreatePixelShader(const std::string& pixel_shader_path);
 
 
-	ComPtr<ID3D11Buffer> m_WorldBuffer = nullptr;
-	ComPtr<ID3D11Buffer> m_LightBuffer = nullptr;
-	ComPtr<ID3D11Buffer> m_BoneConstantBuffer = nullptr;
+	// Constant buffers. With constant buffer offsets every slot shares the first ring, otherwise
+	// each slot has a ring of its own that is discarded on every update
+	ComPtr<ID3D11DeviceContext1> m_DeviceContext1 = nullptr;
+	bool m_ConstantBufferOffsets = false;
+	std::array<DXConstantRing, 3> m_ConstantRings;
+
+	struct StreamedConstants
+	{
+		// Data last written and the constants it was written to
+		UploadShadow shadow;
+		UINT firstConstant = 0;
+		UINT numConstants = 0;
+		uint64_t generation = UINT64_MAX;
+	};
+
+	// Writes the data with write(destination) unless the range already written can be reused, then binds the range
+	template <typename Write>
+	void StreamConstants(UINT slot, bool pixelShader, StreamedConstants& block, bool changed, size_t size, Write&& write);
+
+	// Writes a block again from its last data if the ring has been discarded since
+	void RestoreConstants(UINT slot, bool pixelShader, StreamedConstants& block);
+
+	StreamedConstants m_WorldConstants;
+	StreamedConstants m_LightConstants;
+	StreamedConstants m_BoneConstants;
+	UploadShadow m_BoneModeShadow;
+	UploadShadow m_InstancePaletteShadow;
+
+	// Range bound to each slot, so unchanged bindings are not set again
+	struct BoundConstants
+	{
+		ID3D11Buffer* buffer = nullptr;
+		UINT firstConstant = 0;
+	};
+
+	std::array<BoundConstants, 3> m_BoundConstants;
+
+	// Structured buffer for palettes too large for the bone constant buffer
+	void UpdateBonePaletteBuffer(const DirectX::XMFLOAT4* palette, size_t rowCount);
+	ComPtr<ID3D11Buffer> m_BonePaletteBuffer = nullptr;
+	ComPtr<ID3D11ShaderResourceView> m_BonePaletteView = nullptr;
+	size_t m_BonePaletteCapacity = 0;
+};
+
+// Persistently mapped uniform buffer streamed through by the CPU. The buffer is split into one region
+// per frame in flight, each fenced when its frame ends and waited on before it is written again
+class GLUniformRing
+{
+public:
+	GLUniformRing() = default;
+	~GLUniformRing();
+	GLUniformRing& operator=(const GLUniformRing&) = delete;
+	GLUniformRing(const GLUniformRing&) = delete;
+
+	// Create the buffer with the given space per frame
+	bool Create(size_t frameSize);
+
+	// Reserve space in the current frame's region at the uniform buffer offset alignment. Returns where to write the data
+	uint8_t* Allocate(size_t size, GLintptr* offset);
+
+	// Move on to the next region, waiting for the GPU if it is still reading it
+	void BeginFrame();
+
+	// Fence the current region once all of its draws are submitted
+	void EndFrame();
+
+	// Changes every frame and whenever earlier data in the region is overwritten, so stale offsets can be recognised
+	constexpr uint64_t GetGeneration() { return m_Generation; }
+	constexpr GLuint GetBuffer() { return m_Buffer; }
+
+private:
+	static constexpr size_t FrameCount = 3;
+
+	GLuint m_Buffer = 0;
+	uint8_t* m_Data = nullptr;
+	size_t m_FrameSize = 0;
+	size_t m_Alignment = 256;
+
+	size_t m_Region = 0;
+	size_t m_Offset = 0;
+	uint64_t m_Generation = 0;
+	std::array<GLsync, FrameCount> m_Fences = {};
 };
 
 // OpenGL 4 shader
@@ -119,9 +280,6 @@ public:
 	// Create shaders
 	bool Create() override;
 
-	// Apply shaders to the pipeline
-	void Use() override;
-
 	// Update World
 	virtual void UpdateWorld(const ShaderData::WorldBuffer& data) override;
 
@@ -129,7 +287,15 @@ public:
 	virtual void UpdateLights(const ShaderData::LightBuffer& data) override;
 
 	// Update bone data
-	virtual void UpdateBones(const ShaderData::BoneBuffer& data) override;
+	virtual void UpdateBones(SkinningMode mode, const DirectX::XMFLOAT4* palette, size_t rowCount) override;
+
+	// Update instance palettes
+	virtual void UpdateInstancePalettes(const DirectX::XMFLOAT4* palettes, size_t rowCount) override;
+	virtual void UpdateBoneOffset(SkinningMode mode, uint32_t boneOffset) override;
+
+	// Frame boundaries
+	virtual void BeginFrame() override;
+	virtual void EndFrame() override;
 
 	constexpr GLuint GetShaderId() { return m_ShaderId; }
 
@@ -140,6 +306,34 @@ private:
 	GLuint m_VertexShader = -1;
 	GLuint m_FragmentShader = -1;
 
+	// Uniform blocks, all streamed through the ring
+	GLUniformRing m_UniformRing;
+
+	struct StreamedBlock
+	{
+		// Data last written and where it was written
+		UploadShadow shadow;
+		GLintptr offset = 0;
+		uint64_t generation = UINT64_MAX;
+	};
+
+	// Binds the block to its binding point. Unchanged data already written this frame is bound again
+	// without another copy. Returns where to write the data, or nullptr when the existing copy is reused
+	uint8_t* StreamBlock(GLuint binding, StreamedBlock& block, bool changed, size_t size);
+
+	// Writes a block again from its last data if the ring has wrapped since
+	void RestoreBlock(GLuint binding, StreamedBlock& block);
+
+	StreamedBlock m_WorldBlock;
+	StreamedBlock m_LightBlock;
+	StreamedBlock m_BoneBlock;
+	UploadShadow m_BoneModeShadow;
+	UploadShadow m_InstancePaletteShadow;
+
+	// Texture buffer for palettes too large for the bone uniforms
+	GLuint m_BonePaletteBuffer = 0;
+	GLuint m_BonePaletteTexture = 0;
+
 	GLuint LoadVertexShader(std::string&& vertexPath);
 	GLuint LoadFragmentShader(std::string&& fragmentPath);
 	std::string ReadShader(std::string&& filename);
@@ -0,0 +1,55 @@
+#include "Pch.h"
+#include "Simd.h"
+#include <intrin.h>
+
+namespace
+{
+	SimdPath DetectPath()
+	{
+		// The wider paths need the CPU feature and the OS saving the wider registers
+		std::array<int, 4> info{};
+		__cpuid(info.data(), 0);
+		auto max_id = info[0];
+
+		__cpuid(info.data(), 1);
+		auto osxsave = (info[2] & (1 << 27)) != 0;
+		auto avx = (info[2] & (1 << 28)) != 0;
+		auto fma = (info[2] & (1 << 12)) != 0;
+		if (!osxsave || !avx || max_id < 7)
+			return SimdPath::SSE;
+
+		auto xcr0 = _xgetbv(0);
+		__cpuidex(info.data(), 7, 0);
+		auto avx2 = (info[1] & (1 << 5)) != 0;
+		auto avx512 = (info[1] & (1 << 16)) != 0;
+
+		if (avx512 && (xcr0 & 0xe6) == 0xe6)
+			return SimdPath::AVX512;
+
+		if (avx2 && fma && (xcr0 & 0x6) == 0x6)
+			return SimdPath::AVX2;
+
+		return SimdPath::SSE;
+	}
+}
+
+SimdPath Simd::GetBestPath()
+{
+	static const auto path = DetectPath();
+	return path;
+}
+
+const char* Simd::GetPathName(SimdPath path)
+{
+	switch (path)
+	{
+	case SimdPath::SSE:
+		return "SSE";
+	case SimdPath::AVX2:
+		return "AVX2";
+	case SimdPath::AVX512:
+		return "AVX-512";
+	default:
+		return "Scalar";
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <immintrin.h>
+
+// Instruction sets the SIMD kernels can run with, widest last
+enum class SimdPath
+{
+	Scalar,
+	SSE,
+	AVX2,
+	AVX512
+};
+
+///<summary>
+/// Each SIMD type exposes the same few operations, so a kernel written once
+/// as a template runs with any of them. Masks hold a comparison per lane,
+/// and Select takes b in the lanes a mask is set and a elsewhere.
+///</summary>
+namespace Simd
+{
+	struct ScalarLanes
+	{
+		using Float = float;
+		using Mask = bool;
+		static constexpr size_t Width = 1;
+		static Float Load(const float* data) { return *data; }
+		static void Store(float* data, Float value) { *data = value; }
+		static Float Set(float value) { return value; }
+		static Float Add(Float a, Float b) { return a + b; }
+		static Float MulAdd(Float a, Float b, Float c) { return a * b + c; }
+		static Float Min(Float a, Float b) { return std::min(a, b); }
+		static Float Max(Float a, Float b) { return std::max(a, b); }
+		static Mask GreaterEqual(Float a, Float b) { return a >= b; }
+		static Mask And(Mask a, Mask b) { return a && b; }
+		static unsigned Bits(Mask mask) { return mask ? 1u : 0u; }
+		static Float Select(Mask mask, Float a, Float b) { return mask ? b : a; }
+	};
+
+	struct SSELanes
+	{
+		using Float = __m128;
+		using Mask = __m128;
+		static constexpr size_t Width = 4;
+		static Float Load(const float* data) { return _mm_loadu_ps(data); }
+		static void Store(float* data, Float value) { _mm_storeu_ps(data, value); }
+		static Float Set(float value) { return _mm_set1_ps(value); }
+		static Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+		static Float MulAdd(Float a, Float b, Float c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+		static Float Min(Float a, Float b) { return _mm_min_ps(a, b); }
+		static Float Max(Float a, Float b) { return _mm_max_ps(a, b); }
+		static Mask GreaterEqual(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+		static Mask And(Mask a, Mask b) { return _mm_and_ps(a, b); }
+		static unsigned Bits(Mask mask) { return static_cast<unsigned>(_mm_movemask_ps(mask)); }
+		static Float Select(Mask mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a)); }
+	};
+
+	struct AVX2Lanes
+	{
+		using Float = __m256;
+		using Mask = __m256;
+		static constexpr size_t Width = 8;
+		static Float Load(const float* data) { return _mm256_loadu_ps(data); }
+		static void Store(float* data, Float value) { _mm256_storeu_ps(data, value); }
+		static Float Set(float value) { return _mm256_set1_ps(value); }
+		static Float Add(Float a, Float b) { return _mm256_add_ps(a, b); }
+		static Float MulAdd(Float a, Float b, Float c) { return _mm256_fmadd_ps(a, b, c); }
+		static Float Min(Float a, Float b) { return _mm256_min_ps(a, b); }
+		static Float Max(Float a, Float b) { return _mm256_max_ps(a, b); }
+		static Mask GreaterEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+		static Mask And(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+		static unsigned Bits(Mask mask) { return static_cast<unsigned>(_mm256_movemask_ps(mask)); }
+		static Float Select(Mask mask, Float a, Float b) { return _mm256_blendv_ps(a, b, mask); }
+	};
+
+	struct AVX512Lanes
+	{
+		using Float = __m512;
+		using Mask = __mmask16;
+		static constexpr size_t Width = 16;
+		static Float Load(const float* data) { return _mm512_loadu_ps(data); }
+		static void Store(float* data, Float value) { _mm512_storeu_ps(data, value); }
+		static Float Set(float value) { return _mm512_set1_ps(value); }
+		static Float Add(Float a, Float b) { return _mm512_add_ps(a, b); }
+		static Float MulAdd(Float a, Float b, Float c) { return _mm512_fmadd_ps(a, b, c); }
+		static Float Min(Float a, Float b) { return _mm512_min_ps(a, b); }
+		static Float Max(Float a, Float b) { return _mm512_max_ps(a, b); }
+		static Mask GreaterEqual(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+		static Mask And(Mask a, Mask b) { return static_cast<Mask>(a & b); }
+		static unsigned Bits(Mask mask) { return static_cast<unsigned>(mask); }
+		static Float Select(Mask mask, Float a, Float b) { return _mm512_mask_blend_ps(mask, a, b); }
+	};
+
+	// Widest path the CPU and operating system support
+	SimdPath GetBestPath();
+
+	const char* GetPathName(SimdPath path);
+
+	// Calls function with the lanes of the path, as function(Simd::SSELanes()) and so on
+	template <typename Function>
+	auto Dispatch(SimdPath path, Function&& function)
+	{
+		switch (path)
+		{
+		case SimdPath::SSE:
+			return function(SSELanes());
+		case SimdPath::AVX2:
+			return function(AVX2Lanes());
+		case SimdPath::AVX512:
+			return function(AVX512Lanes());
+		default:
+			return function(ScalarLanes());
+		}
+	}
+}